@@ -6,40 +6,53 @@
  * @author Michal Smahel (xsmahe01)
  */
 
+#define _GNU_SOURCE // mremap
 #include "mmal.h"
-#include <sys/mman.h> // mmap
+#include <sys/mman.h> // mmap, mremap
 #include <stdbool.h> // bool
 #include <assert.h> // assert
 #include <string.h> // memcpy
+#include <stdint.h> // uint64_t, SIZE_MAX
+#include <errno.h> // EINVAL, ENOMEM
+#include <stdlib.h> // getenv
+#include <execinfo.h> // backtrace
+#include <fcntl.h> // open
+#include <signal.h> // sigaction, sig_atomic_t
+#include <unistd.h> // write, read, close
+#include <time.h> // clock_gettime
+#ifdef MMAL_THREADS
+#include <pthread.h> // pthread_mutex_t, pthread_key_t
+#endif
 
 #ifdef NDEBUG
 /**
- * The structure header encapsulates data of a single memory block.
+ * The structure header encapsulates data of a single memory block. It's
+ * a single word: the size of the whole block (header included), which is
+ * a multiple of ALIGNMENT, and flags in its lowest bits (see HDR_FLAGS).
+ * Blocks are placed so that their data are aligned to ALIGNMENT.
+ * A free block has links to its bin (see FreeLinks) at the start of its data
+ * and a copy of its size (footer) in the last word, so the following block
+ * can find it in a constant time.
  */
 /*
- *   ---+------+----------------------------+---
- *      |Header|DDD not_free DDDDD...free...|
- *   ---+------+-----------------+----------+---
- *             |-- Header.asize -|
- *             |-- Header.size -------------|
+ *   ---+------+-------------------------------+------+---
+ *      |Header|DDD not_free DDDDD...unused....|Header|...
+ *   ---+------+-------------------------------+------+---
+ *      |-- Header.size -----------------------|
+ *
+ *   ---+------+---------+-----------+------+------+---
+ *      |Header|FreeLinks|...free....|footer|Header|...
+ *   ---+------+---------+-----------+------+------+---
+ *                                      \--- size of the free block
  */
 typedef struct header Header;
 struct header {
 
     /**
-     * Pointer to the next header. Cyclic list. If there is no other block,
-     * points to itself.
+     * Size of the block including the header. The lowest bits hold flags,
+     * use HDR_SIZE() or BLOCK_SIZE() for reading the size.
      */
-    Header *next;
-
-    /// size of the block
     size_t size;
-
-    /**
-     * Size of block in bytes allocated for program. asize=0 means the block 
-     * is not used by a program.
-     */
-    size_t asize;
 };
 
 /**
@@ -48,12 +61,15 @@ struct header {
 /*
  *   /--- arena metadata
  *   |     /---- header of the first block
- *   v     v
- *   +-----+------+-----------------------------+
- *   |Arena|Header|.............................|
- *   +-----+------+-----------------------------+
+ *   |     |                                 /---- fence (used block of size 0)
+ *   v     v                                 v
+ *   +-----+-+------+--------------------+-----+-+
+ *   |Arena| |Header|....................|Fence| |
+ *   +-----+-+------+--------------------+-----+-+
+ *        ^                                 /
+ *        \------------- arena ------------/
  *
- *   |--------------- Arena.size ---------------|
+ *   |--------------- Arena.size ----------------|
  */
 typedef struct arena Arena;
 struct arena {
@@ -72,8 +88,137 @@ struct arena {
  */
 #define PAGE_SIZE (128*1024)
 
+/**
+ * Alignment of data of all blocks (as required by the malloc ABI)
+ */
+#define ALIGNMENT 16
+
+/**
+ * Flag in Header.size: the block is used by the program (or it's the fence)
+ */
+#define HDR_USED ((size_t)4)
+
+/**
+ * All bits of Header.size reserved for flags (sizes are multiples of ALIGNMENT)
+ */
+#define HDR_FLAGS ((size_t)(ALIGNMENT - 1))
+
+/**
+ * Gives the first header of arena (its data are aligned to ALIGNMENT)
+ * @param arena Arena for which to search for the header
+ */
+#define FIRST_HEADER(arena) ((Header *)((char *)(arena) + ARENA_HEADER_OFFSET))
+
 #endif // NDEBUG
 
+/**
+ * Metadata of a huge block, which has its own mapping outside all arenas.
+ * Huge blocks are linked together, but they are never searched for free space.
+ */
+/*
+ *   +---------+-+------+-----------------------------+
+ *   |HugeBlock| |Header|XXXXXXXXXXXXXXXXXXXXXXXXXXXXX|
+ *   +---------+-+------+-----------------------------+
+ *
+ *   Aligned huge block:
+ *
+ *   +---------+---------+-+------+---------------------+
+ *   |.........|HugeBlock| |Header|XXXXXXXXXXXXXXXXXXXXX|
+ *   +---------+---------+-+------+---------------------+
+ *                              aligned ^
+ *
+ *   |------------ HugeBlock.size --------------------|
+ */
+typedef struct sample Sample;
+
+typedef struct huge_block HugeBlock;
+struct huge_block {
+
+    /// Next huge block (NULL for the last one)
+    HugeBlock *next;
+
+    /// Previous huge block (NULL for the first one)
+    HugeBlock *prev;
+
+    /// Size of the whole mapping (see HUGE_MAP())
+    size_t size;
+
+    /// Sample of the heap profiler (NULL if the block isn't sampled)
+    Sample *sample;
+};
+
+/// Maximum number of frames of call stacks of samples
+#define SAMPLE_DEPTH 30
+
+/**
+ * Allocation sampled by the heap profiler with its call stack (see
+ * mmal_set_sample_interval()). Sampled data always get their own mapping
+ * (a huge block), so only frees of huge blocks check for samples.
+ */
+struct sample {
+
+    /// Next live sample (or the next free record)
+    Sample *next;
+
+    /// Previous live sample
+    Sample *prev;
+
+    /// Requested size of the sampled data
+    size_t size;
+
+    /// Number of frames of the call stack
+    int depth;
+
+    /// Return addresses of the call stack, the innermost first
+    void *frames[SAMPLE_DEPTH];
+};
+
+/**
+ * Metadata of a run of equal-size slots for small objects. Slots don't have
+ * any header, their run is found by masking of the address (see RUN_OF()).
+ */
+/*
+ *   /--- SLAB_RUN_SIZE aligned
+ *   v
+ *   +-------+----+----+----+----+----+----+-------------------------+
+ *   |SlabRun|XXXX|....|XXXX|XXXX|....|XXXX|....never used slots.....|
+ *   +-------+----+----+----+----+----+----+-------------------------+
+ *                 ^ \_______free_slots___/ ^ bump
+ *                  \______________________/
+ */
+typedef struct slab_run SlabRun;
+struct slab_run {
+
+    /// Next run of the same class with free slots (or the next free run)
+    SlabRun *next;
+
+    /// Previous run of the same class with free slots (or the previous free
+    /// run)
+    SlabRun *prev;
+
+    /// Freed slots (linked through their first word)
+    void *free_slots;
+
+    /// First slot which has never been used
+    char *bump;
+
+    /// Size of slots
+    unsigned slot_size;
+
+    /// Index of the size class (SLAB_POOL for free runs)
+    unsigned size_class;
+
+    /// Number of used slots
+    unsigned used;
+
+    /// Number of runs without used slots (only in the first run of a slab
+    /// arena)
+    unsigned empty_runs;
+
+    /// Next slab arena of the heap (only in the first run of a slab arena)
+    SlabRun *next_arena;
+};
+
 /**
  * mmap's protection flags
  */
@@ -83,9 +228,244 @@ struct arena {
  */
 #define MMAP_FLAGS (MAP_PRIVATE|MAP_ANONYMOUS)
 /**
- * Minimum size of memory block assigned to caller program
+ * Minimum size of data of a block, so the block can hold its FreeLinks and
+ * footer when it's free
+ */
+#define MIN_BLOCK_SIZE (ALIGN(sizeof(Header) + sizeof(FreeLinks) + sizeof(size_t), ALIGNMENT) - sizeof(Header))
+/**
+ * Flag in Header.size: the physically previous block is free, so there is
+ * its footer right before the header
+ */
+#define HDR_PREV_FREE ((size_t)1)
+/**
+ * Flag in Header.size: the block has its own mapping (see HugeBlock)
+ */
+#define HDR_MMAPPED ((size_t)2)
+/**
+ * Flag in Header.size of a free block: its data from ZERO_FROM() up to the
+ * footer have never been touched since they were mapped, so they are zero
+ */
+#define HDR_ZERO ((size_t)8)
+/**
+ * Flag in Header.size of a free block: its pages have been returned to the OS
+ * (see heap_purge()). Free blocks never have their own mapping, so the bit
+ * of HDR_MMAPPED is reused. hdr_mark_used() clears it.
+ */
+#define HDR_PURGED HDR_MMAPPED
+/**
+ * Offset of the first header in arena, so its data are aligned
+ */
+#define ARENA_HEADER_OFFSET (ALIGN(sizeof(Arena) + sizeof(Header), ALIGNMENT) - sizeof(Header))
+/**
+ * Offset of the fence from the end of arena (the fence follows an aligned block)
+ */
+#define FENCE_OFFSET (ALIGN(sizeof(Fence) - sizeof(Header), ALIGNMENT) + sizeof(Header))
+/**
+ * Size of the arena's memory used for metadata (arena, first header and fence)
+ */
+#define ARENA_OVERHEAD (ARENA_HEADER_OFFSET + sizeof(Header) + FENCE_OFFSET)
+/**
+ * Offset of data in a chunk of a region (the first chunk holds the region
+ * itself before its data)
+ */
+#define REGION_DATA_OFFSET ALIGN(sizeof(Arena), MMAL_REGION_ALIGNMENT)
+/**
+ * Default number of completely free arenas kept mapped for later use
+ */
+#ifndef MMAL_ARENA_CACHE
+#define MMAL_ARENA_CACHE 2
+#endif
+/**
+ * Maximal size of arenas mapped for new blocks (arenas grow geometrically
+ * with the heap up to this size)
+ */
+#ifndef MMAL_ARENA_MAX_SIZE
+#define MMAL_ARENA_MAX_SIZE (256*PAGE_SIZE)
+#endif
+/**
+ * Default number of bytes freed next to large free blocks between two purges
+ * of their pages (see heap_purge())
+ */
+#ifndef MMAL_PURGE_INTERVAL
+#define MMAL_PURGE_INTERVAL (4*1024*1024)
+#endif
+/**
+ * Free blocks from this size have their pages purged
+ */
+#define PURGE_MIN_SIZE (64*1024)
+/**
+ * Default size from which a block gets its own mapping
+ */
+#ifndef MMAL_MMAP_THRESHOLD
+#define MMAL_MMAP_THRESHOLD PAGE_SIZE
+#endif
+/**
+ * Granularity of mappings of huge blocks
+ */
+#define OS_PAGE_SIZE 4096
+/**
+ * Size of huge pages of the hardware (transparent or from hugetlbfs), arenas
+ * using them are aligned to it
+ */
+#define OS_HUGE_PAGE_SIZE (2*1024*1024)
+/**
+ * Offset of the header of a huge block in its mapping, so its data are aligned
+ */
+#define HUGE_HEADER_OFFSET (ALIGN(sizeof(HugeBlock) + sizeof(Header), ALIGNMENT) - sizeof(Header))
+/**
+ * Size of the huge block's mapping used for metadata
+ */
+#define HUGE_OVERHEAD (HUGE_HEADER_OFFSET + sizeof(Header))
+
+/**
+ * Size classes of free blocks
+ */
+/*
+ *   block size:  32 48 64 ... 1008 | 1024 ...
+ *   bin:          2  3  4 ...   63 | tree of large blocks (exact best fit)
+ *                \__ exact bins __/
+ *
+ * With MMAL_LARGE_BINS, large blocks go to geometric bins instead of the tree:
+ *
+ *   block size:  ... 1008 | 1024 1280 1536 1792 | 2048 2560 ...
+ *   bin:         ...   63 |   64   65   66   67 |   68   69 ...
+ *                         \__ 4 bins per power of two (geometric) ...
+ */
+/// Step between sizes of the exact (small) bins
+#define BIN_STEP ALIGNMENT
+/// log2 of the first size which goes to geometric bins
+#define SMALL_BIN_LOG2 10
+/// Blocks smaller than this go to exact bins
+#define SMALL_BIN_LIMIT (1UL << SMALL_BIN_LOG2)
+/// Number of exact bins
+#define SMALL_BIN_COUNT (SMALL_BIN_LIMIT / BIN_STEP)
+/// log2 of the number of bins every power of two is split into
+#define SUB_BIN_LOG2 2
+/// Number of bins every power of two is split into
+#define SUB_BIN_COUNT (1UL << SUB_BIN_LOG2)
+#ifdef MMAL_LARGE_BINS
+/// Total number of bins
+#define BIN_COUNT (SMALL_BIN_COUNT + (64 - SMALL_BIN_LOG2) * SUB_BIN_COUNT)
+/// Blocks from this size go to the tree (never)
+#define TREE_MIN_SIZE SIZE_MAX
+#else
+/// Total number of bins
+#define BIN_COUNT SMALL_BIN_COUNT
+/// Blocks from this size go to the tree
+#define TREE_MIN_SIZE SMALL_BIN_LIMIT
+#endif
+/// Number of words of the bitmap of non-empty bins
+#define BIN_MAP_WORDS ((BIN_COUNT + 63) / 64)
+/// Returned by bin_map_find() when there is no suitable non-empty bin
+#define NO_BIN BIN_COUNT
+/// Maximum number of recently freed small blocks of one size kept unmerged
+/// (see quick_free())
+#define QUICK_LIMIT 16
+
+/**
+ * Slab arenas for small objects
+ */
+/// Biggest object allocated from slab arenas
+#define SLAB_MAX_SIZE 256
+/// Step of the table of slab size classes
+#define SLAB_STEP 16
+/// Number of slab size classes
+#define SLAB_CLASSES 12
+/// log2 of the size (and the alignment) of slab arenas
+#define SLAB_ARENA_LOG2 20
+/// Size (and the alignment) of slab arenas
+#define SLAB_ARENA_SIZE (1UL << SLAB_ARENA_LOG2)
+/// log2 of the size (and the alignment) of runs of equal-size slots
+#define SLAB_RUN_LOG2 16
+/// Size (and the alignment) of runs of equal-size slots
+#define SLAB_RUN_SIZE (1UL << SLAB_RUN_LOG2)
+/// Number of runs of a slab arena
+#define SLAB_ARENA_RUNS (SLAB_ARENA_SIZE / SLAB_RUN_SIZE)
+/// Size class of runs in the pool of free runs
+#define SLAB_POOL SLAB_CLASSES
+/// Number of bits of user space addresses
+#define ADDRESS_BITS 48
+/// Number of bits of the map of slab arenas (one bit per SLAB_ARENA_SIZE)
+#define SLAB_MAP_BITS (1UL << (ADDRESS_BITS - SLAB_ARENA_LOG2))
+
+#ifdef MMAL_THREADS
+/**
+ * Thread caches of freed blocks
+ */
+/// Biggest block (in bytes) held by thread caches
+#define TCACHE_MAX_SIZE 1024
+/// Step between usable sizes of thread cache classes (slots and blocks
+/// differ in the usable size even when they fall to the same bin)
+#define TCACHE_STEP sizeof(size_t)
+/// Number of size classes of a thread cache (one per TCACHE_STEP)
+#define TCACHE_CLASSES ((TCACHE_MAX_SIZE + ALIGNMENT) / TCACHE_STEP + 1)
+/// Maximum number of blocks in one class of a thread cache
+#define TCACHE_LIMIT 32
+/// Number of blocks moved between a thread cache and arenas at once
+#define TCACHE_BATCH (TCACHE_LIMIT / 2)
+/// Number of remotely freed blocks sorted and freed at once
+#define REMOTE_BATCH 64
+#endif // MMAL_THREADS
+
+/**
+ * Heap profiler
+ */
+/// Bytes allocated by a thread between checks whether the profiler has been
+/// enabled (the countdown of a disabled profiler)
+#define SAMPLE_RECHECK (1024*1024)
+/// Size of chunks of records of samples (they are never unmapped)
+#define SAMPLE_CHUNK (16*OS_PAGE_SIZE)
+/// Maximum number of mappings of freed samples kept for next samples
+#define SAMPLE_MAP_CACHE 16
+/// Biggest mapping of a freed sample which is kept
+#define SAMPLE_MAP_MAX (16*OS_PAGE_SIZE)
+/// Buffer of the writer of profiles
+#define PROFILE_BUFFER 4096
+/// Maximum length of the path of profiles dumped on a signal
+#define PROFILE_PATH_MAX 4096
+
+/**
+ * Locking of arenas, bins and all the other data of a heap, of the list
+ * of heaps and of samples of the profiler (MMAL_THREADS only)
+ */
+#ifdef MMAL_THREADS
+#define HEAP_LOCK(heap) pthread_mutex_lock(&(heap)->lock)
+#define HEAP_UNLOCK(heap) pthread_mutex_unlock(&(heap)->lock)
+#define HEAPS_LOCK() pthread_mutex_lock(&heaps_lock)
+#define HEAPS_UNLOCK() pthread_mutex_unlock(&heaps_lock)
+#define PROFILE_LOCK() pthread_mutex_lock(&profile_lock)
+#define PROFILE_UNLOCK() pthread_mutex_unlock(&profile_lock)
+#else
+#define HEAP_LOCK(heap)
+#define HEAP_UNLOCK(heap)
+#define HEAPS_LOCK()
+#define HEAPS_UNLOCK()
+#define PROFILE_LOCK()
+#define PROFILE_UNLOCK()
+#endif
+
+/**
+ * Instrumentation (MMAL_INSTRUMENT only, see mmal_instrument_read()).
+ * System calls for mappings are counted by macros of their names. mmalloc(),
+ * mfree() and mrealloc() are renamed here and wrapped by timed functions
+ * at the end of the file, so their inner calls aren't timed twice.
  */
-#define MIN_BLOCK_SIZE 32
+#ifdef MMAL_INSTRUMENT
+#define INSTRUMENT_COUNT(counter) __atomic_fetch_add(&instrument.counter, 1, __ATOMIC_RELAXED)
+#define INSTRUMENT_HISTOGRAM(histogram, value) instrument_add(instrument.histogram, (value))
+#define mmap(...) (INSTRUMENT_COUNT(mmaps), mmap(__VA_ARGS__))
+#define munmap(...) (INSTRUMENT_COUNT(munmaps), munmap(__VA_ARGS__))
+#define mremap(...) (INSTRUMENT_COUNT(mremaps), mremap(__VA_ARGS__))
+#define madvise(...) (INSTRUMENT_COUNT(madvises), madvise(__VA_ARGS__))
+#define mmalloc untimed_mmalloc
+#define mfree untimed_mfree
+#define mrealloc untimed_mrealloc
+static void *mmalloc(size_t size);
+static void mfree(void *ptr);
+static void *mrealloc(void *ptr, size_t size);
+#else
+#define INSTRUMENT_HISTOGRAM(histogram, value) ((void)(value))
+#endif
 
 /**
  * Finds maximum of two numbers
@@ -93,6 +473,12 @@ struct arena {
  * @param second Second number
  */
 #define MAX(first, second) (((first) > (second)) ? (first) : (second))
+/**
+ * Finds minimum of two numbers
+ * @param first First number
+ * @param second Second number
+ */
+#define MIN(first, second) (((first) < (second)) ? (first) : (second))
 /**
  * Aligns number to the alignment
  * @param number Number to be aligned
@@ -100,400 +486,4532 @@ struct arena {
  */
 #define ALIGN(number, alignment) (((number) + (alignment) - 1) / (alignment) * (alignment))
 /**
- * Gives the first header of arena
- * @param arena Arena for which to search for the header
+ * Gives the arena of its first header
+ * @param hdr First header of the arena
+ */
+#define HEADER_ARENA(hdr) ((Arena *)((char *)(hdr) - ARENA_HEADER_OFFSET))
+/**
+ * Gives the next header
+ * @param current Current header
+ * @param offset Offset from the end of current header (or size stored in current header)
+ */
+#define NEXT_HEADER(current, offset) ((Header *)((char *)(current) + sizeof(Header) + (offset)))
+/**
+ * Gives size of the whole block (header included) without flags
+ * @param hdr Header of the block
+ */
+#define BLOCK_SIZE(hdr) ((hdr)->size & ~HDR_FLAGS)
+/**
+ * Gives size of data of the block
+ * @param hdr Header of the block (not the fence)
+ */
+#define HDR_SIZE(hdr) (BLOCK_SIZE(hdr) - sizeof(Header))
+/**
+ * Sets size of data of the block, flags are kept
+ * @param hdr Header of the block
+ * @param data_size New size of data
+ */
+#define HDR_SET_SIZE(hdr, data_size) ((hdr)->size = ((data_size) + sizeof(Header)) | ((hdr)->size & HDR_FLAGS))
+/**
+ * Checks if the block is free
+ * @param hdr Header of the block
+ */
+#define HDR_IS_FREE(hdr) (((hdr)->size & HDR_USED) == 0)
+/**
+ * Gives size of data of a block for the requested size. The whole block is
+ * a multiple of ALIGNMENT, so the data of the next block are aligned, too.
+ * @param size Requested size
+ */
+#define BLOCK_DATA_SIZE(size) MAX(ALIGN((size) + sizeof(Header), ALIGNMENT) - sizeof(Header), MIN_BLOCK_SIZE)
+/**
+ * Remembers the size requested by the program (DEBUG mode only)
+ * @param hdr Header of the block
+ * @param req_size Requested size (0 for free blocks)
+ */
+#ifndef NDEBUG
+#define HDR_SET_ASIZE(hdr, req_size) ((hdr)->asize = (req_size))
+#else
+#define HDR_SET_ASIZE(hdr, req_size) ((void)(req_size))
+#endif
+/**
+ * Gives the physically next header (or the fence of the arena)
+ * @param hdr Current header
+ */
+#define PHYS_NEXT(hdr) ((Header *)((char *)(hdr) + BLOCK_SIZE(hdr)))
+/**
+ * Gives the footer of the free block
+ * @param hdr Header of the free block
+ */
+#define FOOTER(hdr) ((size_t *)PHYS_NEXT(hdr) - 1)
+/**
+ * Gives the physically previous header, which must be free (HDR_PREV_FREE)
+ * @param hdr Current header
+ */
+#define PHYS_PREV(hdr) ((Header *)((char *)(hdr) - *((size_t *)(hdr) - 1)))
+/**
+ * Gives the fence (the last header) of arena
+ * @param arena Arena for which to search for the fence
+ */
+#define ARENA_FENCE(arena) ((Header *)((char *)(arena) + (arena)->size - FENCE_OFFSET))
+/**
+ * Gives the arena of the fence
+ * @param fence Fence of the arena
+ */
+#define FENCE_ARENA(fence) (((Fence *)(fence))->arena)
+/**
+ * Gives the header of the huge block
+ * @param huge Metadata of the huge block
+ */
+#define HUGE_HEADER(huge) ((Header *)((char *)(huge) + HUGE_HEADER_OFFSET))
+/**
+ * Gives metadata of the huge block
+ * @param hdr Header of the huge block
+ */
+#define HUGE_BLOCK(hdr) ((HugeBlock *)((char *)(hdr) - HUGE_HEADER_OFFSET))
+/**
+ * Gives the start of the mapping of the huge block (metadata of aligned huge
+ * blocks needn't be at the start, but they are always in its first page)
+ * @param huge Metadata of the huge block
+ */
+#define HUGE_MAP(huge) ((char *)((uintptr_t)(huge) & ~(uintptr_t)(OS_PAGE_SIZE - 1)))
+/**
+ * Gives the run of the slot (runs are aligned to their size)
+ * @param ptr Pointer to the slot
+ */
+#define RUN_OF(ptr) ((SlabRun *)((uintptr_t)(ptr) & ~(SLAB_RUN_SIZE - 1)))
+/**
+ * Gives the first run of the slab arena of the run (arenas are aligned to
+ * their size)
+ * @param run Run of slots
+ */
+#define SLAB_ARENA_OF(run) ((SlabRun *)((uintptr_t)(run) & ~(SLAB_ARENA_SIZE - 1)))
+/**
+ * Gives the first slot of the run (aligned to a cache line)
+ * @param run Run of slots
+ */
+#define RUN_SLOTS(run) ((char *)(run) + ALIGN(sizeof(SlabRun), 64))
+/**
+ * Gives the end of the run
+ * @param run Run of slots
+ */
+#define RUN_END(run) ((char *)(run) + SLAB_RUN_SIZE)
+/**
+ * Gives links of the free block to its neighbours in the bin
+ * @param hdr Header of the free block
+ */
+#define FREE_LINKS(hdr) ((FreeLinks *)((char *)(hdr) + sizeof(Header)))
+/**
+ * Gives the offset of zero data in the free block with HDR_ZERO (it's stored
+ * right after the links, the tree ones are the bigger ones, so it's never
+ * zero itself)
+ * @param hdr Header of the free block
+ */
+#define ZERO_FROM(hdr) (*(size_t *)((char *)(hdr) + sizeof(Header) + sizeof(TreeLinks)))
+/**
+ * The lowest offset of zero data in a free block (links and ZERO_FROM() are
+ * before it)
+ */
+#define ZERO_MIN_FROM (sizeof(TreeLinks) + sizeof(size_t))
+/**
+ * Gives links of the large free block to its children in the tree
+ * @param hdr Header of the free block
+ */
+#define TREE_LINKS(hdr) ((TreeLinks *)((char *)(hdr) + sizeof(Header)))
+
+/**
+ * Links of a free block inside its bin. They are stored in the data part
+ * of the block, so they cost nothing for used blocks.
+ */
+/*
+ *   ---+------+---------+----------------------+---
+ *      |Header|FreeLinks|........free..........|
+ *   ---+------+---------+----------------------+---
+ */
+typedef struct free_links FreeLinks;
+struct free_links {
+
+    /// Next free block in the same bin (NULL for the last one)
+    Header *next;
+
+    /// Previous free block in the same bin (NULL for the first one)
+    Header *prev;
+};
+
+/**
+ * Links of a large free block inside the tree of free blocks. The tree is
+ * a treap: it's ordered by the size and the address of blocks (only by the
+ * address for first fit and next fit, see tree_less()) and heap-ordered by
+ * a hash of the address (see tree_priority()), so it stays balanced without
+ * storing anything else. In the order by addresses, every node keeps the
+ * size of the biggest block of its subtree, so searches skip subtrees
+ * without a block big enough.
+ */
+/*
+ *   ---+------+---------+----------------------+---
+ *      |Header|TreeLinks|........free..........|
+ *   ---+------+---------+----------------------+---
+ */
+typedef struct tree_links TreeLinks;
+struct tree_links {
+
+    /// Subtree of smaller blocks (or the same size at lower addresses)
+    Header *left;
+
+    /// Subtree of bigger blocks (or the same size at higher addresses)
+    Header *right;
+
+    /// Size of the biggest block of the subtree, only in the order by
+    /// addresses (see tree_update())
+    size_t max;
+};
+
+/**
+ * The fence at the end of arena. It's a used block of size 0, so nothing
+ * merges over it, and it points back to its arena, so the first block
+ * spanning the whole arena is recognized in a constant time.
+ */
+typedef struct fence Fence;
+struct fence {
+
+    /// Header of the used block of size 0
+    Header hdr;
+
+    /// Arena of the fence
+    Arena *arena;
+};
+
+/**
+ * Maximum number of completely free arenas kept mapped (by every heap)
+ */
+static size_t arena_cache = MMAL_ARENA_CACHE;
+
+/**
+ * Options of new arenas (MMAL_ARENA_THP, MMAL_ARENA_HUGETLB,
+ * MMAL_ARENA_POPULATE)
+ */
+static unsigned arena_options = 0;
+
+/**
+ * Options of arenas were set by the program or read from the environment
+ */
+static bool arena_options_set = false;
+
+/**
+ * Blocks from this size get their own mapping
+ */
+static size_t mmap_threshold = MMAL_MMAP_THRESHOLD;
+
+/**
+ * Number of bytes freed between two purges of large free blocks
+ */
+static size_t purge_interval = MMAL_PURGE_INTERVAL;
+
+/**
+ * Slot sizes of slab size classes
+ */
+static const unsigned slab_sizes[SLAB_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256
+};
+
+/**
+ * Slab size classes for sizes rounded up to SLAB_STEP
+ */
+static const unsigned char slab_size_classes[SLAB_MAX_SIZE / SLAB_STEP + 1] = {
+    0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 8, 9, 9, 10, 10, 11, 11
+};
+
+/**
+ * Bitmap of slab arenas of all heaps in the address space
+ */
+static uint64_t *slab_map = NULL;
+
+/**
+ * Mean number of bytes between two sampled allocations (0 disables the
+ * heap profiler)
+ */
+static size_t sample_interval = 0;
+
+/**
+ * List of live samples and free records of samples
+ */
+static Sample *samples = NULL;
+static Sample *free_samples = NULL;
+
+/**
+ * Numbers and bytes of live samples and of all samples taken so far
+ */
+static size_t sample_count = 0;
+static size_t sample_bytes = 0;
+static size_t sample_total_count = 0;
+static size_t sample_total_bytes = 0;
+
+/**
+ * Sample interval of the profile (the last one set), samples are scaled by
+ * it when they are read
+ */
+static size_t sample_period = 0;
+
+/**
+ * Mappings of freed sampled data and their sizes (see huge_unmap())
+ */
+static char *sample_maps[SAMPLE_MAP_CACHE];
+static size_t sample_map_sizes[SAMPLE_MAP_CACHE];
+static size_t sample_map_count = 0;
+
+/**
+ * A profile has been requested by a signal (see mmal_profile_signal())
+ */
+static volatile sig_atomic_t profile_requested = 0;
+
+/**
+ * File of profiles requested by a signal
+ */
+static char profile_path[PROFILE_PATH_MAX];
+
+#ifdef MMAL_THREADS
+/**
+ * Bytes the current thread allocates until its next sample, and its state
+ * of the random generator of sampling
+ */
+static __thread size_t sample_countdown = 0;
+static __thread uint64_t sample_random = 0;
+
+/**
+ * Lock of samples
+ */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+static size_t sample_countdown = 0;
+static uint64_t sample_random = 0;
+#endif
+
+#ifdef MMAL_INSTRUMENT
+/**
+ * Histograms and counters of the instrumented build
+ */
+static MmalInstrument instrument;
+#endif
+
+/**
+ * Independent heap: its arenas, free blocks, huge blocks and slab runs.
+ * Blocks must be freed to the heap they have been allocated from. The
+ * functions of mmal.h without a heap work with the default heap.
+ */
+struct mmal_heap {
+
+    /// First arena of the heap (see arena_append())
+    Arena *arenas;
+
+    /// Last arena of the list, new arenas are appended after it
+    Arena *last_arena;
+
+    /// Total size of all arenas in the list
+    size_t arena_bytes;
+
+    /// Total size of chunks of all regions (of the default heap only)
+    size_t region_bytes;
+
+    /// Heads of lists of free blocks, one list per size class
+    Header *bins[BIN_COUNT];
+
+    /// Bitmap of non-empty bins (bit i is set iff bins[i] != NULL)
+    uint64_t bin_map[BIN_MAP_WORDS];
+
+    /// Root of the tree of large free blocks
+    Header *free_tree;
+
+    /// Placement policy of large free blocks (MMAL_FIT_BEST, ...)
+    unsigned fit_policy;
+
+    /// Block found by the last search of next fit (only its address is
+    /// used, it can be merged or allocated since then)
+    Header *fit_rover;
+
+    /// Recently freed small blocks, not merged yet, one LIFO list per
+    /// exact size (linked through their first word, see quick_free())
+    void *quick[SMALL_BIN_COUNT];
+
+    /// Number of blocks in each quick list
+    unsigned quick_count[SMALL_BIN_COUNT];
+
+    /// Number of blocks in all quick lists
+    size_t quick_blocks;
+
+    /// Number of completely free arenas
+    size_t empty_arenas;
+
+    /// Number of arenas mapped since the heap has been created
+    size_t arenas_mapped;
+
+    /// Number of arenas unmapped since the heap has been created
+    size_t arenas_unmapped;
+
+    /// Number of bytes freed next to large free blocks since the last purge
+    size_t purge_pending;
+
+    /// List of huge blocks
+    HugeBlock *huge_blocks;
+
+    /// Number of huge blocks mapped since the heap has been created
+    size_t huges_mapped;
+
+    /// Number of huge blocks unmapped since the heap has been created
+    size_t huges_unmapped;
+
+    /// Runs with free slots, one list per slab size class
+    SlabRun *slab_runs[SLAB_CLASSES];
+
+    /// Completely free runs, which can be used for any size class
+    SlabRun *slab_free_runs;
+
+    /// First runs of slab arenas of the heap (linked by next_arena)
+    SlabRun *slab_arena_list;
+
+    /// Number of slab arenas
+    size_t slab_arenas;
+
+    /// Number of slab arenas without used slots
+    size_t empty_slab_arenas;
+
+    /// Next heap of the list of all heaps
+    MmalHeap *next;
+
+#ifdef MMAL_THREADS
+    /// Lock of the heap
+    pthread_mutex_t lock;
+
+    /// Data freed by other threads, waiting for the next allocation from
+    /// the heap (linked through their first word, see remote_push())
+    void *remote_frees;
+
+    /// Thread which has created the heap (not used for the default heap)
+    pthread_t owner;
+#endif
+};
+
+/**
+ * The heap of mmalloc(), mfree() and the others without a heap
+ */
+#ifdef MMAL_THREADS
+static MmalHeap default_heap = {.lock = PTHREAD_MUTEX_INITIALIZER};
+#else
+static MmalHeap default_heap;
+#endif
+
+/**
+ * List of all heaps (for fork())
+ */
+static MmalHeap *heaps = &default_heap;
+
+#ifndef NDEBUG
+/**
+ * Gives the first arena of the default heap (DEBUG mode only)
+ */
+Arena *mmal_first_arena(void)
+{
+    return default_heap.arenas;
+}
+#endif
+
+#ifdef MMAL_THREADS
+/**
+ * Cache of freed blocks owned by a single thread. Cached blocks stay used
+ * from the arenas' point of view, so nobody else merges with them.
+ */
+typedef struct tcache TCache;
+struct tcache {
+
+    /**
+     * Stacks of cached data, one per usable size (linked through their
+     * first word)
+     */
+    void *blocks[TCACHE_CLASSES];
+
+    /// Number of blocks in each stack
+    unsigned count[TCACHE_CLASSES];
+
+    /// The cache is registered for flushing when the thread exits
+    bool registered;
+};
+
+/**
+ * Lock of the list of heaps
+ */
+static pthread_mutex_t heaps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Cache of the current thread
+ */
+static __thread TCache tcache;
+
+/**
+ * Key for flushing thread caches when threads exit
+ */
+static pthread_key_t tcache_key;
+
+/**
+ * Guard of tcache_key initialization
+ */
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+#endif // MMAL_THREADS
+
+#ifdef MMAL_INSTRUMENT
+/**
+ * Counts the value to its bucket of the histogram (see MmalInstrument).
+ * @param histogram buckets of the histogram
+ * @param value     measured value
+ */
+static
+void instrument_add(size_t *histogram, uint64_t value)
+{
+    size_t bucket = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+    __atomic_fetch_add(&histogram[bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Gives the time for latencies of calls.
+ * @return nanoseconds of the monotonic clock
+ */
+static
+uint64_t instrument_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
+
+/**
+ * Return size alligned to PAGE_SIZE (to OS_HUGE_PAGE_SIZE when arenas use
+ * huge pages)
+ */
+size_t allign_page(size_t size)
+{
+    if (arena_options & (MMAL_ARENA_THP | MMAL_ARENA_HUGETLB)) {
+        return ALIGN(size, OS_HUGE_PAGE_SIZE);
+    }
+
+    return ALIGN(size, PAGE_SIZE);
+}
+
+/**
+ * Reads options of arenas from the environment variable MMAL_ARENA_OPTIONS
+ * (comma separated: thp, hugetlb, populate), unless the program set them.
+ */
+static
+void arena_options_load(void)
+{
+    if (arena_options_set) {
+        return;
+    }
+    arena_options_set = true;
+
+    const char *env = getenv("MMAL_ARENA_OPTIONS");
+    if (env == NULL) {
+        return;
+    }
+
+    while (*env != '\0') {
+        size_t len = strcspn(env, ",");
+        if (len == 3 && strncmp(env, "thp", len) == 0) {
+            arena_options |= MMAL_ARENA_THP;
+        } else if (len == 7 && strncmp(env, "hugetlb", len) == 0) {
+            arena_options |= MMAL_ARENA_HUGETLB;
+        } else if (len == 8 && strncmp(env, "populate", len) == 0) {
+            arena_options |= MMAL_ARENA_POPULATE;
+        }
+        env += (env[len] == ',') ? len + 1 : len;
+    }
+}
+
+/**
+ * Maps memory aligned to the given alignment. The mapping is made bigger
+ * and the unaligned parts are unmapped.
+ * @param size      size of the mapping (multiple of OS_PAGE_SIZE)
+ * @param alignment power of two (multiple of OS_PAGE_SIZE)
+ * @return aligned memory or NULL if error.
+ */
+/*
+ *   +----------+---------------------------+------+
+ *   |(unmapped)|........ size .............|(unm.)|
+ *   +----------+---------------------------+------+
+ *              ^ aligned
+ */
+static
+void *map_aligned(size_t size, size_t alignment)
+{
+    char *map;
+    if ((map = mmap(NULL, size + alignment, MMAP_PROT, MMAP_FLAGS, -1, 0)) == MAP_FAILED) {
+        return NULL;
+    }
+
+    char *aligned = (char *)ALIGN((uintptr_t)map, alignment);
+    if (aligned > map) {
+        munmap(map, aligned - map);
+    }
+    if (map + alignment > aligned) {
+        munmap(aligned + size, map + alignment - aligned);
+    }
+
+    return aligned;
+}
+
+/**
+ * Maps memory of a new arena according to options of arenas. Huge pages
+ * of hugetlbfs are tried first, then transparent huge pages (the mapping
+ * is aligned to them), then usual pages.
+ * @param size      size of the arena (multiple of OS_HUGE_PAGE_SIZE when
+ *                  arenas use huge pages)
+ * @return mapped memory or NULL if error.
+ */
+static
+void *arena_map(size_t size)
+{
+    int populate = (arena_options & MMAL_ARENA_POPULATE) ? MAP_POPULATE : 0;
+    void *map;
+
+    if (arena_options & MMAL_ARENA_HUGETLB) {
+        map = mmap(NULL, size, MMAP_PROT, MMAP_FLAGS | MAP_HUGETLB | populate, -1, 0);
+        if (map != MAP_FAILED) {
+            return map;
+        }
+        // The pool of huge pages is empty (or there is none)
+    }
+
+    if (arena_options & MMAL_ARENA_THP) {
+        if ((map = map_aligned(size, OS_HUGE_PAGE_SIZE)) == NULL) {
+            return NULL;
+        }
+        madvise(map, size, MADV_HUGEPAGE);
+
+        // Prefaulted after madvise, so the pages are huge right away
+        if (populate) {
+#ifdef MADV_POPULATE_WRITE
+            if (madvise(map, size, MADV_POPULATE_WRITE) == 0) {
+                return map;
+            }
+#endif
+            for (char *page = map; page < (char *)map + size; page += OS_PAGE_SIZE) {
+                *(volatile char *)page = 0;
+            }
+        }
+        return map;
+    }
+
+    map = mmap(NULL, size, MMAP_PROT, MMAP_FLAGS | populate, -1, 0);
+
+    return (map != MAP_FAILED) ? map : NULL;
+}
+
+/**
+ * Allocate a new arena using mmap.
+ * @param heap     the heap
+ * @param req_size requested size in bytes. Should be alligned to PAGE_SIZE.
+ * @return pointer to a new arena, if successfull. NULL if error.
+ * @pre req_size > ARENA_OVERHEAD + MIN_BLOCK_SIZE
+ */
+
+/*
+ *   +-----+------------------------------------+
+ *   |Arena|....................................|
+ *   +-----+------------------------------------+
+ *
+ *   |--------------- Arena.size ---------------|
+ */
+static
+Arena *arena_alloc(MmalHeap *heap, size_t req_size)
+{
+    assert(req_size > ARENA_OVERHEAD + MIN_BLOCK_SIZE);
+
+    arena_options_load();
+    size_t aligned_size = allign_page(req_size);
+
+    // Allocate new arena with mmap
+    Arena *arena;
+    if ((arena = arena_map(aligned_size)) == NULL) {
+        return NULL;
+    }
+
+    arena->size = aligned_size;
+    arena->next = NULL;
+    heap->arenas_mapped++;
+
+    return arena;
+}
+
+/**
+ * Appends a new arena to the end of the arena list.
+ * @param heap  the heap
+ * @param a     already allocated arena
+ */
+static
+void arena_append(MmalHeap *heap, Arena *a)
+{
+    if (heap->last_arena != NULL) {
+        heap->last_arena->next = a;
+    } else {
+        heap->arenas = a;
+    }
+    heap->last_arena = a;
+    heap->arena_bytes += a->size;
+}
+
+/**
+ * Gives the size of a new arena. Arenas grow with the heap (by half of its
+ * size), so a big heap needs only a few mappings.
+ * @param heap      the heap
+ * @param size      requested size for program
+ * @return size of the new arena (not aligned to PAGE_SIZE)
+ */
+static
+size_t arena_next_size(MmalHeap *heap, size_t size)
+{
+    size_t arena_size = MIN(MAX(heap->arena_bytes / 2, PAGE_SIZE), MMAL_ARENA_MAX_SIZE);
+
+    return MAX(BLOCK_DATA_SIZE(size) + ARENA_OVERHEAD, arena_size);
+}
+
+/**
+ * Header structure constructor (alone, not used block).
+ * @param hdr       pointer to block metadata.
+ * @param size      size of data of free block
+ * @pre size >= MIN_BLOCK_SIZE
+ */
+/**
+ *   +-----+------+------------------------+----+
+ *   | ... |Header|........................| ...|
+ *   +-----+------+------------------------+----+
+ *
+ *                |-- size ----------------|
+ *         |-- Header.size ----------------|
+ */
+static
+void hdr_ctor(Header *hdr, size_t size)
+{
+    assert(size >= MIN_BLOCK_SIZE);
+
+    hdr->size = size + sizeof(Header); // No flags, not user allocated
+    HDR_SET_ASIZE(hdr, 0);
+}
+
+/**
+ * Creates the fence at the end of arena.
+ * @param arena     arena with the first block spanning to its end
+ */
+static
+void arena_set_fence(Arena *arena)
+{
+    // The fence is a used block of zero size, so nothing merges over it
+    // It points back to the arena, so an empty arena is recognized
+    Header *fence = ARENA_FENCE(arena);
+    fence->size = HDR_USED;
+    HDR_SET_ASIZE(fence, 0);
+    FENCE_ARENA(fence) = arena;
+}
+
+/**
+ * Gives the offset of data of the block, from which the data are known
+ * to be zero (except the footer of a free block).
+ * @param hdr       header of the block
+ * @return offset of zero data, HDR_SIZE(hdr) when nothing is known to be zero
+ */
+static
+size_t hdr_zero_from(Header *hdr)
+{
+    if (!HDR_IS_FREE(hdr) || !(hdr->size & HDR_ZERO)) {
+        return HDR_SIZE(hdr);
+    }
+
+    return ZERO_FROM(hdr);
+}
+
+/**
+ * Remembers zero data of the free block. Blocks too small for holding
+ * ZERO_FROM() (or without any zero data) aren't marked.
+ * @param hdr       header of the free block
+ * @param zero_from offset of data, from which the data are zero
+ * @pre HDR_IS_FREE(hdr)
+ */
+/*
+ *   ---+------+---------+---------+00000000000000000+------+---
+ *      |Header|FreeLinks|ZERO_FROM|00000000000000000|footer|...
+ *   ---+------+---------+---------+00000000000000000+------+---
+ *             |-- ZERO_FROM ------^
+ */
+static
+void hdr_set_zero(Header *hdr, size_t zero_from)
+{
+    assert(HDR_IS_FREE(hdr));
+
+    zero_from = MAX(zero_from, ZERO_MIN_FROM);
+    if (zero_from + sizeof(size_t) < HDR_SIZE(hdr)) {
+        hdr->size |= HDR_ZERO;
+        ZERO_FROM(hdr) = zero_from;
+    } else {
+        hdr->size &= ~HDR_ZERO;
+    }
+}
+
+/**
+ * Initializes a new arena with a single free block and the fence.
+ * @param arena     newly allocated arena
+ * @return header of the block spanning the whole arena
+ */
+static
+Header *arena_init_block(Arena *arena)
+{
+    Header *hdr = FIRST_HEADER(arena);
+    hdr_ctor(hdr, arena->size - ARENA_OVERHEAD);
+    arena_set_fence(arena);
+
+    // Anonymous mappings are zero
+    hdr_set_zero(hdr, 0);
+
+    return hdr;
+}
+
+/**
+ * Marks the block as free for its physical neighbours: writes the footer
+ * and informs the next block.
+ * @param hdr       header of the free block
+ * @pre HDR_IS_FREE(hdr)
+ */
+static
+void hdr_mark_free(Header *hdr)
+{
+    assert(HDR_IS_FREE(hdr));
+
+    *FOOTER(hdr) = BLOCK_SIZE(hdr);
+    PHYS_NEXT(hdr)->size |= HDR_PREV_FREE;
+}
+
+/**
+ * Marks the block as used, also for its physical neighbours (the next block
+ * mustn't look for its footer anymore).
+ * @param hdr       header of the used block
+ */
+static
+void hdr_mark_used(Header *hdr)
+{
+    hdr->size = (hdr->size | HDR_USED) & ~(HDR_ZERO | HDR_PURGED);
+    PHYS_NEXT(hdr)->size &= ~HDR_PREV_FREE;
+}
+
+/**
+ * Checks if the block is the first one of its arena and the given header
+ * is the fence of the same arena.
+ * @param hdr       header of a block
+ * @param next_hdr  header following the block (or the block after it)
+ * @return true if the block spans the whole arena up to next_hdr
+ */
+static
+bool hdr_spans_arena(Header *hdr, Header *next_hdr)
+{
+    return BLOCK_SIZE(next_hdr) == 0 && FIRST_HEADER(FENCE_ARENA(next_hdr)) == hdr;
+}
+
+/**
+ * Checks if the free block spans the whole arena.
+ * @param hdr       header of the free block
+ * @return true if the block is the only one in its arena
+ * @pre HDR_IS_FREE(hdr)
+ */
+static
+bool arena_is_empty(Header *hdr)
+{
+    assert(HDR_IS_FREE(hdr));
+
+    return hdr_spans_arena(hdr, PHYS_NEXT(hdr));
+}
+
+/**
+ * Checks if the used block is the only used block of its arena.
+ * @param hdr       header of the used block
+ * @return true if the arena would be empty without the block
+ */
+static
+bool hdr_is_last_used(Header *hdr)
+{
+    Header *first_hdr = (hdr->size & HDR_PREV_FREE) ? PHYS_PREV(hdr) : hdr;
+    Header *next_hdr = PHYS_NEXT(hdr);
+    if (HDR_IS_FREE(next_hdr)) {
+        next_hdr = PHYS_NEXT(next_hdr);
+    }
+
+    return hdr_spans_arena(first_hdr, next_hdr);
+}
+
+/**
+ * Finds the predecessor of the arena in the arena list. Arenas are released
+ * and moved rarely, so the list is simply walked.
+ * @param heap      the heap
+ * @param arena     arena whose predecessor is searched
+ * @return the previous arena or NULL for the first one
+ */
+static
+Arena *arena_list_prev(MmalHeap *heap, Arena *arena)
+{
+    Arena *prev_arena = NULL;
+    for (Arena *curr = heap->arenas; curr != arena; curr = curr->next) {
+        prev_arena = curr;
+    }
+
+    return prev_arena;
+}
+
+/**
+ * Unlinks an empty arena from the arena list and returns it to the OS.
+ * @param heap      the heap
+ * @param arena     arena with the only (free) block, which isn't in any bin
+ */
+static
+void arena_release(MmalHeap *heap, Arena *arena)
+{
+    assert(arena_is_empty(FIRST_HEADER(arena)));
+
+    Arena *prev_arena = arena_list_prev(heap, arena);
+    if (prev_arena != NULL) {
+        prev_arena->next = arena->next;
+    } else {
+        heap->arenas = arena->next;
+    }
+    if (heap->last_arena == arena) {
+        heap->last_arena = prev_arena;
+    }
+
+    heap->arena_bytes -= arena->size;
+    munmap(arena, arena->size);
+    heap->arenas_unmapped++;
+}
+
+/**
+ * Gives the size class (bin) of a free block.
+ * @param size      size of the whole block (see BLOCK_SIZE())
+ * @return index of the bin the block belongs to
+ * @pre size >= MIN_BLOCK_SIZE + sizeof(Header)
+ */
+static
+size_t bin_index(size_t size)
+{
+    assert(size >= MIN_BLOCK_SIZE + sizeof(Header));
+
+    if (size < SMALL_BIN_LIMIT) {
+        return size / BIN_STEP;
+    }
+
+    // Every power of two has SUB_BIN_COUNT bins, the bin is given by the bits
+    // right after the most significant one
+    size_t log2 = sizeof(size_t) * 8 - 1 - __builtin_clzl(size);
+    size_t sub_bin = (size >> (log2 - SUB_BIN_LOG2)) & (SUB_BIN_COUNT - 1);
+
+    return SMALL_BIN_COUNT + (log2 - SMALL_BIN_LOG2) * SUB_BIN_COUNT + sub_bin;
+}
+
+/**
+ * Gives the smallest size of a block stored in the bin.
+ * @param index     index of the bin
+ * @return minimal size of the whole block of the bin
+ * @pre index < BIN_COUNT
+ */
+static
+size_t bin_min_size(size_t index)
+{
+    assert(index < BIN_COUNT);
+
+    if (index < SMALL_BIN_COUNT) {
+        return index * BIN_STEP;
+    }
+
+    size_t log2 = SMALL_BIN_LOG2 + (index - SMALL_BIN_COUNT) / SUB_BIN_COUNT;
+    size_t sub_bin = (index - SMALL_BIN_COUNT) % SUB_BIN_COUNT;
+
+    return (1UL << log2) + sub_bin * (1UL << (log2 - SUB_BIN_LOG2));
+}
+
+/**
+ * Finds the first non-empty bin with index greater or equal to the given one.
+ * @param heap      the heap
+ * @param index     index of the first bin to check
+ * @return index of the non-empty bin or NO_BIN if there is no such bin
+ */
+static
+size_t bin_map_find(MmalHeap *heap, size_t index)
+{
+    if (index >= BIN_COUNT) {
+        return NO_BIN;
+    }
+
+    size_t word = index / 64;
+    uint64_t bits = heap->bin_map[word] & (~(uint64_t)0 << (index % 64));
+    while (bits == 0) {
+        if (++word == BIN_MAP_WORDS) {
+            return NO_BIN;
+        }
+        bits = heap->bin_map[word];
+    }
+
+    return word * 64 + __builtin_ctzll(bits);
+}
+
+/**
+ * Gives the heap priority of a block in the tree. It's a hash of the address,
+ * which is as good as a random number for keeping the tree balanced.
+ * @param hdr       header of the free block
+ * @return priority (greater is closer to the root)
+ */
+static
+uint64_t tree_priority(Header *hdr)
+{
+    return ((uintptr_t)hdr / ALIGNMENT) * 0x9e3779b97f4a7c15ULL;
+}
+
+/**
+ * Checks if the tree of the heap is ordered by addresses (first fit and
+ * next fit), otherwise it's ordered by sizes.
+ * @param heap      the heap
+ * @return true if the tree is ordered by addresses
+ */
+static
+bool tree_by_address(MmalHeap *heap)
+{
+    return heap->fit_policy == MMAL_FIT_FIRST || heap->fit_policy == MMAL_FIT_NEXT;
+}
+
+/**
+ * Compares blocks by the tree order: by size, then by address (or only
+ * by address, see tree_by_address()).
+ * @param heap      the heap
+ * @param left      header of a free block
+ * @param right     header of another free block
+ * @return true if left goes before right
+ */
+static
+bool tree_less(MmalHeap *heap, Header *left, Header *right)
+{
+    if (tree_by_address(heap)) {
+        return left < right;
+    }
+
+    return BLOCK_SIZE(left) < BLOCK_SIZE(right) || (BLOCK_SIZE(left) == BLOCK_SIZE(right) && left < right);
+}
+
+/**
+ * Updates the size of the biggest block of the subtree after its children
+ * have changed. Only the tree ordered by addresses needs it, the biggest
+ * block of the tree ordered by sizes is the rightmost one.
+ * @param heap      the heap
+ * @param root      root of the subtree
+ */
+static
+void tree_update(MmalHeap *heap, Header *root)
+{
+    if (!tree_by_address(heap)) {
+        return;
+    }
+
+    TreeLinks *links = TREE_LINKS(root);
+    size_t max = BLOCK_SIZE(root);
+    if (links->left != NULL) {
+        max = MAX(max, TREE_LINKS(links->left)->max);
+    }
+    if (links->right != NULL) {
+        max = MAX(max, TREE_LINKS(links->right)->max);
+    }
+    links->max = max;
+}
+
+/**
+ * Inserts a free block to the subtree.
+ * @param heap      the heap
+ * @param root      root of the subtree (can be NULL)
+ * @param hdr       header of the free block
+ * @return a new root of the subtree
+ */
+/*
+ *   Rotation of a child with a higher priority (to the right):
+ *
+ *          root            left
+ *          /  \            /  \
+ *       left   C    -->    A   root
+ *       /  \                   /  \
+ *      A    B                 B    C
+ */
+static
+Header *tree_insert_at(MmalHeap *heap, Header *root, Header *hdr)
+{
+    if (root == NULL) {
+        TREE_LINKS(hdr)->left = NULL;
+        TREE_LINKS(hdr)->right = NULL;
+        TREE_LINKS(hdr)->max = BLOCK_SIZE(hdr);
+        return hdr;
+    }
+
+    TreeLinks *links = TREE_LINKS(root);
+    if (tree_less(heap, hdr, root)) {
+        links->left = tree_insert_at(heap, links->left, hdr);
+        if (tree_priority(links->left) > tree_priority(root)) {
+            Header *left = links->left;
+            links->left = TREE_LINKS(left)->right;
+            tree_update(heap, root);
+            TREE_LINKS(left)->right = root;
+            tree_update(heap, left);
+            return left;
+        }
+    } else {
+        links->right = tree_insert_at(heap, links->right, hdr);
+        if (tree_priority(links->right) > tree_priority(root)) {
+            Header *right = links->right;
+            links->right = TREE_LINKS(right)->left;
+            tree_update(heap, root);
+            TREE_LINKS(right)->left = root;
+            tree_update(heap, right);
+            return right;
+        }
+    }
+
+    tree_update(heap, root);
+    return root;
+}
+
+/**
+ * Joins two subtrees, all blocks of the left one go before the right one.
+ * @param heap      the heap
+ * @param left      root of the left subtree (can be NULL)
+ * @param right     root of the right subtree (can be NULL)
+ * @return root of the joined tree
+ */
+static
+Header *tree_join(MmalHeap *heap, Header *left, Header *right)
+{
+    if (left == NULL) {
+        return right;
+    }
+    if (right == NULL) {
+        return left;
+    }
+
+    if (tree_priority(left) > tree_priority(right)) {
+        TREE_LINKS(left)->right = tree_join(heap, TREE_LINKS(left)->right, right);
+        tree_update(heap, left);
+        return left;
+    }
+
+    TREE_LINKS(right)->left = tree_join(heap, left, TREE_LINKS(right)->left);
+    tree_update(heap, right);
+    return right;
+}
+
+/**
+ * Removes a free block from the subtree.
+ * @param heap      the heap
+ * @param root      root of the subtree
+ * @param hdr       header of the free block
+ * @param visited   counter of visited blocks (instrumentation)
+ * @return a new root of the subtree
+ * @pre hdr is stored in the subtree (with the same size)
+ */
+static
+Header *tree_remove_at(MmalHeap *heap, Header *root, Header *hdr, size_t *visited)
+{
+    assert(root != NULL);
+
+    (*visited)++;
+    if (root == hdr) {
+        return tree_join(heap, TREE_LINKS(hdr)->left, TREE_LINKS(hdr)->right);
+    }
+
+    TreeLinks *links = TREE_LINKS(root);
+    if (tree_less(heap, hdr, root)) {
+        links->left = tree_remove_at(heap, links->left, hdr, visited);
+    } else {
+        links->right = tree_remove_at(heap, links->right, hdr, visited);
+    }
+    tree_update(heap, root);
+
+    return root;
+}
+
+/**
+ * Removes a free block from the tree.
+ * @param heap      the heap
+ * @param hdr       header of the free block
+ * @pre hdr is stored in the tree (with the same size)
+ */
+static
+void tree_remove(MmalHeap *heap, Header *hdr)
+{
+    size_t visited = 0;
+    if (tree_by_address(heap)) {
+        // Sizes of the biggest blocks are updated on the way back
+        heap->free_tree = tree_remove_at(heap, heap->free_tree, hdr, &visited);
+        INSTRUMENT_HISTOGRAM(remove_visits, visited);
+        return;
+    }
+
+    Header **link = &heap->free_tree;
+    while (*link != hdr) {
+        assert(*link != NULL);
+        link = tree_less(heap, hdr, *link) ? &TREE_LINKS(*link)->left : &TREE_LINKS(*link)->right;
+        visited++;
+    }
+    INSTRUMENT_HISTOGRAM(remove_visits, visited + 1);
+
+    *link = tree_join(heap, TREE_LINKS(hdr)->left, TREE_LINKS(hdr)->right);
+}
+
+/**
+ * Inserts all blocks of the subtree to the tree of the heap again, e.g. in
+ * a new order after the fit policy has changed.
+ * @param heap      the heap
+ * @param node      root of the subtree (can be NULL), it's not in the tree
+ */
+static
+void tree_reinsert(MmalHeap *heap, Header *node)
+{
+    while (node != NULL) {
+        Header *left = TREE_LINKS(node)->left;
+        Header *right = TREE_LINKS(node)->right;
+        tree_reinsert(heap, left);
+        heap->free_tree = tree_insert_at(heap, heap->free_tree, node);
+        node = right;
+    }
+}
+
+/**
+ * Finds the block with the lowest address which is big enough in the tree
+ * ordered by addresses. Subtrees without a block big enough are skipped
+ * by their biggest blocks.
+ * @param node          root of the subtree (can be NULL)
+ * @param block_size    requested size of the whole block
+ * @param from          blocks at lower addresses are skipped (NULL for none)
+ * @param visited       counter of visited blocks (instrumentation)
+ * @return header of the block or NULL if there is no such block.
+ */
+static
+Header *tree_first_fit(Header *node, size_t block_size, Header *from, size_t *visited)
+{
+    while (node != NULL && TREE_LINKS(node)->max >= block_size) {
+        (*visited)++;
+        if (node >= from) {
+            Header *found = tree_first_fit(TREE_LINKS(node)->left, block_size, from, visited);
+            if (found != NULL) {
+                return found;
+            }
+            if (BLOCK_SIZE(node) >= block_size) {
+                return node;
+            }
+        }
+        node = TREE_LINKS(node)->right;
+    }
+
+    return NULL;
+}
+
+/**
+ * Finds a block big enough in the tree by the fit policy of the heap:
+ *  - best fit: the smallest one, the one with the lowest address from
+ *    blocks of the same size,
+ *  - good fit: the first one met on the way to the best one which is
+ *    bigger by less than a quarter of the power of two of the size (a size
+ *    class of geometric bins),
+ *  - first fit: the one with the lowest address,
+ *  - next fit: the first one from the block found last time, the search
+ *    wraps around to the lowest address.
+ * @param heap          the heap
+ * @param block_size    requested size of the whole block
+ * @param visited       blocks visited by the search before (instrumentation)
+ * @return header of the block or NULL if there is no block big enough.
+ */
+static
+Header *tree_find_fit(MmalHeap *heap, size_t block_size, size_t visited)
+{
+    Header *best = NULL;
+    if (tree_by_address(heap)) {
+        Header *from = (heap->fit_policy == MMAL_FIT_NEXT) ? heap->fit_rover : NULL;
+        best = tree_first_fit(heap->free_tree, block_size, from, &visited);
+        if (best == NULL && from != NULL) {
+            best = tree_first_fit(heap->free_tree, block_size, NULL, &visited);
+        }
+        heap->fit_rover = best;
+        INSTRUMENT_HISTOGRAM(search_visits, visited);
+        return best;
+    }
+
+    // Blocks smaller than good_size end the search (none for best fit)
+    size_t good_size = 0;
+    if (heap->fit_policy == MMAL_FIT_GOOD) {
+        // Sizes of a geometric bin (see bin_index()) differ by less than this
+        size_t log2 = sizeof(size_t) * 8 - 1 - __builtin_clzl(block_size);
+        good_size = block_size + ((size_t)1 << (log2 - SUB_BIN_LOG2));
+    }
+
+    Header *node = heap->free_tree;
+    while (node != NULL) {
+        visited++;
+        if (BLOCK_SIZE(node) >= block_size) {
+            best = node;
+            if (BLOCK_SIZE(node) < good_size) {
+                break;
+            }
+            node = TREE_LINKS(node)->left;
+        } else {
+            node = TREE_LINKS(node)->right;
+        }
+    }
+    INSTRUMENT_HISTOGRAM(search_visits, visited);
+
+    return best;
+}
+
+/**
+ * Inserts a free block to the head of its bin (or to the tree).
+ * @param heap      the heap
+ * @param hdr       header of the free block
+ * @pre HDR_IS_FREE(hdr)
+ */
+static
+void bin_insert(MmalHeap *heap, Header *hdr)
+{
+    assert(HDR_IS_FREE(hdr));
+
+    if (BLOCK_SIZE(hdr) >= TREE_MIN_SIZE) {
+        heap->free_tree = tree_insert_at(heap, heap->free_tree, hdr);
+        return;
+    }
+
+    size_t index = bin_index(BLOCK_SIZE(hdr));
+    FreeLinks *links = FREE_LINKS(hdr);
+
+    links->prev = NULL;
+    links->next = heap->bins[index];
+    if (heap->bins[index] != NULL) {
+        FREE_LINKS(heap->bins[index])->prev = hdr;
+    }
+
+    heap->bins[index] = hdr;
+    heap->bin_map[index / 64] |= (uint64_t)1 << (index % 64);
+}
+
+/**
+ * Removes a free block from its bin (or from the tree).
+ * @param heap      the heap
+ * @param hdr       header of the free block
+ * @pre hdr is stored in the bin (or the tree) for its size
+ */
+static
+void bin_remove(MmalHeap *heap, Header *hdr)
+{
+    if (BLOCK_SIZE(hdr) >= TREE_MIN_SIZE) {
+        tree_remove(heap, hdr);
+        return;
+    }
+
+    size_t index = bin_index(BLOCK_SIZE(hdr));
+    FreeLinks *links = FREE_LINKS(hdr);
+
+    if (links->prev != NULL) {
+        FREE_LINKS(links->prev)->next = links->next;
+    } else {
+        assert(heap->bins[index] == hdr);
+
+        heap->bins[index] = links->next;
+        if (heap->bins[index] == NULL) {
+            heap->bin_map[index / 64] &= ~((uint64_t)1 << (index % 64));
+        }
+    }
+
+    if (links->next != NULL) {
+        FREE_LINKS(links->next)->prev = links->prev;
+    }
+}
+
+/**
+ * Finds a free block big enough for the requested size. Only free blocks
+ * are examined. Exact bins are found in a constant time by the bitmap, the
+ * first non-empty one is the best fit. Large blocks are searched in the tree
+ * in a logarithmic time.
+ * With MMAL_LARGE_BINS, the search starts in the first bin whose blocks are
+ * all big enough. Only when there is no such bin, blocks of the bin of the
+ * requested size are checked one by one.
+ * @param heap      the heap
+ * @param size      requested size
+ * @return pointer to the header of the block or NULL if no block is available.
+ * @pre size > 0
+ */
+static
+Header *bin_find_fit(MmalHeap *heap, size_t size)
+{
+    assert(size > 0);
+
+    size_t block_size = BLOCK_DATA_SIZE(size) + sizeof(Header);
+    if (block_size >= TREE_MIN_SIZE) {
+        return tree_find_fit(heap, block_size, 0);
+    }
+
+    size_t index = bin_index(block_size);
+
+    // Bin with blocks of exactly the same or bigger size than requested
+    size_t fit_index = index;
+    if (bin_min_size(fit_index) < block_size) {
+        fit_index++;
+    }
+
+    size_t found = bin_map_find(heap, fit_index);
+    if (found != NO_BIN) {
+        INSTRUMENT_HISTOGRAM(search_visits, 1);
+        return heap->bins[found];
+    }
+
+    // Blocks of the requested size class could be big enough, too
+    size_t visited = 0;
+    if (fit_index != index) {
+        for (Header *hdr = heap->bins[index]; hdr != NULL; hdr = FREE_LINKS(hdr)->next) {
+            visited++;
+            if (BLOCK_SIZE(hdr) >= block_size) {
+                INSTRUMENT_HISTOGRAM(search_visits, visited);
+                return hdr;
+            }
+        }
+    }
+
+    // All bins are too small, the smallest large block is the best one
+    return tree_find_fit(heap, block_size, visited);
+}
+
+/**
+ * Checks if the given block should be split in two separate blocks.
+ * @param hdr       header of the block
+ * @param size      requested size of data
+ * @return true if the block should be split
+ * @pre size > 0
+ */
+static
+bool hdr_should_split(Header *hdr, size_t size)
+{
+    assert(size > 0);
+
+    return HDR_SIZE(hdr) >= BLOCK_DATA_SIZE(size) + sizeof(Header) + MIN_BLOCK_SIZE;
+}
+
+/**
+ * Splits one block in two. The new (right) block is free and it's put
+ * to its bin. The left block is expected to be used.
+ * @param heap      the heap
+ * @param hdr       pointer to header of the big block
+ * @param req_size  requested size of data in the (left) block.
+ * @return pointer to the new (right) block header.
+ * @pre HDR_SIZE(hdr) >= BLOCK_DATA_SIZE(req_size) + sizeof(Header) + MIN_BLOCK_SIZE
+ */
+/*
+ * Before:        |---- HDR_SIZE(hdr) -----|
+ *
+ *    -----+------+------------------------+----
+ *         |Header|........................|
+ *    -----+------+------------------------+----
+ */
+/*
+ * After:         |- BLOCK_DATA_SIZE(req_size)
+ *
+ *    -----+------+------------+------+----+----
+ *     ... |Header|............|Header|....|
+ *    -----+------+------------+------+----+----
+ */
+static
+Header *hdr_split(MmalHeap *heap, Header *hdr, size_t req_size)
+{
+    size_t alloc_size = BLOCK_DATA_SIZE(req_size);
+
+    assert(HDR_SIZE(hdr) >= alloc_size + sizeof(Header) + MIN_BLOCK_SIZE);
+
+    // Create new header (for block which is the rest of the old big block)
+    // It keeps zero data of the big block
+    size_t zero_from = hdr_zero_from(hdr);
+    Header *new_hdr = NEXT_HEADER(hdr, alloc_size);
+    hdr_ctor(new_hdr, HDR_SIZE(hdr) - sizeof(Header) - alloc_size);
+    if (zero_from > alloc_size + sizeof(Header)) {
+        hdr_set_zero(new_hdr, zero_from - alloc_size - sizeof(Header));
+    } else {
+        hdr_set_zero(new_hdr, 0);
+    }
+
+    // Update old header
+    HDR_SET_SIZE(hdr, alloc_size);
+    HDR_SET_ASIZE(hdr, req_size);
+
+    hdr_mark_free(new_hdr);
+    bin_insert(heap, new_hdr);
+
+    return new_hdr;
+}
+
+/**
+ * Detect if two adjacent blocks could be merged. Blocks from different
+ * arenas are never physical neighbours: the last block of an arena is
+ * followed by the (used) fence and the first one never has HDR_PREV_FREE.
+ * @param left      left block
+ * @param right     right block (or the fence)
+ * @return true if two block are free and adjacent in the same arena.
+ * @pre PHYS_NEXT(left) == right
+ */
+static
+bool hdr_can_merge(Header *left, Header *right)
+{
+    assert(PHYS_NEXT(left) == right);
+
+    // There is a non-free block
+    return HDR_IS_FREE(left) && HDR_IS_FREE(right);
+}
+
+/**
+ * Merge two adjacent free blocks (or a used block with the next free one).
+ * Zero data of the right block stay known to be zero in the merged free block.
+ * @param left      left block
+ * @param right     right block
+ * @pre PHYS_NEXT(left) == right
+ * @pre left != right
+ */
+static
+void hdr_merge(Header *left, Header *right)
+{
+    assert(PHYS_NEXT(left) == right);
+    assert(left != right);
+
+    size_t zero_from = BLOCK_SIZE(left) + hdr_zero_from(right);
+    left->size = (BLOCK_SIZE(left) + BLOCK_SIZE(right)) | (left->size & HDR_FLAGS & ~(HDR_ZERO | HDR_PURGED));
+    if (HDR_IS_FREE(left)) {
+        hdr_set_zero(left, zero_from);
+    }
+}
+
+/**
+ * Grows the arena of its only used block with mremap, so the data are never
+ * copied. The arena may be moved to another address.
+ * @param heap      the heap
+ * @param hdr       header of the first block of the arena, which is followed
+ *                  by the fence or by a free block and the fence
+ * @param size      requested size for program
+ * @return pointer to the data of the grown block or NULL if error.
+ */
+/*
+ *   +-----+------+XXXXXXXXX+------+....+------+
+ *   |Arena|Header|XXXXXXXXX|Header|....|Header|
+ *   +-----+------+XXXXXXXXX+------+....+------+
+ *
+ *            \ mremap
+ *             v
+ *   +-----+------+XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX+------+...+------+
+ *   |Arena|Header|XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX|Header|...|Header|
+ *   +-----+------+XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX+------+...+------+
+ */
+static
+void *arena_grow(MmalHeap *heap, Header *hdr, size_t size)
+{
+    Arena *arena = HEADER_ARENA(hdr);
+    assert(FIRST_HEADER(arena) == hdr);
+
+    if (size > SIZE_MAX - ARENA_OVERHEAD - OS_HUGE_PAGE_SIZE) {
+        // Overflow
+        return NULL;
+    }
+
+    Header *next_hdr = PHYS_NEXT(hdr);
+    if (HDR_IS_FREE(next_hdr)) {
+        bin_remove(heap, next_hdr);
+        hdr_merge(hdr, next_hdr);
+        hdr_mark_used(hdr);
+    }
+
+    // Remember the neighbour, the arena may move
+    Arena *prev_arena = arena_list_prev(heap, arena);
+    size_t old_size = arena->size;
+
+    size_t new_size = allign_page(BLOCK_DATA_SIZE(size) + ARENA_OVERHEAD);
+    Arena *new_arena;
+    if ((new_arena = mremap(arena, arena->size, new_size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+        return NULL;
+    }
+    new_arena->size = new_size;
+    heap->arena_bytes += new_size - old_size;
+
+    // The block spans the whole grown arena
+    Header *new_hdr = FIRST_HEADER(new_arena);
+    HDR_SET_SIZE(new_hdr, new_size - ARENA_OVERHEAD);
+    arena_set_fence(new_arena);
+
+    // Relink the (possibly moved) arena
+    if (prev_arena != NULL) {
+        prev_arena->next = new_arena;
+    } else {
+        heap->arenas = new_arena;
+    }
+    if (heap->last_arena == arena) {
+        heap->last_arena = new_arena;
+    }
+
+    // The rest over the requested size is left for the next growth
+    // Its part beyond the old end of the arena is freshly mapped (zero)
+    if (hdr_should_split(new_hdr, size)) {
+        Header *rest_hdr = hdr_split(heap, new_hdr, size);
+        char *rest_data = (char *)rest_hdr + sizeof(Header);
+        char *old_end = (char *)new_arena + old_size;
+        hdr_set_zero(rest_hdr, (old_end > rest_data) ? (size_t)(old_end - rest_data) : 0);
+    }
+    HDR_SET_ASIZE(new_hdr, size);
+
+    return (char *)new_hdr + sizeof(Header);
+}
+
+/**
+ * Zeroes data of a new used block, which could be dirty: everything before
+ * the zero data of the former free block and its footer.
+ * @param data      data of the used block
+ * @param size      requested size for program
+ * @param zero_from offset of zero data of the former free block
+ */
+static
+void heap_clear(char *data, size_t size, size_t zero_from)
+{
+    if (zero_from >= size) {
+        memset(data, 0, size);
+        return;
+    }
+
+    memset(data, 0, zero_from);
+
+    // The footer of the former free block (when it hasn't been split)
+    size_t footer = HDR_SIZE((Header *)(data - sizeof(Header))) - sizeof(size_t);
+    if (footer < size) {
+        memset(data + footer, 0, size - footer);
+    }
+}
+
+/**
+ * Takes the free block out of its bin to be used.
+ * @param heap      the heap
+ * @param hdr       header of the free block
+ * @pre HDR_IS_FREE(hdr)
+ */
+static
+void heap_take_free(MmalHeap *heap, Header *hdr)
+{
+    bin_remove(heap, hdr);
+    if (arena_is_empty(hdr)) {
+        heap->empty_arenas--;
+    }
+}
+
+/**
+ * Returns whole pages of a large free block to the OS. Its first page (with
+ * the links) and the last one (with the footer) usually stay. With
+ * MADV_DONTNEED the pages read as zero then, so the block gets zero data.
+ * MADV_FREE is cheaper (pages are reclaimed only under memory pressure),
+ * but they can keep their data.
+ * @param hdr       header of the free block
+ * @pre HDR_IS_FREE(hdr)
+ */
+/*
+ *   ---+------+---------+--+----------------------+--+------+---
+ *      |Header|FreeLinks|..|  purged (whole pages) |..|footer|...
+ *   ---+------+---------+--+----------------------+--+------+---
+ *                          ^ start                ^ end
+ */
+static
+void hdr_purge(Header *hdr)
+{
+    assert(HDR_IS_FREE(hdr));
+
+    char *data = (char *)hdr + sizeof(Header);
+    char *start = (char *)ALIGN((uintptr_t)data + ZERO_MIN_FROM, OS_PAGE_SIZE);
+    char *end = (char *)((uintptr_t)FOOTER(hdr) & ~(uintptr_t)(OS_PAGE_SIZE - 1));
+    if (end <= start) {
+        return;
+    }
+
+    // Zero data have never been touched (or they are purged already)
+    if (hdr_zero_from(hdr) <= (size_t)(start - data)) {
+        hdr->size |= HDR_PURGED;
+        return;
+    }
+
+#if defined(MADV_FREE) && !defined(MMAL_PURGE_DONTNEED)
+    if (madvise(start, end - start, MADV_FREE) == 0) {
+        hdr->size |= HDR_PURGED;
+        return;
+    }
+#endif
+    if (madvise(start, end - start, MADV_DONTNEED) == 0) {
+        // The rest after the pages is zeroed, so all data from start are zero
+        memset(end, 0, (char *)FOOTER(hdr) - end);
+        hdr_set_zero(hdr, start - data);
+        hdr->size |= HDR_PURGED;
+    }
+}
+
+/**
+ * Purges large free blocks of the subtree, which haven't been purged yet.
+ * @param root      root of the subtree (can be NULL)
+ */
+static
+void heap_purge_tree(Header *root)
+{
+    for (; root != NULL; root = TREE_LINKS(root)->right) {
+        if (BLOCK_SIZE(root) >= PURGE_MIN_SIZE && !(root->size & HDR_PURGED)) {
+            hdr_purge(root);
+        }
+        heap_purge_tree(TREE_LINKS(root)->left);
+    }
+}
+
+/**
+ * Returns pages of all large free blocks to the OS. It's done after
+ * purge_interval bytes are freed next to large free blocks, so a block
+ * which is allocated again soon doesn't fault its pages again.
+ * @param heap      the heap
+ */
+static
+void heap_purge(MmalHeap *heap)
+{
+    heap->purge_pending = 0;
+
+    // Large blocks are in the tree, unless MMAL_LARGE_BINS is used
+    for (size_t i = bin_index(PURGE_MIN_SIZE); i < BIN_COUNT; i++) {
+        for (Header *hdr = heap->bins[i]; hdr != NULL; hdr = FREE_LINKS(hdr)->next) {
+            if (BLOCK_SIZE(hdr) >= PURGE_MIN_SIZE && !(hdr->size & HDR_PURGED)) {
+                hdr_purge(hdr);
+            }
+        }
+    }
+    heap_purge_tree(heap->free_tree);
+}
+
+/**
+ * Free memory block and return it to arenas.
+ * @param heap      the heap
+ * @param ptr       pointer to previously allocated data
+ * @pre ptr != NULL
+ */
+static
+void heap_free(MmalHeap *heap, void *ptr)
+{
+    // Header for allocated space
+    Header *processed_hdr = (Header *)((char *)ptr - sizeof(Header));
+
+    // Set block of the header as not used (its data are dirty)
+    processed_hdr->size &= ~(HDR_USED | HDR_ZERO);
+    HDR_SET_ASIZE(processed_hdr, 0);
+    size_t freed_size = BLOCK_SIZE(processed_hdr);
+
+    // Merge with surrounding blocks if possible
+    // Physical neighbours are found in a constant time: the next one
+    // by the size, the previous one by its footer (if it's free)
+    // This and next
+    Header *next_hdr = PHYS_NEXT(processed_hdr);
+    if (hdr_can_merge(processed_hdr, next_hdr)) {
+        bin_remove(heap, next_hdr);
+        hdr_merge(processed_hdr, next_hdr);
+    }
+
+    // Previous and this
+    if (processed_hdr->size & HDR_PREV_FREE) {
+        Header *prev_hdr = PHYS_PREV(processed_hdr);
+        assert(hdr_can_merge(prev_hdr, processed_hdr));
+
+        bin_remove(heap, prev_hdr);
+        hdr_merge(prev_hdr, processed_hdr);
+        processed_hdr = prev_hdr;
+    }
+
+    // Completely free arenas over the limit are returned to the OS
+    if (arena_is_empty(processed_hdr)) {
+        if (heap->empty_arenas >= arena_cache) {
+            arena_release(heap, HEADER_ARENA(processed_hdr));
+            return;
+        }
+        heap->empty_arenas++;
+    }
+
+    hdr_mark_free(processed_hdr);
+    bin_insert(heap, processed_hdr);
+
+    // Pages of large free blocks are purged in batches
+    if (BLOCK_SIZE(processed_hdr) >= PURGE_MIN_SIZE) {
+        heap->purge_pending += freed_size;
+        if (heap->purge_pending >= purge_interval) {
+            heap_purge(heap);
+        }
+    }
+}
+
+/**
+ * Coalesces blocks of the quick list: they are freed and merged with their
+ * free neighbours at once.
+ * @param heap      the heap
+ * @param index     index of the quick list (the same as of the exact bin)
+ */
+static
+void quick_coalesce(MmalHeap *heap, size_t index)
+{
+    void *next;
+    for (void *ptr = heap->quick[index]; ptr != NULL; ptr = next) {
+        next = *(void **)ptr;
+        heap_free(heap, ptr);
+    }
+
+    heap->quick_blocks -= heap->quick_count[index];
+    heap->quick[index] = NULL;
+    heap->quick_count[index] = 0;
+}
+
+/**
+ * Coalesces blocks of all quick lists (before the heap grows).
+ * @param heap      the heap
+ */
+static
+void quick_coalesce_all(MmalHeap *heap)
+{
+    for (size_t index = 0; heap->quick_blocks > 0 && index < SMALL_BIN_COUNT; index++) {
+        if (heap->quick[index] != NULL) {
+            quick_coalesce(heap, index);
+        }
+    }
+}
+
+/**
+ * Free a block of arenas. Small blocks are kept unmerged in the quick list
+ * of their size, so allocations of the same size take them back without
+ * splitting them again. They stay used from arenas' point of view, so
+ * nobody merges with them. A full list is coalesced first. The last used
+ * block of an arena is freed at once, so the arena can be released.
+ * @param heap      the heap
+ * @param ptr       pointer to previously allocated data
+ * @pre ptr != NULL
+ */
+static
+void quick_free(MmalHeap *heap, void *ptr)
+{
+    Header *hdr = (Header *)((char *)ptr - sizeof(Header));
+    if (BLOCK_SIZE(hdr) >= SMALL_BIN_LIMIT || hdr_is_last_used(hdr)) {
+        heap_free(heap, ptr);
+        return;
+    }
+
+    size_t index = bin_index(BLOCK_SIZE(hdr));
+    if (heap->quick_count[index] == QUICK_LIMIT) {
+        quick_coalesce(heap, index);
+    }
+
+    HDR_SET_ASIZE(hdr, 0);
+    *(void **)ptr = heap->quick[index];
+    heap->quick[index] = ptr;
+    heap->quick_count[index]++;
+    heap->quick_blocks++;
+}
+
+/**
+ * Takes a recently freed block of exactly the size for the request out of
+ * its quick list.
+ * @param heap      the heap
+ * @param size      requested size for program
+ * @return header of the used block or NULL if the list is empty.
+ * @pre size > 0
+ */
+static
+Header *quick_take(MmalHeap *heap, size_t size)
+{
+    size_t block_size = BLOCK_DATA_SIZE(size) + sizeof(Header);
+    if (block_size >= SMALL_BIN_LIMIT) {
+        return NULL;
+    }
+
+    size_t index = bin_index(block_size);
+    void *ptr = heap->quick[index];
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    heap->quick[index] = *(void **)ptr;
+    heap->quick_count[index]--;
+    heap->quick_blocks--;
+
+    return (Header *)((char *)ptr - sizeof(Header));
+}
+
+/**
+ * Takes a free block big enough for the requested size out of its bin.
+ * When no block is big enough, quick lists are coalesced and only then
+ * a new arena is allocated.
+ * @param heap      the heap
+ * @param size      requested size for program
+ * @return header of the free block, which isn't in any bin, or NULL if error.
+ * @pre size > 0
+ */
+static
+Header *heap_take_block(MmalHeap *heap, size_t size)
+{
+    assert(size > 0);
+
+    if (size > SIZE_MAX - ARENA_OVERHEAD - OS_HUGE_PAGE_SIZE) {
+        // Overflow
+        return NULL;
+    }
+
+    Header *hdr = bin_find_fit(heap, size);
+    if (hdr == NULL && heap->quick_blocks > 0) {
+        quick_coalesce_all(heap);
+        hdr = bin_find_fit(heap, size);
+    }
+    if (hdr != NULL) {
+        // There is a free block big enough for a new allocation
+        heap_take_free(heap, hdr);
+        return hdr;
+    }
+
+    // No arena can store this block --> we need a new one
+    Arena *new_arena;
+    if ((new_arena = arena_alloc(heap, arena_next_size(heap, size))) == NULL) {
+        // OS can't give us a new memory block
+        return NULL;
+    }
+
+    // Init new arena with header and use this header for next actions
+    hdr = arena_init_block(new_arena);
+
+    // Add arena to the list of arenas
+    arena_append(heap, new_arena);
+
+    return hdr;
+}
+
+/**
+ * Allocate memory from arenas. A recently freed block of the same size is
+ * taken from its quick list, otherwise segregated fit search is used.
+ * @param heap      the heap
+ * @param size      requested size for program
+ * @param clear     the data are zeroed (only the part which could be dirty)
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+static
+void *heap_malloc(MmalHeap *heap, size_t size, bool clear)
+{
+    // Check for bad input value
+    if (size == 0) {
+        return NULL;
+    }
+
+    // A recently freed block of the same size is used as it is
+    Header *quick_hdr;
+    if ((quick_hdr = quick_take(heap, size)) != NULL) {
+        HDR_SET_ASIZE(quick_hdr, size);
+        char *data = (char *)quick_hdr + sizeof(Header);
+        if (clear) {
+            memset(data, 0, size);
+        }
+        return data;
+    }
+
+    // Prepare header for user allocation
+    Header *best_fit_hdr;
+    if ((best_fit_hdr = heap_take_block(heap, size)) == NULL) {
+        return NULL;
+    }
+
+    // Split header when it's too large
+    size_t zero_from = hdr_zero_from(best_fit_hdr);
+    if (hdr_should_split(best_fit_hdr, size)) {
+        hdr_split(heap, best_fit_hdr, size);
+    }
+
+    // Update used header
+    HDR_SET_ASIZE(best_fit_hdr, size);
+    hdr_mark_used(best_fit_hdr);
+
+    // Return pointer to user allocated space inside used header
+    char *data = (char *)best_fit_hdr + sizeof(Header);
+    if (clear) {
+        heap_clear(data, size, zero_from);
+    }
+
+    return data;
+}
+
+/**
+ * Allocate memory with aligned data from arenas. A block with a room for
+ * the alignment is found and the slack before the aligned data is split
+ * off as a free block (as well as the rest after the data).
+ * @param heap      the heap
+ * @param alignment power of two greater than ALIGNMENT
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error.
+ * @pre size > 0
+ */
+/*
+ *           |-- slack --|    v aligned
+ *   ---+------+---------+------+XXXXXXXXXXX+------+-----+---
+ *      |Header|.........|Header|XXXXXXXXXXX|Header|.....|
+ *   ---+------+---------+------+XXXXXXXXXXX+------+-----+---
+ *      \_ free block __/                   \_ free block _/
+ */
+static
+void *heap_memalign(MmalHeap *heap, size_t alignment, size_t size)
+{
+    assert(size > 0);
+
+    // The slack is either empty or big enough for a free block
+    size_t min_slack = MIN_BLOCK_SIZE + sizeof(Header);
+    if (size > SIZE_MAX - alignment - min_slack) {
+        // Overflow
+        return NULL;
+    }
+
+    Header *hdr;
+    if ((hdr = heap_take_block(heap, BLOCK_DATA_SIZE(size) + alignment + min_slack)) == NULL) {
+        return NULL;
+    }
+
+    char *data = (char *)hdr + sizeof(Header);
+    char *aligned = (char *)ALIGN((uintptr_t)data, alignment);
+    if (aligned != data && (size_t)(aligned - data) < min_slack) {
+        aligned += alignment;
+    }
+
+    if (aligned != data) {
+        // The slack stays free, the previous block is never free here
+        // Both parts keep zero data of the block
+        size_t zero_from = hdr_zero_from(hdr);
+        size_t offset = aligned - data;
+        Header *aligned_hdr = (Header *)(aligned - sizeof(Header));
+        hdr_ctor(aligned_hdr, HDR_SIZE(hdr) - offset);
+        hdr_set_zero(aligned_hdr, (zero_from > offset) ? zero_from - offset : 0);
+        HDR_SET_SIZE(hdr, offset - sizeof(Header));
+        hdr_set_zero(hdr, zero_from);
+        hdr_mark_free(hdr);
+        bin_insert(heap, hdr);
+        hdr = aligned_hdr;
+    }
+
+    if (hdr_should_split(hdr, size)) {
+        hdr_split(heap, hdr, size);
+    }
+
+    HDR_SET_ASIZE(hdr, size);
+    hdr_mark_used(hdr);
+
+    return aligned;
+}
+
+/**
+ * Allocate blocks of the same size from arenas. The blocks are carved one
+ * after another from a single free block big enough for all of them, so
+ * the bins are searched once per batch instead of once per block. When
+ * there is no such block, a smaller one is carved as far as it goes and
+ * the rest of the batch continues with another block (or a new arena).
+ * @param heap      the heap
+ * @param size      requested size for program
+ * @param count     number of blocks
+ * @param ptrs      array for pointers to the allocated data
+ * @return number of allocated blocks, less than count only if error.
+ * @pre size > 0
+ */
+/*
+ *          |-- step ----------|
+ *   ---+------+XXXXXXXXXXXX+------+XXXXXXXXXXXX+------+XXXXXXXXXXXX+------+....+---
+ *      |Header|XXXXXXXXXXXX|Header|XXXXXXXXXXXX|Header|XXXXXXXXXXXX|Header|....|
+ *   ---+------+XXXXXXXXXXXX+------+XXXXXXXXXXXX+------+XXXXXXXXXXXX+------+....+---
+ *      ^ ptrs[0]           ^ ptrs[1]           ^ ptrs[2]           ^ rest (free)
+ */
+static
+size_t heap_malloc_batch(MmalHeap *heap, size_t size, size_t count, void **ptrs)
+{
+    assert(size > 0);
+
+    size_t step = BLOCK_DATA_SIZE(size) + sizeof(Header);
+    size_t done = 0;
+    while (done < count) {
+        // Room for the rest of the batch, at most an arena of the maximal size
+        size_t wanted = MIN(count - done, MAX(MMAL_ARENA_MAX_SIZE / step, 1));
+        size_t region = wanted * step - sizeof(Header);
+
+        Header *hdr;
+        if ((hdr = bin_find_fit(heap, region)) != NULL || (hdr = bin_find_fit(heap, size)) != NULL) {
+            heap_take_free(heap, hdr);
+        } else if ((hdr = heap_take_block(heap, region)) == NULL) {
+            break;
+        }
+
+        // The rest after the blocks is split off only when it's big enough
+        // for a free block, otherwise the last block gets it
+        size_t zero_from = hdr_zero_from(hdr);
+        size_t carved = MIN(wanted, BLOCK_SIZE(hdr) / step);
+        size_t rest = BLOCK_SIZE(hdr) - carved * step;
+        bool split = rest >= sizeof(Header) + MIN_BLOCK_SIZE;
+        for (size_t i = 0; i < carved; i++) {
+            Header *used = (Header *)((char *)hdr + i * step);
+            used->size = (i == carved - 1 && !split) ? step + rest : step;
+            HDR_SET_ASIZE(used, size);
+            hdr_mark_used(used);
+            ptrs[done++] = (char *)used + sizeof(Header);
+        }
+
+        if (split) {
+            // The rest keeps zero data of the block
+            size_t offset = carved * step;
+            Header *rest_hdr = (Header *)((char *)hdr + offset);
+            hdr_ctor(rest_hdr, rest - sizeof(Header));
+            hdr_set_zero(rest_hdr, (zero_from > offset) ? zero_from - offset : 0);
+            hdr_mark_free(rest_hdr);
+            bin_insert(heap, rest_hdr);
+        }
+    }
+
+    return done;
+}
+
+/**
+ * Checks if the pointer points to a slot of a slab arena.
+ * @param ptr       pointer to previously allocated data
+ * @return true if the data are in a slab arena
+ */
+static
+bool slab_owns(void *ptr)
+{
+    // The map is shared by heaps of other threads
+    uintptr_t index = (uintptr_t)ptr >> SLAB_ARENA_LOG2;
+    uint64_t *map = __atomic_load_n(&slab_map, __ATOMIC_ACQUIRE);
+    if (map == NULL || index >= SLAB_MAP_BITS) {
+        return false;
+    }
+
+    return (__atomic_load_n(&map[index / 64], __ATOMIC_ACQUIRE) >> (index % 64)) & 1;
+}
+
+/**
+ * Puts the run to the head of the list of runs.
+ * @param list      head of the list (of a size class or the pool)
+ * @param run       run, which isn't in any list
+ */
+static
+void slab_run_push(SlabRun **list, SlabRun *run)
+{
+    run->prev = NULL;
+    run->next = *list;
+    if (run->next != NULL) {
+        run->next->prev = run;
+    }
+    *list = run;
+}
+
+/**
+ * Maps a new slab arena and puts all its runs to the pool of free runs.
+ * @param heap      the heap
+ * @return true if successful, false if error.
+ */
+/*
+ *   /--- SLAB_ARENA_SIZE aligned
+ *   v
+ *   +-------+-----------+-------+-----------+-------+--   --+-----------+
+ *   |SlabRun|...slots...|SlabRun|...slots...|SlabRun|  ...  |...slots...|
+ *   +-------+-----------+-------+-----------+-------+--   --+-----------+
+ *
+ *   |-- SLAB_RUN_SIZE --|
+ */
+static
+bool slab_arena_alloc(MmalHeap *heap)
+{
+    // Map of slab arenas covers the whole address space, but only its
+    // pages for the used addresses are touched
+    // It's shared by all heaps, the one mapped first is kept
+    if (__atomic_load_n(&slab_map, __ATOMIC_ACQUIRE) == NULL) {
+        uint64_t *map = mmap(NULL, SLAB_MAP_BITS / 8, MMAP_PROT, MMAP_FLAGS | MAP_NORESERVE, -1, 0);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        uint64_t *no_map = NULL;
+        if (!__atomic_compare_exchange_n(&slab_map, &no_map, map, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            munmap(map, SLAB_MAP_BITS / 8);
+        }
+    }
+
+    char *arena;
+    if ((arena = map_aligned(SLAB_ARENA_SIZE, SLAB_ARENA_SIZE)) == NULL) {
+        return false;
+    }
+    heap->arenas_mapped++;
+
+    uintptr_t index = (uintptr_t)arena >> SLAB_ARENA_LOG2;
+    if (index >= SLAB_MAP_BITS) {
+        // Out of the map, nobody would recognize its slots
+        munmap(arena, SLAB_ARENA_SIZE);
+        heap->arenas_unmapped++;
+        return false;
+    }
+    __atomic_fetch_or(&slab_map[index / 64], (uint64_t)1 << (index % 64), __ATOMIC_RELEASE);
+    heap->slab_arenas++;
+    heap->empty_slab_arenas++;
+
+    for (char *run_ptr = arena; run_ptr < arena + SLAB_ARENA_SIZE; run_ptr += SLAB_RUN_SIZE) {
+        SlabRun *run = (SlabRun *)run_ptr;
+        run->size_class = SLAB_POOL;
+        slab_run_push(&heap->slab_free_runs, run);
+    }
+
+    SlabRun *first_run = (SlabRun *)arena;
+    first_run->empty_runs = SLAB_ARENA_RUNS;
+    first_run->next_arena = heap->slab_arena_list;
+    heap->slab_arena_list = first_run;
+
+    return true;
+}
+
+/**
+ * Removes the run from the list of runs with free slots (or from the pool
+ * of free runs).
+ * @param heap      the heap
+ * @param run       run in the list of its class (or in the pool)
+ */
+static
+void slab_run_unlink(MmalHeap *heap, SlabRun *run)
+{
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else if (run->size_class == SLAB_POOL) {
+        heap->slab_free_runs = run->next;
+    } else {
+        heap->slab_runs[run->size_class] = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+}
+
+/**
+ * Unlinks all runs of an empty slab arena and returns it to the OS. Its
+ * slots aren't recognized by slab_owns() anymore.
+ * @param heap      the heap
+ * @param first_run first run of the slab arena without used slots
+ */
+static
+void slab_arena_release(MmalHeap *heap, SlabRun *first_run)
+{
+    assert(first_run->empty_runs == SLAB_ARENA_RUNS);
+
+    // Empty runs are either in the pool, or the last ones of their classes
+    for (size_t i = 0; i < SLAB_ARENA_RUNS; i++) {
+        slab_run_unlink(heap, (SlabRun *)((char *)first_run + i * SLAB_RUN_SIZE));
+    }
+
+    SlabRun **link = &heap->slab_arena_list;
+    while (*link != first_run) {
+        link = &(*link)->next_arena;
+    }
+    *link = first_run->next_arena;
+
+    uintptr_t index = (uintptr_t)first_run >> SLAB_ARENA_LOG2;
+    __atomic_fetch_and(&slab_map[index / 64], ~((uint64_t)1 << (index % 64)), __ATOMIC_RELEASE);
+    munmap(first_run, SLAB_ARENA_SIZE);
+    heap->slab_arenas--;
+    heap->arenas_unmapped++;
+}
+
+/**
+ * Prepares an empty run for slots of the size class and puts it to the list
+ * of runs with free slots.
+ * @param heap          the heap
+ * @param size_class    index of the size class
+ * @return the new run or NULL if error.
+ */
+static
+SlabRun *slab_run_new(MmalHeap *heap, size_t size_class)
+{
+    if (heap->slab_free_runs == NULL && !slab_arena_alloc(heap)) {
+        return NULL;
+    }
+
+    SlabRun *run = heap->slab_free_runs;
+    slab_run_unlink(heap, run);
+    slab_run_push(&heap->slab_runs[size_class], run);
+
+    run->free_slots = NULL;
+    run->bump = RUN_SLOTS(run);
+    run->slot_size = slab_sizes[size_class];
+    run->size_class = size_class;
+    run->used = 0;
+
+    return run;
+}
+
+/**
+ * Allocates a slot for a small object.
+ * @param heap      the heap
+ * @param size      requested size for program
+ * @return pointer to the slot or NULL if error.
+ * @pre 0 < size <= SLAB_MAX_SIZE
+ */
+static
+void *slab_alloc(MmalHeap *heap, size_t size)
+{
+    assert(size > 0 && size <= SLAB_MAX_SIZE);
+
+    size_t size_class = slab_size_classes[(size + SLAB_STEP - 1) / SLAB_STEP];
+    SlabRun *run = heap->slab_runs[size_class];
+    if (run == NULL && (run = slab_run_new(heap, size_class)) == NULL) {
+        return NULL;
+    }
+
+    // Freed slots first, then the never used ones
+    void *slot = run->free_slots;
+    if (slot != NULL) {
+        run->free_slots = *(void **)slot;
+    } else {
+        slot = run->bump;
+        run->bump += run->slot_size;
+    }
+    if (run->used++ == 0) {
+        // The slab arena isn't empty anymore
+        SlabRun *first_run = SLAB_ARENA_OF(run);
+        if (first_run->empty_runs-- == SLAB_ARENA_RUNS) {
+            heap->empty_slab_arenas--;
+        }
+    }
+
+    // Full runs leave the list, they are found by masking when freed
+    if (run->free_slots == NULL && run->bump + run->slot_size > RUN_END(run)) {
+        slab_run_unlink(heap, run);
+    }
+
+    return slot;
+}
+
+/**
+ * Frees a slot of a small object.
+ * @param heap      the heap
+ * @param ptr       pointer to the slot
+ * @pre slab_owns(ptr)
+ */
+static
+void slab_free(MmalHeap *heap, void *ptr)
+{
+    assert(slab_owns(ptr));
+
+    SlabRun *run = RUN_OF(ptr);
+    bool was_full = run->free_slots == NULL && run->bump + run->slot_size > RUN_END(run);
+
+    *(void **)ptr = run->free_slots;
+    run->free_slots = ptr;
+    run->used--;
+
+    if (was_full) {
+        slab_run_push(&heap->slab_runs[run->size_class], run);
+    } else if (run->used == 0 && (run->prev != NULL || run->next != NULL)) {
+        // Empty run goes to the pool, when there is another one for the class
+        slab_run_unlink(heap, run);
+        run->size_class = SLAB_POOL;
+        slab_run_push(&heap->slab_free_runs, run);
+    }
+
+    // Completely empty slab arenas over the limit are returned to the OS
+    if (run->used == 0) {
+        SlabRun *first_run = SLAB_ARENA_OF(run);
+        if (++first_run->empty_runs == SLAB_ARENA_RUNS) {
+            if (heap->empty_slab_arenas >= arena_cache) {
+                slab_arena_release(heap, first_run);
+                return;
+            }
+            heap->empty_slab_arenas++;
+        }
+    }
+}
+
+/**
+ * Allocate memory for a small object from slab arenas or a block from
+ * general arenas.
+ * @param heap      the heap
+ * @param size      requested size for program
+ * @param clear     the data are zeroed
+ * @return pointer to allocated data or NULL if error.
+ * @pre 0 < size < mmap_threshold
+ */
+static
+void *block_alloc(MmalHeap *heap, size_t size, bool clear)
+{
+    if (size <= SLAB_MAX_SIZE) {
+        void *ptr = slab_alloc(heap, size);
+        if (ptr != NULL) {
+            if (clear) {
+                memset(ptr, 0, size);
+            }
+            return ptr;
+        }
+    }
+
+    return heap_malloc(heap, size, clear);
+}
+
+/**
+ * Free memory allocated by block_alloc().
+ * @param heap      the heap
+ * @param ptr       pointer to previously allocated data
+ */
+static
+void block_free(MmalHeap *heap, void *ptr)
+{
+    if (slab_owns(ptr)) {
+        slab_free(heap, ptr);
+    } else {
+        quick_free(heap, ptr);
+    }
+}
+
+/**
+ * Gives the size usable by the program of data allocated by block_alloc().
+ * @param ptr       pointer to previously allocated data
+ * @return usable size in bytes
+ */
+static
+size_t block_capacity(void *ptr)
+{
+    if (slab_owns(ptr)) {
+        return RUN_OF(ptr)->slot_size;
+    }
+
+    return HDR_SIZE((Header *)((char *)ptr - sizeof(Header)));
+}
+
+/**
+ * Records a sample of the heap profiler. Records are taken from chunks
+ * mapped on demand, nothing is allocated from heaps.
+ * @param size      requested size of the sampled data
+ * @param frames    call stack of the allocation
+ * @param depth     number of frames
+ * @return the live sample or NULL if there is no memory for it.
+ */
+static
+Sample *sample_add(size_t size, void **frames, int depth)
+{
+    PROFILE_LOCK();
+
+    if (free_samples == NULL) {
+        char *chunk = mmap(NULL, SAMPLE_CHUNK, MMAP_PROT, MMAP_FLAGS, -1, 0);
+        if (chunk == MAP_FAILED) {
+            PROFILE_UNLOCK();
+            return NULL;
+        }
+        for (Sample *record = (Sample *)chunk; (char *)(record + 1) <= chunk + SAMPLE_CHUNK; record++) {
+            record->next = free_samples;
+            free_samples = record;
+        }
+    }
+
+    Sample *sample = free_samples;
+    free_samples = sample->next;
+    sample->size = size;
+    sample->depth = depth;
+    memcpy(sample->frames, frames, depth * sizeof(void *));
+
+    sample->prev = NULL;
+    sample->next = samples;
+    if (samples != NULL) {
+        samples->prev = sample;
+    }
+    samples = sample;
+
+    sample_count++;
+    sample_bytes += size;
+    sample_total_count++;
+    sample_total_bytes += size;
+
+    PROFILE_UNLOCK();
+
+    return sample;
+}
+
+/**
+ * Updates the size of a sample whose data have been resized in place.
+ * Growth counts to the bytes of all samples as well.
+ * @param sample    the live sample
+ * @param size      a new requested size
+ */
+static
+void sample_resize(Sample *sample, size_t size)
+{
+    PROFILE_LOCK();
+    sample_bytes += size - sample->size;
+    if (size > sample->size) {
+        sample_total_bytes += size - sample->size;
+    }
+    sample->size = size;
+    PROFILE_UNLOCK();
+}
+
+/**
+ * Removes a sample whose data have been freed.
+ * @param sample    the live sample
+ */
+static
+void sample_release(Sample *sample)
+{
+    PROFILE_LOCK();
+
+    if (sample->prev != NULL) {
+        sample->prev->next = sample->next;
+    } else {
+        samples = sample->next;
+    }
+    if (sample->next != NULL) {
+        sample->next->prev = sample->prev;
+    }
+    sample_count--;
+    sample_bytes -= sample->size;
+
+    sample->next = free_samples;
+    free_samples = sample;
+
+    PROFILE_UNLOCK();
+}
+
+/**
+ * Keeps the mapping of freed sampled data for a next sample.
+ * @param map       the mapping
+ * @param size      size of the mapping
+ * @return true if the mapping has been kept
+ */
+static
+bool sample_map_put(char *map, size_t size)
+{
+    bool kept = false;
+
+    PROFILE_LOCK();
+    if (size <= SAMPLE_MAP_MAX && sample_map_count < SAMPLE_MAP_CACHE) {
+        sample_maps[sample_map_count] = map;
+        sample_map_sizes[sample_map_count] = size;
+        sample_map_count++;
+        kept = true;
+    }
+    PROFILE_UNLOCK();
+
+    return kept;
+}
+
+/**
+ * Takes a kept mapping of at least the given size (but not too much
+ * bigger).
+ * @param size      minimal size of the mapping, its real size on output
+ * @return the mapping or NULL if there is no such mapping.
+ */
+static
+char *sample_map_take(size_t *size)
+{
+    char *map = NULL;
+
+    PROFILE_LOCK();
+    for (size_t i = 0; i < sample_map_count; i++) {
+        if (sample_map_sizes[i] >= *size && sample_map_sizes[i] <= 2 * *size) {
+            map = sample_maps[i];
+            *size = sample_map_sizes[i];
+            sample_map_count--;
+            sample_maps[i] = sample_maps[sample_map_count];
+            sample_map_sizes[i] = sample_map_sizes[sample_map_count];
+            break;
+        }
+    }
+    PROFILE_UNLOCK();
+
+    return map;
+}
+
+/**
+ * Removes a huge block from the list of huge blocks, its mapping is to be
+ * returned to the OS.
+ * @param heap      the heap
+ * @param huge      the huge block
+ * @pre the heap is locked
+ */
+static
+void huge_unlink(MmalHeap *heap, HugeBlock *huge)
+{
+    if (huge->prev != NULL) {
+        huge->prev->next = huge->next;
+    } else {
+        heap->huge_blocks = huge->next;
+    }
+    if (huge->next != NULL) {
+        huge->next->prev = huge->prev;
+    }
+    heap->huges_unmapped++;
+}
+
+/**
+ * Returns the mapping of a huge block removed by huge_unlink() to the OS.
+ * Small mappings of sampled data are kept for next samples, a new mapping
+ * with its page faults would cost much more than the sample itself.
+ * @param huge      the huge block
+ */
+static
+void huge_unmap(HugeBlock *huge)
+{
+    if (huge->sample != NULL) {
+        sample_release(huge->sample);
+        if (sample_map_put(HUGE_MAP(huge), huge->size)) {
+            return;
+        }
+    }
+
+    munmap(HUGE_MAP(huge), huge->size);
+}
+
+/**
+ * Moves the pointer down the binary heap (ordered by addresses) to its place.
+ * @param ptrs      binary heap of pointers
+ * @param root      index of the moved pointer
+ * @param count     number of pointers in the binary heap
+ */
+static
+void ptr_sift_down(void **ptrs, size_t root, size_t count)
+{
+    void *ptr = ptrs[root];
+    size_t child;
+    while ((child = 2 * root + 1) < count) {
+        if (child + 1 < count && (uintptr_t)ptrs[child + 1] > (uintptr_t)ptrs[child]) {
+            child++;
+        }
+        if ((uintptr_t)ptrs[child] <= (uintptr_t)ptr) {
+            break;
+        }
+        ptrs[root] = ptrs[child];
+        root = child;
+    }
+    ptrs[root] = ptr;
+}
+
+/**
+ * Sorts pointers by their addresses in place. Heapsort neither recurses nor
+ * allocates memory (qsort() may call malloc()). Batches are usually freed
+ * in the order they have been allocated, so a sorted array is kept as is.
+ * @param ptrs      array of pointers
+ * @param count     number of pointers
+ */
+static
+void ptr_sort(void **ptrs, size_t count)
+{
+    size_t sorted = 1;
+    while (sorted < count && (uintptr_t)ptrs[sorted - 1] <= (uintptr_t)ptrs[sorted]) {
+        sorted++;
+    }
+    if (sorted >= count) {
+        return;
+    }
+
+    for (size_t i = count / 2; i > 0; i--) {
+        ptr_sift_down(ptrs, i - 1, count);
+    }
+    for (size_t end = count - 1; end > 0; end--) {
+        void *max = ptrs[0];
+        ptrs[0] = ptrs[end];
+        ptrs[end] = max;
+        ptr_sift_down(ptrs, 0, end);
+    }
+}
+
+/**
+ * Free blocks of the heap sorted by their addresses. Physical neighbours
+ * come one after another, such used blocks are joined in one sweep and the
+ * joined block is freed (merged with its free neighbours and put to a bin)
+ * only once.
+ * @param heap      the heap
+ * @param ptrs      sorted pointers to previously allocated data (NULL
+ *                  pointers are skipped)
+ * @param count     number of pointers
+ * @pre the heap is locked
+ */
+/*
+ *   ---+------+XXXXXX+------+XXXXXX+------+XXXXXX+------+.....+---
+ *      |Header|XXXXXX|Header|XXXXXX|Header|XXXXXX|Header|.....|
+ *   ---+------+XXXXXX+------+XXXXXX+------+XXXXXX+------+.....+---
+ *      ^ ptrs[0]     ^ ptrs[1]     ^ ptrs[2]
+ *
+ *                    \ joined, then heap_free()
+ *                     v
+ *   ---+------+...........................................+---
+ *      |Header|...........................................|
+ *   ---+------+...........................................+---
+ */
+static
+void heap_free_sorted(MmalHeap *heap, void **ptrs, size_t count)
+{
+    Header *joined = NULL;
+    for (size_t i = 0; i < count; i++) {
+        void *ptr = ptrs[i];
+        if (ptr == NULL) {
+            continue;
+        }
+        if (slab_owns(ptr)) {
+            slab_free(heap, ptr);
+            continue;
+        }
+
+        Header *hdr = (Header *)((char *)ptr - sizeof(Header));
+        if (hdr->size & HDR_MMAPPED) {
+            HugeBlock *huge = HUGE_BLOCK(hdr);
+            huge_unlink(heap, huge);
+            huge_unmap(huge);
+            continue;
+        }
+
+        // A used block physically following the joined ones is joined too
+        if (joined != NULL && PHYS_NEXT(joined) == hdr) {
+            hdr_merge(joined, hdr);
+            continue;
+        }
+        if (joined != NULL) {
+            heap_free(heap, (char *)joined + sizeof(Header));
+        }
+        joined = hdr;
+    }
+    if (joined != NULL) {
+        heap_free(heap, (char *)joined + sizeof(Header));
+    }
+}
+
+#ifdef MMAL_THREADS
+/**
+ * Queue data freed by a thread which doesn't hold the lock of the heap.
+ * Threads push with a single CAS, the queue is taken whole by the thread
+ * holding the lock (see heap_drain_remote()), so there is no ABA problem.
+ * @param heap      the heap the data have been allocated from
+ * @param first     the first data of a list linked through their first word
+ * @param last      the last data of the list (the same as first for one)
+ */
+static
+void remote_push(MmalHeap *heap, void *first, void *last)
+{
+    void *head = __atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED);
+    do {
+        *(void **)last = head;
+    } while (!__atomic_compare_exchange_n(&heap->remote_frees, &head, first, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * Lock the heap for freeing, unless the data should be queued by
+ * remote_push(). Other threads than the owner of the heap never wait for
+ * its lock. The default heap is shared by all threads, data are queued only
+ * when it's busy.
+ * @param heap      the heap
+ * @return true if the heap has been locked
+ */
+static
+bool heap_lock_free(MmalHeap *heap)
+{
+    if (heap == &default_heap) {
+        return pthread_mutex_trylock(&heap->lock) == 0;
+    }
+    if (!pthread_equal(heap->owner, pthread_self())) {
+        return false;
+    }
+
+    HEAP_LOCK(heap);
+    return true;
+}
+#endif // MMAL_THREADS
+
+/**
+ * Free data queued by other threads (MMAL_THREADS only). They are freed in
+ * sorted batches, so blocks freed one after another are merged at once.
+ * @param heap      the heap
+ * @pre the heap is locked
+ */
+static
+void heap_drain_remote(MmalHeap *heap)
+{
+#ifdef MMAL_THREADS
+    // An empty queue is only read, its cache line stays shared
+    if (__atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+
+    void *ptr = __atomic_exchange_n(&heap->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    void *batch[REMOTE_BATCH];
+    while (ptr != NULL) {
+        size_t count = 0;
+        for (; ptr != NULL && count < REMOTE_BATCH; ptr = *(void **)ptr) {
+            batch[count++] = ptr;
+        }
+        ptr_sort(batch, count);
+        heap_free_sorted(heap, batch, count);
+    }
+#else
+    (void)heap;
+#endif
+}
+
+#ifdef MMAL_THREADS
+/**
+ * Returns data of one class of the thread cache to arenas of the default
+ * heap (only its blocks are cached). When the heap is busy, the data are
+ * queued at once (see remote_push()).
+ * @param index     class of the thread cache
+ * @param count     number of cached data to return
+ * @pre 0 < count <= tcache.count[index]
+ */
+static
+void tcache_flush(size_t index, unsigned count)
+{
+    assert(count > 0 && count <= tcache.count[index]);
+
+    // The data are already linked in the stack
+    void *first = tcache.blocks[index];
+    void *last = first;
+    for (unsigned i = 1; i < count; i++) {
+        last = *(void **)last;
+    }
+    tcache.blocks[index] = *(void **)last;
+    tcache.count[index] -= count;
+
+    if (!heap_lock_free(&default_heap)) {
+        remote_push(&default_heap, first, last);
+        return;
+    }
+
+    heap_drain_remote(&default_heap);
+    void *next;
+    for (void *ptr = first; count > 0; ptr = next, count--) {
+        next = *(void **)ptr;
+        block_free(&default_heap, ptr);
+    }
+    HEAP_UNLOCK(&default_heap);
+}
+
+/**
+ * Returns the whole cache of an exiting thread to arenas.
+ * @param cache     cache of the exiting thread (unused, it's the tcache)
+ */
+static
+void tcache_destroy(void *cache)
+{
+    (void)cache;
+
+    for (size_t index = 0; index < TCACHE_CLASSES; index++) {
+        if (tcache.count[index] > 0) {
+            tcache_flush(index, tcache.count[index]);
+        }
+    }
+}
+
+/**
+ * Takes locks of all heaps before fork(), so the child doesn't get them
+ * held by a thread which doesn't exist there.
+ */
+static
+void heap_fork_prepare(void)
+{
+    HEAPS_LOCK();
+    for (MmalHeap *heap = heaps; heap != NULL; heap = heap->next) {
+        HEAP_LOCK(heap);
+    }
+    PROFILE_LOCK();
+}
+
+/**
+ * Releases the locks after fork() in the parent.
+ */
+static
+void heap_fork_parent(void)
+{
+    PROFILE_UNLOCK();
+    for (MmalHeap *heap = heaps; heap != NULL; heap = heap->next) {
+        HEAP_UNLOCK(heap);
+    }
+    HEAPS_UNLOCK();
+}
+
+/**
+ * Makes the locks usable again after fork() in the child.
+ */
+static
+void heap_fork_child(void)
+{
+    for (MmalHeap *heap = heaps; heap != NULL; heap = heap->next) {
+        pthread_mutex_init(&heap->lock, NULL);
+    }
+    pthread_mutex_init(&heaps_lock, NULL);
+    pthread_mutex_init(&profile_lock, NULL);
+}
+
+/**
+ * Creates the key used for flushing caches of exiting threads and makes
+ * heaps safe for fork().
+ */
+static
+void tcache_key_create(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+    pthread_atfork(heap_fork_prepare, heap_fork_parent, heap_fork_child);
+}
+
+/**
+ * Registers the fork() handlers when the program (or the library) is
+ * loaded, before any other thread may hold a lock. Threads allocating only
+ * blocks bypassing the thread cache would never register them otherwise.
+ */
+__attribute__((constructor))
+static
+void heap_fork_init(void)
+{
+    pthread_once(&tcache_key_once, tcache_key_create);
+}
+
+/**
+ * Registers the cache of the current thread for flushing on its exit.
+ */
+static
+void tcache_register(void)
+{
+    pthread_once(&tcache_key_once, tcache_key_create);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = true;
+}
+
+/**
+ * Puts data to the thread cache if there is a room for them.
+ * @param ptr       pointer to data (used from arenas' point of view)
+ * @param capacity  usable size of the data (see block_capacity())
+ * @return true if the data have been cached
+ */
+static
+bool tcache_push(void *ptr, size_t capacity)
+{
+    size_t index = capacity / TCACHE_STEP;
+    if (index >= TCACHE_CLASSES || tcache.count[index] == TCACHE_LIMIT) {
+        return false;
+    }
+
+    *(void **)ptr = tcache.blocks[index];
+    tcache.blocks[index] = ptr;
+    tcache.count[index]++;
+
+    return true;
+}
+
+/**
+ * Allocates data for the thread cache from the default heap. One of them is
+ * returned to the caller, the others are cached.
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error.
+ * @pre 0 < size <= TCACHE_MAX_SIZE
+ */
+static
+void *tcache_refill(size_t size)
+{
+    if (!tcache.registered) {
+        tcache_register();
+    }
+
+    HEAP_LOCK(&default_heap);
+    heap_drain_remote(&default_heap);
+    void *ptr = block_alloc(&default_heap, size, false);
+    for (unsigned i = 1; ptr != NULL && i < TCACHE_BATCH; i++) {
+        void *cached = block_alloc(&default_heap, size, false);
+        if (cached == NULL) {
+            break;
+        }
+        if (!tcache_push(cached, block_capacity(cached))) {
+            block_free(&default_heap, cached);
+            break;
+        }
+    }
+    HEAP_UNLOCK(&default_heap);
+
+    return ptr;
+}
+#endif // MMAL_THREADS
+
+/**
+ * Makes a huge block of a mapping and links it to the list of the heap.
+ * @param heap      the heap
+ * @param huge      place of the huge block in the first page of the mapping
+ * @param map_end   end of the mapping
+ * @param size      requested size for program
+ * @return pointer to the data of the block
+ */
+static
+void *huge_link(MmalHeap *heap, HugeBlock *huge, char *map_end, size_t size)
+{
+    huge->size = map_end - HUGE_MAP(huge);
+    huge->prev = NULL;
+    huge->sample = NULL;
+
+    // The block ends aligned down at the end of the mapping
+    Header *hdr = HUGE_HEADER(huge);
+    hdr->size = ((map_end - (char *)hdr) & ~HDR_FLAGS) | HDR_MMAPPED | HDR_USED;
+    HDR_SET_ASIZE(hdr, size);
+
+    HEAP_LOCK(heap);
+    heap_drain_remote(heap);
+    huge->next = heap->huge_blocks;
+    if (heap->huge_blocks != NULL) {
+        heap->huge_blocks->prev = huge;
+    }
+    heap->huge_blocks = huge;
+    heap->huges_mapped++;
+    HEAP_UNLOCK(heap);
+
+    return (char *)hdr + sizeof(Header);
+}
+
+/**
+ * Allocate a huge block with its own mapping.
+ * @param heap      the heap
+ * @param alignment power of two, data are aligned to it
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error.
+ */
+static
+void *huge_alloc(MmalHeap *heap, size_t alignment, size_t size)
+{
+    alignment = MAX(alignment, ALIGNMENT);
+    size_t slack = (alignment > ALIGNMENT) ? alignment : 0;
+    size_t map_size = ALIGN(BLOCK_DATA_SIZE(size) + HUGE_OVERHEAD + slack, OS_PAGE_SIZE);
+    if (map_size < size) {
+        // Overflow
+        return NULL;
+    }
+
+    char *map;
+    if ((map = mmap(NULL, map_size, MMAP_PROT, MMAP_FLAGS, -1, 0)) == MAP_FAILED) {
+        return NULL;
+    }
+
+    // Whole pages before and after the aligned block are unmapped
+    char *data = (char *)ALIGN((uintptr_t)map + HUGE_OVERHEAD, alignment);
+    HugeBlock *huge = HUGE_BLOCK(data - sizeof(Header));
+    char *map_end = map + map_size;
+    if (slack > 0) {
+        char *start = HUGE_MAP(huge);
+        char *end = (char *)ALIGN((uintptr_t)data + BLOCK_DATA_SIZE(size), OS_PAGE_SIZE);
+        if (start > map) {
+            munmap(map, start - map);
+        }
+        if (end < map_end) {
+            munmap(end, map_end - end);
+        }
+        map_end = end;
+    }
+
+    return huge_link(heap, huge, map_end, size);
+}
+
+/**
+ * Free a huge block and return its mapping to the OS. With MMAL_THREADS,
+ * other threads than the owner of the heap queue the block like other data
+ * (see heap_lock_free()), the next allocation from the heap unmaps it.
+ * @param heap      the heap
+ * @param hdr       header of the huge block
+ * @pre hdr->size & HDR_MMAPPED
+ */
+static
+void huge_free(MmalHeap *heap, Header *hdr)
+{
+    assert(hdr->size & HDR_MMAPPED);
+
+    HugeBlock *huge = HUGE_BLOCK(hdr);
+
+#ifdef MMAL_THREADS
+    if (!heap_lock_free(heap)) {
+        // A busy default heap is waited for, its queue may not be drained
+        // for a long time and the mapping would stay
+        if (heap != &default_heap) {
+            remote_push(heap, (char *)hdr + sizeof(Header), (char *)hdr + sizeof(Header));
+            return;
+        }
+        HEAP_LOCK(heap);
+    }
+#else
+    HEAP_LOCK(heap);
+#endif
+    heap_drain_remote(heap);
+    huge_unlink(heap, huge);
+    HEAP_UNLOCK(heap);
+
+    huge_unmap(huge);
+}
+
+/**
+ * Resize a huge block with mremap, so the data are never copied.
+ * @param heap      the heap
+ * @param hdr       header of the huge block
+ * @param size      a new requested size
+ * @return pointer to the resized data (may be moved) or NULL if error.
+ * @pre hdr->size & HDR_MMAPPED
+ */
+static
+void *huge_resize(MmalHeap *heap, Header *hdr, size_t size)
+{
+    assert(hdr->size & HDR_MMAPPED);
+
+    HugeBlock *huge = HUGE_BLOCK(hdr);
+    size_t offset = (char *)huge - HUGE_MAP(huge);
+    size_t map_size = ALIGN(offset + BLOCK_DATA_SIZE(size) + HUGE_OVERHEAD, OS_PAGE_SIZE);
+    if (map_size < size) {
+        // Overflow
+        return NULL;
+    }
+
+    if (map_size != huge->size) {
+        char *new_map;
+        if ((new_map = mremap(HUGE_MAP(huge), huge->size, map_size, MREMAP_MAYMOVE)) == MAP_FAILED) {
+            return NULL;
+        }
+        HugeBlock *new_huge = (HugeBlock *)(new_map + offset);
+
+        // Relink the (possibly moved) block
+        if (new_huge->prev != NULL) {
+            new_huge->prev->next = new_huge;
+        } else {
+            heap->huge_blocks = new_huge;
+        }
+        if (new_huge->next != NULL) {
+            new_huge->next->prev = new_huge;
+        }
+
+        new_huge->size = map_size;
+        hdr = HUGE_HEADER(new_huge);
+        hdr->size = ((new_map + map_size - (char *)hdr) & ~HDR_FLAGS) | HDR_MMAPPED | HDR_USED;
+    }
+    HDR_SET_ASIZE(hdr, size);
+
+    if (HUGE_BLOCK(hdr)->sample != NULL) {
+        sample_resize(HUGE_BLOCK(hdr)->sample, size);
+    }
+
+    return (char *)hdr + sizeof(Header);
+}
+
+/**
+ * Gives the number of bytes until the next sample. It's exponentially
+ * distributed with the mean sample_interval, so every allocated byte is
+ * sampled with the same probability (big allocations more often) and the
+ * sampling can't resonate with patterns of the program. The logarithm is
+ * computed without libm (ln m = 2 atanh((m - 1) / (m + 1)) for m in [1, 2)).
+ * @return bytes until the next sample (SAMPLE_RECHECK if the profiler is
+ * disabled)
+ */
+static
+size_t sample_next(void)
+{
+    size_t interval = __atomic_load_n(&sample_interval, __ATOMIC_RELAXED);
+    if (interval == 0) {
+        return SAMPLE_RECHECK;
+    }
+
+    // xorshift64, seeded by the address of the state (different in threads)
+    if (sample_random == 0) {
+        sample_random = (uintptr_t)&sample_random ^ 0x9e3779b97f4a7c15ULL;
+    }
+    sample_random ^= sample_random << 13;
+    sample_random ^= sample_random >> 7;
+    sample_random ^= sample_random << 17;
+
+    // u = r / 2^53 is uniform in (0, 1], -ln u = 53 ln 2 - ln r
+    uint64_t r = (sample_random >> 11) + 1;
+    int exponent = 63 - __builtin_clzll(r);
+    double m = (double)r / (double)((uint64_t)1 << exponent);
+    double t = (m - 1.0) / (m + 1.0);
+    double t2 = t * t;
+    double ln_m = 2.0 * t * (1.0 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7))));
+    double ln_r = exponent * 0.6931471805599453 + ln_m;
+    double bytes = interval * (53 * 0.6931471805599453 - ln_r);
+
+    return (bytes < (double)(SIZE_MAX / 2)) ? (size_t)bytes + 1 : SIZE_MAX / 2;
+}
+
+/**
+ * Slow path of the heap profiler, the countdown of the thread has run out
+ * (see mmalloc()). The allocation is sampled if the profiler is enabled,
+ * a requested profile is dumped here as well (outside of the signal).
+ * @param size      requested size for program
+ * @param clear     the data are zeroed
+ * @return pointer to sampled data or NULL if the allocation isn't sampled.
+ */
+__attribute__((noinline))
+static
+void *sample_alloc(size_t size, bool clear)
+{
+    sample_countdown = sample_next();
+
+    if (profile_requested) {
+        profile_requested = 0;
+        int fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            mmal_profile_dump(fd);
+            close(fd);
+        }
+    }
+
+    if (__atomic_load_n(&sample_interval, __ATOMIC_RELAXED) == 0 || size == 0) {
+        return NULL;
+    }
+
+    // The first frame is this function
+    void *frames[SAMPLE_DEPTH + 1];
+    int depth = backtrace(frames, SAMPLE_DEPTH + 1);
+
+    // Mappings of freed samples are reused, only new ones are zero
+    void *ptr;
+    size_t map_size = ALIGN(BLOCK_DATA_SIZE(size) + HUGE_OVERHEAD, OS_PAGE_SIZE);
+    char *map = (size <= SAMPLE_MAP_MAX) ? sample_map_take(&map_size) : NULL;
+    if (map != NULL) {
+        ptr = huge_link(&default_heap, (HugeBlock *)map, map + map_size, size);
+        if (clear) {
+            memset(ptr, 0, size);
+        }
+    } else {
+        ptr = huge_alloc(&default_heap, ALIGNMENT, size);
+    }
+
+    if (ptr != NULL && depth > 1) {
+        HugeBlock *huge = HUGE_BLOCK((Header *)((char *)ptr - sizeof(Header)));
+        huge->sample = sample_add(size, frames + 1, depth - 1);
+    }
+
+    return ptr;
+}
+
+/**
+ * Counts the allocation to the countdown of the heap profiler, which costs
+ * a single branch until the countdown runs out.
+ * @param size      requested size for program
+ * @return true if the allocation should be sampled (see sample_alloc())
+ */
+static inline
+bool sample_due(size_t size)
+{
+    if (__builtin_expect(size >= sample_countdown, 0)) {
+        return true;
+    }
+
+    sample_countdown -= size;
+    return false;
+}
+
+/**
+ * Allocate memory. Small objects get a slot in a slab arena, bigger blocks
+ * use segregated fit search of available block. Huge blocks (see
+ * mmal_set_mmap_threshold()) get their own mapping.
+ * When built with MMAL_THREADS, small blocks are taken from the cache
+ * of the calling thread without any locking.
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+void *mmalloc(size_t size)
+{
+    void *sampled;
+    if (sample_due(size) && (sampled = sample_alloc(size, false)) != NULL) {
+        return sampled;
+    }
+
+#ifdef MMAL_THREADS
+    if (size > 0 && size <= TCACHE_MAX_SIZE && size < mmap_threshold) {
+        size_t capacity = (size <= SLAB_MAX_SIZE)
+            ? slab_sizes[slab_size_classes[(size + SLAB_STEP - 1) / SLAB_STEP]]
+            : BLOCK_DATA_SIZE(size);
+        size_t index = capacity / TCACHE_STEP;
+        void *ptr = tcache.blocks[index];
+        if (ptr == NULL) {
+            return tcache_refill(size);
+        }
+
+        tcache.blocks[index] = *(void **)ptr;
+        tcache.count[index]--;
+        if (size > SLAB_MAX_SIZE) {
+            HDR_SET_ASIZE((Header *)((char *)ptr - sizeof(Header)), size);
+        }
+
+        return ptr;
+    }
+#endif
+
+    return mmal_heap_malloc(&default_heap, size);
+}
+
+/**
+ * Allocate zeroed memory for an array. Only the data which could be dirty
+ * are zeroed: memory never touched since it was mapped is skipped, huge
+ * blocks come from fresh mappings and aren't touched at all.
+ * @param count     number of elements
+ * @param size      size of an element
+ * @return pointer to allocated data or NULL if error, overflow or the total
+ * size = 0.
+ */
+void *mcalloc(size_t count, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total) || total == 0) {
+        return NULL;
+    }
+
+#ifdef MMAL_THREADS
+    if (total <= TCACHE_MAX_SIZE) {
+        void *ptr = mmalloc(total);
+        if (ptr != NULL) {
+            memset(ptr, 0, total);
+        }
+        return ptr;
+    }
+#endif
+
+    void *sampled;
+    if (sample_due(total) && (sampled = sample_alloc(total, true)) != NULL) {
+        return sampled;
+    }
+
+    if (total >= mmap_threshold) {
+        return huge_alloc(&default_heap, ALIGNMENT, total);
+    }
+
+    HEAP_LOCK(&default_heap);
+    void *ptr = block_alloc(&default_heap, total, true);
+    HEAP_UNLOCK(&default_heap);
+
+    return ptr;
+}
+
+/**
+ * Allocate memory with data aligned to the given alignment. The slack before
+ * the aligned data is returned to arenas as a free block.
+ * @param alignment power of two
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error, size = 0 or alignment
+ * isn't a power of two.
+ */
+void *mmemalign(size_t alignment, size_t size)
+{
+    if (size == 0 || alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        return NULL;
+    }
+
+    if (alignment <= ALIGNMENT) {
+        return mmalloc(size);
+    }
+
+    // Slack of huge blocks is returned to the OS
+    if (alignment >= mmap_threshold || size >= mmap_threshold - alignment) {
+        return huge_alloc(&default_heap, alignment, size);
+    }
+
+    HEAP_LOCK(&default_heap);
+    void *ptr = heap_memalign(&default_heap, alignment, size);
+    HEAP_UNLOCK(&default_heap);
+
+    return ptr;
+}
+
+/**
+ * Allocate memory with aligned data (C11 interface of mmemalign()).
+ * @param alignment power of two
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error.
+ */
+void *maligned_alloc(size_t alignment, size_t size)
+{
+    return mmemalign(alignment, size);
+}
+
+/**
+ * Allocate memory with aligned data (POSIX interface of mmemalign()).
+ * @param memptr    output for the pointer to allocated data (NULL for size 0)
+ * @param alignment power of two and a multiple of sizeof(void *)
+ * @param size      requested size for program
+ * @return 0 if successful, EINVAL for a bad alignment, ENOMEM if error.
+ */
+int mposix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) {
+        return EINVAL;
+    }
+
+    void *ptr = NULL;
+    if (size > 0 && (ptr = mmemalign(alignment, size)) == NULL) {
+        return ENOMEM;
+    }
+
+    *memptr = ptr;
+    return 0;
+}
+
+/**
+ * Free memory block.
+ * When built with MMAL_THREADS, small blocks go to the cache of the calling
+ * thread without any locking. Only a full cache is flushed in a batch.
+ * @param ptr       pointer to previously allocated data
+ * @pre ptr != NULL
+ */
+void mfree(void *ptr)
+{
+#ifdef MMAL_THREADS
+    // Slots of slab arenas have no header
+    bool slab = slab_owns(ptr);
+    Header *hdr = (Header *)((char *)ptr - sizeof(Header));
+
+    // Neighbours may change flags of the header (under the lock) meanwhile,
+    // but the size of a used block is changed only by its owner
+    size_t capacity = slab ? RUN_OF(ptr)->slot_size : HDR_SIZE(hdr);
+    size_t index = capacity / TCACHE_STEP;
+    if (index < TCACHE_CLASSES && (slab || !(hdr->size & HDR_MMAPPED))) {
+        if (!tcache.registered) {
+            tcache_register();
+        }
+        if (tcache.count[index] == TCACHE_LIMIT) {
+            tcache_flush(index, TCACHE_BATCH);
+        }
+
+        tcache_push(ptr, capacity);
+        return;
+    }
+#endif
+
+    mmal_heap_free(&default_heap, ptr);
+}
+
+/**
+ * Allocate blocks of the same size at once. The heap is locked only once
+ * and blocks of arenas are carved from one free block in a single pass
+ * (see heap_malloc_batch()), so they lie one after another. Blocks for
+ * the thread cache (MMAL_THREADS) aren't used.
+ * @param size      requested size for program
+ * @param count     number of blocks
+ * @param ptrs      array for pointers to the allocated data
+ * @return number of allocated blocks, less than count only if error
+ * (0 if size = 0).
+ */
+size_t mmalloc_batch(size_t size, size_t count, void **ptrs)
+{
+    size_t done = 0;
+    if (size == 0) {
+        return 0;
+    }
+
+    if (size >= mmap_threshold) {
+        while (done < count && (ptrs[done] = huge_alloc(&default_heap, ALIGNMENT, size)) != NULL) {
+            done++;
+        }
+        return done;
+    }
+
+    HEAP_LOCK(&default_heap);
+    heap_drain_remote(&default_heap);
+    if (size <= SLAB_MAX_SIZE) {
+        while (done < count && (ptrs[done] = slab_alloc(&default_heap, size)) != NULL) {
+            done++;
+        }
+    }
+    done += heap_malloc_batch(&default_heap, size, count - done, ptrs + done);
+    HEAP_UNLOCK(&default_heap);
+
+    return done;
+}
+
+/**
+ * Free blocks at once. The pointers are sorted by their addresses (see
+ * ptr_sort()), so neighbouring blocks are freed together. The heap is
+ * locked only once and the thread cache (MMAL_THREADS) isn't used.
+ * @param ptrs      pointers to previously allocated data (NULL pointers are
+ *                  skipped), the array is reordered
+ * @param count     number of pointers
+ */
+void mfree_batch(void **ptrs, size_t count)
+{
+    ptr_sort(ptrs, count);
+
+    HEAP_LOCK(&default_heap);
+    heap_drain_remote(&default_heap);
+    heap_free_sorted(&default_heap, ptrs, count);
+    HEAP_UNLOCK(&default_heap);
+}
+
+/**
+ * Resize the block in place if it's possible. Shrinking releases the rest
+ * of the block, growing absorbs the physically next free block. The only
+ * used block of an arena grows with the arena (see arena_grow()) and huge
+ * blocks are resized with their mappings.
+ * @param heap      the heap
+ * @param ptr       pointer to previously allocated data
+ * @param size      a new requested size
+ * @return pointer to the resized block (the same as ptr unless the arena
+ * has been moved) or NULL if the block can't be resized in place.
+ * @pre size > 0
+ */
+static
+void *heap_resize(MmalHeap *heap, void *ptr, size_t size)
+{
+    assert(size > 0);
+
+    Header *hdr = (Header *)((char *)ptr - sizeof(Header));
+
+    if (hdr->size & HDR_MMAPPED) {
+        return huge_resize(heap, hdr, size);
+    }
+
+    // Block is big enough for containing data of the new size
+    // The rest is released, when it's big enough for another block
+    if (HDR_SIZE(hdr) >= size) {
+        if (hdr_should_split(hdr, size)) {
+            Header *rest_hdr = hdr_split(heap, hdr, size);
+
+            Header *next_hdr = PHYS_NEXT(rest_hdr);
+            if (hdr_can_merge(rest_hdr, next_hdr)) {
+                bin_remove(heap, rest_hdr);
+                bin_remove(heap, next_hdr);
+                hdr_merge(rest_hdr, next_hdr);
+                hdr_mark_free(rest_hdr);
+                bin_insert(heap, rest_hdr);
+            }
+        }
+        HDR_SET_ASIZE(hdr, size);
+
+        return ptr;
+    }
+
+    // Absorb the physically next free block, when it's big enough
+    Header *next_hdr = PHYS_NEXT(hdr);
+    Header *fence = next_hdr;
+    if (HDR_IS_FREE(next_hdr)) {
+        if (HDR_SIZE(hdr) + BLOCK_SIZE(next_hdr) >= size) {
+            bin_remove(heap, next_hdr);
+            hdr_merge(hdr, next_hdr);
+            hdr_mark_used(hdr);
+
+            if (hdr_should_split(hdr, size)) {
+                hdr_split(heap, hdr, size);
+            }
+            HDR_SET_ASIZE(hdr, size);
+
+            return ptr;
+        }
+        fence = PHYS_NEXT(next_hdr);
+    }
+
+    // The only used block of its arena (the fence points back to its arena)
+    if (hdr_spans_arena(hdr, fence)) {
+        return arena_grow(heap, hdr, size);
+    }
+
+    return NULL;
+}
+
+/**
+ * Resize data of the heap in place if it's possible (see heap_resize()).
+ * @param heap      the heap
+ * @param ptr       pointer to previously allocated data
+ * @param size      a new requested size
+ * @return pointer to the resized data or NULL if they have to be moved.
+ * @pre size > 0
+ */
+static
+void *block_resize(MmalHeap *heap, void *ptr, size_t size)
+{
+    // Slots of slab arenas can't grow
+    if (slab_owns(ptr)) {
+        return (size <= block_capacity(ptr)) ? ptr : NULL;
+    }
+
+    HEAP_LOCK(heap);
+    void *new_ptr = heap_resize(heap, ptr, size);
+    HEAP_UNLOCK(heap);
+
+    return new_ptr;
+}
+
+/**
+ * Reallocate previously allocated block. The block is resized in place
+ * when possible, otherwise data are moved to a new block.
+ * @param ptr       pointer to previously allocated data (NULL works as mmalloc)
+ * @param size      a new requested size. Size can be greater, equal, or less
+ * then size of previously allocated block.
+ * @return pointer to reallocated space or NULL if size equals to 0 or if error.
+ * The original block stays untouched in case of error.
+ * @post header_of(return pointer)->asize == size (DEBUG mode only)
+ */
+void *mrealloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return mmalloc(size);
+    }
+
+    if (size == 0) {
+        mfree(ptr);
+        return NULL;
+    }
+
+    void *new_ptr;
+    size_t capacity = block_capacity(ptr);
+    if ((new_ptr = block_resize(&default_heap, ptr, size)) != NULL) {
+        return new_ptr;
+    }
+
+    // The block can't be resized in place --> data have to be moved (even
+    // a shrinking huge block, when mremap fails)
+    if ((new_ptr = mmalloc(size)) == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, MIN(capacity, size));
+    mfree(ptr);
+
+    return new_ptr;
+}
+
+/**
+ * Create an independent heap. Its metadata have their own mapping and
+ * arenas are mapped on the first allocation.
+ * @return the heap or NULL if error.
+ */
+MmalHeap *mmal_heap_create(void)
+{
+    // All the lists of a new mapping are empty (NULL)
+    MmalHeap *heap;
+    if ((heap = mmap(NULL, sizeof(MmalHeap), MMAP_PROT, MMAP_FLAGS, -1, 0)) == MAP_FAILED) {
+        return NULL;
+    }
+
+#ifdef MMAL_THREADS
+    pthread_mutex_init(&heap->lock, NULL);
+    heap->owner = pthread_self();
+    pthread_once(&tcache_key_once, tcache_key_create);
+#endif
+
+    HEAPS_LOCK();
+    heap->next = heaps;
+    heaps = heap;
+    HEAPS_UNLOCK();
+
+    return heap;
+}
+
+/**
+ * Allocate memory from the heap (see mmalloc()). Caches of threads aren't
+ * used, the heap is locked instead. Data freed by other threads meanwhile
+ * are freed first.
+ * @param heap      the heap
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+void *mmal_heap_malloc(MmalHeap *heap, size_t size)
+{
+    // Check for bad input value
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (size >= mmap_threshold) {
+        return huge_alloc(heap, ALIGNMENT, size);
+    }
+
+    HEAP_LOCK(heap);
+    heap_drain_remote(heap);
+    void *ptr = block_alloc(heap, size, false);
+    HEAP_UNLOCK(heap);
+
+    return ptr;
+}
+
+/**
+ * Free memory block of the heap. With MMAL_THREADS, other threads than the
+ * owner of the heap (its creator) don't take its lock, the data are queued
+ * for the next allocation from the heap (see heap_lock_free()).
+ * @param heap      the heap the data have been allocated from
+ * @param ptr       pointer to previously allocated data
+ * @pre ptr != NULL
+ */
+void mmal_heap_free(MmalHeap *heap, void *ptr)
+{
+    // Slots of slab arenas have no header, the owner of the heap may change
+    // other flags of the header meanwhile
+    Header *hdr = (Header *)((char *)ptr - sizeof(Header));
+    if (!slab_owns(ptr) && (hdr->size & HDR_MMAPPED)) {
+        huge_free(heap, hdr);
+        return;
+    }
+
+#ifdef MMAL_THREADS
+    if (!heap_lock_free(heap)) {
+        remote_push(heap, ptr, ptr);
+        return;
+    }
+#endif
+    heap_drain_remote(heap);
+    block_free(heap, ptr);
+    HEAP_UNLOCK(heap);
+}
+
+/**
+ * Reallocate previously allocated block of the heap (see mrealloc()).
+ * @param heap      the heap the data have been allocated from
+ * @param ptr       pointer to previously allocated data (NULL works as
+ *                  mmal_heap_malloc())
+ * @param size      a new requested size
+ * @return pointer to reallocated space or NULL if size equals to 0 or if error.
+ * The original block stays untouched in case of error.
+ */
+void *mmal_heap_realloc(MmalHeap *heap, void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return mmal_heap_malloc(heap, size);
+    }
+
+    if (size == 0) {
+        mmal_heap_free(heap, ptr);
+        return NULL;
+    }
+
+    void *new_ptr;
+    size_t capacity = block_capacity(ptr);
+    if ((new_ptr = block_resize(heap, ptr, size)) != NULL) {
+        return new_ptr;
+    }
+
+    if ((new_ptr = mmal_heap_malloc(heap, size)) == NULL) {
+        return NULL;
+    }
+
+    memcpy(new_ptr, ptr, MIN(capacity, size));
+    mmal_heap_free(heap, ptr);
+
+    return new_ptr;
+}
+
+/**
+ * Destroy the heap with all its data. Every mapping of the heap is returned
+ * to the OS, no block is visited.
+ * @param heap      the heap, which isn't used by any other thread
+ * @pre heap isn't the default heap
+ */
+void mmal_heap_destroy(MmalHeap *heap)
+{
+    assert(heap != &default_heap);
+
+    HEAPS_LOCK();
+    MmalHeap **link = &heaps;
+    while (*link != heap) {
+        link = &(*link)->next;
+    }
+    *link = heap->next;
+    HEAPS_UNLOCK();
+
+    Arena *next_arena;
+    for (Arena *arena = heap->arenas; arena != NULL; arena = next_arena) {
+        next_arena = arena->next;
+        munmap(arena, arena->size);
+    }
+
+    HugeBlock *next_huge;
+    for (HugeBlock *huge = heap->huge_blocks; huge != NULL; huge = next_huge) {
+        next_huge = huge->next;
+        munmap(HUGE_MAP(huge), huge->size);
+    }
+
+    // Slots of unmapped slab arenas mustn't be recognized anymore
+    SlabRun *next_run;
+    for (SlabRun *run = heap->slab_arena_list; run != NULL; run = next_run) {
+        next_run = run->next_arena;
+        uintptr_t index = (uintptr_t)run >> SLAB_ARENA_LOG2;
+        __atomic_fetch_and(&slab_map[index / 64], ~((uint64_t)1 << (index % 64)), __ATOMIC_RELEASE);
+        munmap(run, SLAB_ARENA_SIZE);
+    }
+
+#ifdef MMAL_THREADS
+    pthread_mutex_destroy(&heap->lock);
+#endif
+    munmap(heap, sizeof(MmalHeap));
+}
+
+/**
+ * Maps a new chunk of a region. Chunks are arenas outside the arena list,
+ * they have neither headers nor the fence.
+ * @param size      requested size of the chunk
+ * @return the chunk or NULL if error.
+ */
+/*
+ *   +-----+----------+XXXXXXXXXXXXXXXXXXXXX+.................+
+ *   |Arena|MmalRegion|XXXXXXXXXXXXXXXXXXXXX|.................|  first chunk
+ *   +-----+----------+XXXXXXXXXXXXXXXXXXXXX+.................+
+ *      | next                              ^ bump            ^ end
+ *      v
+ *   +-----+XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX+
+ *   |Arena|XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX|
+ *   +-----+XXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXXX+
+ */
+static
+Arena *region_chunk_alloc(size_t size)
+{
+    HEAP_LOCK(&default_heap);
+    Arena *chunk = arena_alloc(&default_heap, size);
+    if (chunk != NULL) {
+        default_heap.region_bytes += chunk->size;
+    }
+    HEAP_UNLOCK(&default_heap);
+
+    return chunk;
+}
+
+/**
+ * Sets the region to allocate from the data of the chunk.
+ * @param region    the region
+ * @param chunk     chunk of the region
+ * @param data      the first free byte of the chunk
+ */
+static
+void region_use_chunk(MmalRegion *region, Arena *chunk, char *data)
+{
+    region->chunk = chunk;
+    region->bump = data;
+    region->end = (char *)chunk + chunk->size;
+}
+
+/**
+ * Create a region with its first chunk.
+ * @return the region or NULL if error.
+ */
+MmalRegion *mmal_region_create(void)
+{
+    Arena *chunk;
+    if ((chunk = region_chunk_alloc(PAGE_SIZE)) == NULL) {
+        return NULL;
+    }
+
+    MmalRegion *region = (MmalRegion *)((char *)chunk + REGION_DATA_OFFSET);
+    mmal_region_reset(region);
+
+    return region;
+}
+
+/**
+ * Allocate data of a region, which don't fit to the rest of its current
+ * chunk (the slow path of mmal_region_alloc()). Chunks kept by
+ * mmal_region_reset() are used first, then a new chunk twice as big as
+ * the last one is mapped. The rest of the current chunk stays unused until
+ * the region is reset.
+ * @param region    the region
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+void *mmal_region_grow(MmalRegion *region, size_t size)
+{
+    if (size == 0 || size > SIZE_MAX - REGION_DATA_OFFSET - OS_HUGE_PAGE_SIZE) {
+        return NULL;
+    }
+    size = ALIGN(size, MMAL_REGION_ALIGNMENT);
+
+    // Chunks following the current one are free (after a reset)
+    Arena *chunk = region->chunk;
+    while (chunk->next != NULL) {
+        chunk = chunk->next;
+        if (chunk->size - REGION_DATA_OFFSET >= size) {
+            region_use_chunk(region, chunk, (char *)chunk + REGION_DATA_OFFSET);
+            return mmal_region_alloc(region, size);
+        }
+    }
+
+    Arena *new_chunk;
+    size_t chunk_size = MAX(size + REGION_DATA_OFFSET, MIN(2 * chunk->size, MMAL_ARENA_MAX_SIZE));
+    if ((new_chunk = region_chunk_alloc(chunk_size)) == NULL) {
+        return NULL;
+    }
+    chunk->next = new_chunk;
+    region_use_chunk(region, new_chunk, (char *)new_chunk + REGION_DATA_OFFSET);
+
+    return mmal_region_alloc(region, size);
+}
+
+/**
+ * Free all data of a region at once. Its chunks are kept for reuse.
+ * @param region    the region
  */
-#define FIRST_HEADER(arena) ((Header *)((char *)(arena) + sizeof(Arena)))
+void mmal_region_reset(MmalRegion *region)
+{
+    Arena *first = (Arena *)((char *)region - REGION_DATA_OFFSET);
+    region_use_chunk(region, first, (char *)region + ALIGN(sizeof(MmalRegion), MMAL_REGION_ALIGNMENT));
+}
+
 /**
- * Gives the next header
- * @param current Current header
- * @param offset Offset from the end of current header (or size stored in current header)
+ * Free all data of a region and the region itself. Its chunks are returned
+ * to the OS.
+ * @param region    the region
  */
-#define NEXT_HEADER(current, offset) ((Header *)((char *)(current) + sizeof(Header) + (offset)))
+void mmal_region_destroy(MmalRegion *region)
+{
+    Arena *chunk = (Arena *)((char *)region - REGION_DATA_OFFSET);
+
+    HEAP_LOCK(&default_heap);
+    while (chunk != NULL) {
+        Arena *next = chunk->next;
+        default_heap.region_bytes -= chunk->size;
+        munmap(chunk, chunk->size);
+        default_heap.arenas_unmapped++;
+        chunk = next;
+    }
+    HEAP_UNLOCK(&default_heap);
+}
 
 /**
- * First arena of allocated memory from OS
+ * Set the number of completely free arenas kept mapped for later use.
+ * Free arenas over the limit are returned to the OS immediately. Quick lists
+ * are coalesced first, so arenas held only by them are released as well.
+ * @param count     maximum number of cached free arenas
  */
-Arena *first_arena = NULL;
+void mmal_set_arena_cache(size_t count)
+{
+    HEAPS_LOCK();
+
+    arena_cache = count;
+
+    for (MmalHeap *heap = heaps; heap != NULL; heap = heap->next) {
+        HEAP_LOCK(heap);
+        quick_coalesce_all(heap);
+
+        SlabRun *next_slab;
+        for (SlabRun *first_run = heap->slab_arena_list; first_run != NULL && heap->empty_slab_arenas > arena_cache; first_run = next_slab) {
+            next_slab = first_run->next_arena;
+            if (first_run->empty_runs == SLAB_ARENA_RUNS) {
+                heap->empty_slab_arenas--;
+                slab_arena_release(heap, first_run);
+            }
+        }
+
+        Arena *next_arena;
+        for (Arena *arena = heap->arenas; arena != NULL && heap->empty_arenas > arena_cache; arena = next_arena) {
+            next_arena = arena->next;
+
+            Header *hdr = FIRST_HEADER(arena);
+            if (HDR_IS_FREE(hdr) && arena_is_empty(hdr)) {
+                bin_remove(heap, hdr);
+                heap->empty_arenas--;
+                arena_release(heap, arena);
+            }
+        }
+
+        HEAP_UNLOCK(heap);
+    }
+
+    HEAPS_UNLOCK();
+}
 
 /**
- * Return size alligned to PAGE_SIZE
+ * Set how often pages of large free blocks are returned to the OS.
+ * @param bytes     number of bytes freed between two purges (0 purges
+ *                  on every mfree() of a large block, SIZE_MAX never)
  */
-size_t allign_page(size_t size)
+void mmal_set_purge_interval(size_t bytes)
 {
-    return ALIGN(size, PAGE_SIZE);
+    HEAPS_LOCK();
+    purge_interval = bytes;
+    HEAPS_UNLOCK();
 }
 
 /**
- * Allocate a new arena using mmap.
- * @param req_size requested size in bytes. Should be alligned to PAGE_SIZE.
- * @return pointer to a new arena, if successfull. NULL if error.
- * @pre req_size > sizeof(Arena) + sizeof(Header) + MIN_BLOCK_SIZE
+ * Set the size from which blocks get their own mapping outside arenas.
+ * Such blocks don't slow down searches of free blocks, they are returned
+ * to the OS by mfree() and resized with mremap.
+ * @param size      minimal size of huge blocks (SIZE_MAX disables them)
  */
+void mmal_set_mmap_threshold(size_t size)
+{
+    HEAPS_LOCK();
+    mmap_threshold = size;
+    HEAPS_UNLOCK();
+}
 
-/*
- *   +-----+------------------------------------+
- *   |Arena|....................................|
- *   +-----+------------------------------------+
- *
- *   |--------------- Arena.size ---------------|
+/**
+ * Set options of arenas mapped from now on (they override the environment
+ * variable MMAL_ARENA_OPTIONS).
+ * @param options   MMAL_ARENA_THP, MMAL_ARENA_HUGETLB, MMAL_ARENA_POPULATE
+ *                  or their combination (0 for usual pages)
  */
-static
-Arena *arena_alloc(size_t req_size)
+void mmal_set_arena_options(unsigned options)
 {
-    assert(req_size > sizeof(Arena) + sizeof(Header) + MIN_BLOCK_SIZE);
+    HEAPS_LOCK();
+    arena_options = options;
+    arena_options_set = true;
+    HEAPS_UNLOCK();
+}
 
-    size_t aligned_size = allign_page(req_size);
+/**
+ * Set the mean number of bytes between two allocations sampled by the heap
+ * profiler. Threads start using the interval within SAMPLE_RECHECK bytes
+ * of their allocations, the calling thread immediately.
+ * @param bytes     mean interval (0 disables the profiler, live samples are
+ *                  kept until their data are freed)
+ */
+void mmal_set_sample_interval(size_t bytes)
+{
+    if (bytes > 0) {
+        // backtrace() loads its unwinder on the first call, which allocates
+        void *frame;
+        backtrace(&frame, 1);
 
-    // Allocate new arena with mmap
-    Arena *arena;
-    if ((arena = mmap(NULL, aligned_size, MMAP_PROT, MMAP_FLAGS, -1, 0)) == MAP_FAILED) {
-        return NULL;
+        PROFILE_LOCK();
+        sample_period = bytes;
+        PROFILE_UNLOCK();
     }
 
-    arena->size = aligned_size;
-    arena->next = NULL;
+#ifdef MMAL_THREADS
+    // The lock of samples is handled by fork() handlers
+    pthread_once(&tcache_key_once, tcache_key_create);
+#endif
 
-    return arena;
+    __atomic_store_n(&sample_interval, bytes, __ATOMIC_RELAXED);
+    sample_countdown = sample_next();
 }
 
 /**
- * Appends a new arena to the end of the arena list.
- * @param a     already allocated arena
+ * Buffered writer of profiles. Nothing is allocated, profiles are written
+ * from inside of the allocator as well.
+ */
+typedef struct profile_writer ProfileWriter;
+struct profile_writer {
+
+    /// Output file
+    int fd;
+
+    /// Number of buffered bytes
+    size_t used;
+
+    /// Writing has failed
+    bool failed;
+
+    char buffer[PROFILE_BUFFER];
+};
+
+/**
+ * Writes out the buffer of the writer.
+ * @param writer    the writer
  */
 static
-void arena_append(Arena *a)
+void profile_flush(ProfileWriter *writer)
 {
-    // Find last arena in linked list
-    Arena *last_arena = first_arena;
-    while (last_arena->next != NULL) {
-        last_arena = last_arena->next;
+    char *data = writer->buffer;
+    while (writer->used > 0 && !writer->failed) {
+        ssize_t written = write(writer->fd, data, writer->used);
+        if (written < 0 && errno != EINTR) {
+            writer->failed = true;
+        } else if (written > 0) {
+            data += written;
+            writer->used -= written;
+        }
     }
-
-    last_arena->next = a;
+    writer->used = 0;
 }
 
 /**
- * Header structure constructor (alone, not used block).
- * @param hdr       pointer to block metadata.
- * @param size      size of free block
- * @pre size > 0
+ * Appends a string to the profile.
+ * @param writer    the writer
+ * @param str       the string
  */
+static
+void profile_puts(ProfileWriter *writer, const char *str)
+{
+    for (; *str != '\0'; str++) {
+        if (writer->used == PROFILE_BUFFER) {
+            profile_flush(writer);
+        }
+        writer->buffer[writer->used++] = *str;
+    }
+}
+
 /**
- *   +-----+------+------------------------+----+
- *   | ... |Header|........................| ...|
- *   +-----+------+------------------------+----+
- *
- *                |-- Header.size ---------|
+ * Appends a number to the profile.
+ * @param writer    the writer
+ * @param value     the number
+ * @param base      10 or 16 (hexadecimal numbers get the 0x prefix)
  */
 static
-void hdr_ctor(Header *hdr, size_t size)
+void profile_number(ProfileWriter *writer, uintptr_t value, unsigned base)
 {
-    assert(size > 0);
+    char digits[2 * sizeof(uintptr_t) * 2 + 3];
+    char *str = digits + sizeof(digits) - 1;
+    *str = '\0';
+    do {
+        *--str = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+    if (base == 16) {
+        *--str = 'x';
+        *--str = '0';
+    }
 
-    hdr->next = NULL;
-    hdr->size = size;
-    hdr->asize = 0; // Not user allocated (by caller program)
+    profile_puts(writer, str);
 }
 
 /**
- * Checks if the given free block should be split in two separate blocks.
- * @param hdr       header of the free block
- * @param size      requested size of data
- * @return true if the block should be split
- * @pre hdr->asize == 0
- * @pre size > 0
+ * Write the profile of live sampled allocations in the text format of heap
+ * profiles of gperftools (readable by pprof, which scales samples by the
+ * interval). Every sample is one line: its count, size and call stack.
+ * Mappings of the process are appended for symbolization.
+ * @param fd        output file
+ * @return 0 on success or -1 if writing has failed.
  */
-static
-bool hdr_should_split(Header *hdr, size_t size)
+int mmal_profile_dump(int fd)
 {
-    assert(hdr->asize == 0);
-    assert(size > 0);
+    ProfileWriter writer;
+    writer.fd = fd;
+    writer.used = 0;
+    writer.failed = false;
+
+    PROFILE_LOCK();
+
+    profile_puts(&writer, "heap profile: ");
+    profile_number(&writer, sample_count, 10);
+    profile_puts(&writer, ": ");
+    profile_number(&writer, sample_bytes, 10);
+    profile_puts(&writer, " [");
+    profile_number(&writer, sample_total_count, 10);
+    profile_puts(&writer, ": ");
+    profile_number(&writer, sample_total_bytes, 10);
+    profile_puts(&writer, "] @ heap_v2/");
+    profile_number(&writer, sample_period, 10);
+    profile_puts(&writer, "\n");
 
-    size_t aligned_size = ALIGN(size, sizeof(size_t));
+    for (Sample *sample = samples; sample != NULL; sample = sample->next) {
+        profile_puts(&writer, "1: ");
+        profile_number(&writer, sample->size, 10);
+        profile_puts(&writer, " [1: ");
+        profile_number(&writer, sample->size, 10);
+        profile_puts(&writer, "] @");
+        for (int i = 0; i < sample->depth; i++) {
+            profile_puts(&writer, " ");
+            profile_number(&writer, (uintptr_t)sample->frames[i], 16);
+        }
+        profile_puts(&writer, "\n");
+    }
+
+    PROFILE_UNLOCK();
+
+    profile_puts(&writer, "\nMAPPED_LIBRARIES:\n");
+    profile_flush(&writer);
+    int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (maps >= 0) {
+        ssize_t length;
+        while ((length = read(maps, writer.buffer, PROFILE_BUFFER)) > 0) {
+            writer.used = length;
+            profile_flush(&writer);
+        }
+        close(maps);
+    }
 
-    return (hdr->size - (MAX(aligned_size, MIN_BLOCK_SIZE) + sizeof(Header) + MIN_BLOCK_SIZE)) > 0;
+    return writer.failed ? -1 : 0;
 }
 
 /**
- * Splits one block in two.
- * @param hdr       pointer to header of the big block
- * @param req_size  requested size of data in the (left) block.
- * @return pointer to the new (right) block header.
- * @pre   (hdr->size >= MAX(req_size, MIN_BLOCK_SIZE) + sizeof(Header) + MIN_BLOCK_SIZE)
- */
-/*
- * Before:        |---- hdr->size ---------|
- *
- *    -----+------+------------------------+----
- *         |Header|........................|
- *    -----+------+------------------------+----
- *            \----hdr->next---------------^
- */
-/*
- * After:         |- req_size -|
- *
- *    -----+------+------------+------+----+----
- *     ... |Header|............|Header|....|
- *    -----+------+------------+------+----+----
- *             \---next--------^  \--next--^
+ * Handler of the signal requesting a profile. Only a flag is set, the
+ * profile is written by the next sample_alloc() (locks and mappings aren't
+ * safe in a signal handler).
+ * @param signum    the signal
  */
 static
-Header *hdr_split(Header *hdr, size_t req_size)
+void profile_request(int signum)
 {
-    size_t aligned_size = ALIGN(req_size, sizeof(size_t));
-    size_t alloc_size = MAX(aligned_size, MIN_BLOCK_SIZE);
+    (void)signum;
+    profile_requested = 1;
+}
 
-    assert((hdr->size - (alloc_size + sizeof(Header) + MIN_BLOCK_SIZE)) > 0);
+/**
+ * Write the profile to the file whenever the signal is received. It's
+ * written by a thread which allocates after the signal, within
+ * SAMPLE_RECHECK bytes (the sample interval when the profiler is enabled).
+ * @param signum    the signal (e.g. SIGUSR2)
+ * @param path      the file, it's rewritten by every profile
+ * @return 0 on success or -1 if error (errno is set).
+ */
+int mmal_profile_signal(int signum, const char *path)
+{
+    size_t length = strlen(path);
+    if (length >= PROFILE_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(profile_path, path, length + 1);
 
-    // Create new header (for block which is the rest of the old big block)
-    Header *new_hdr = NEXT_HEADER(hdr, alloc_size);
-    hdr_ctor(new_hdr, hdr->size - sizeof(Header) - alloc_size);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_request;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
 
-    // Update old header
-    hdr->size = alloc_size;
-    hdr->asize = req_size;
+    return sigaction(signum, &action, NULL);
+}
 
-    // Update list pointers
-    new_hdr->next = hdr->next;
-    hdr->next = new_hdr;
+/**
+ * Get the size usable by the program of previously allocated data. It's
+ * at least the requested size.
+ * @param ptr       pointer to previously allocated data (can be NULL)
+ * @return usable size in bytes (0 for NULL)
+ */
+size_t mmal_usable_size(void *ptr)
+{
+    if (ptr == NULL) {
+        return 0;
+    }
 
-    return new_hdr;
+    // Huge blocks have a header as well
+    return block_capacity(ptr);
 }
 
 /**
- * Detect if two adjacent blocks could be merged.
- * @param left      left block
- * @param right     right block
- * @return true if two block are free and adjacent in the same arena.
- * @pre left->next == right
- * @pre left != right
+ * Get numbers of arenas mapped and unmapped since the start of the program.
+ * @param mapped    output for the number of mapped arenas (can be NULL)
+ * @param unmapped  output for the number of unmapped arenas (can be NULL)
  */
-static
-bool hdr_can_merge(Header *left, Header *right)
+void mmal_arena_counters(size_t *mapped, size_t *unmapped)
 {
-    assert(left->next == right);
-    assert(left != right);
+    HEAP_LOCK(&default_heap);
 
-    // There is a non-free block
-    if (left->asize != 0 || right->asize != 0) {
-        return false;
+    if (mapped != NULL) {
+        *mapped = default_heap.arenas_mapped;
+    }
+    if (unmapped != NULL) {
+        *unmapped = default_heap.arenas_unmapped;
     }
 
-    return (NEXT_HEADER(left, left->size) == right);
+    HEAP_UNLOCK(&default_heap);
 }
 
 /**
- * Merge two adjacent free blocks.
- * @param left      left block
- * @param right     right block
- * @pre left->next == right
- * @pre left != right
+ * Counts free blocks (or free slots) of the same size to statistics.
+ * @param stats     statistics being gathered
+ * @param size      size of every block (header included)
+ * @param count     number of the blocks
+ * @pre size > 0
  */
 static
-void hdr_merge(Header *left, Header *right)
+void stats_add_free(MmalStats *stats, size_t size, size_t count)
 {
-    assert(left->next == right);
-    assert(left != right);
+    assert(size > 0);
 
-    left->size = left->size + sizeof(Header) + right->size;
-    left->next = right->next;
+    stats->free += size * count;
+    stats->free_blocks[sizeof(size_t) * 8 - 1 - __builtin_clzl(size)] += count;
 }
 
 /**
- * Finds the free block that fits best to the requested size.
- * @param size      requested size
- * @return pointer to the header of the block or NULL if no block is available.
- * @pre size > 0
+ * Counts free blocks of the subtree of large free blocks to statistics.
+ * @param stats     statistics being gathered
+ * @param root      root of the subtree (can be NULL)
  */
 static
-Header *best_fit(size_t size)
+void stats_add_tree(MmalStats *stats, Header *root)
 {
-    assert(size > 0);
+    for (; root != NULL; root = TREE_LINKS(root)->right) {
+        stats_add_free(stats, BLOCK_SIZE(root), 1);
+        stats_add_tree(stats, TREE_LINKS(root)->left);
+    }
+}
+
+/**
+ * Get statistics of the heap. Only lists of free blocks, arenas and huge
+ * blocks are walked, used blocks aren't visited.
+ * @param heap      the heap
+ * @param stats     output for the statistics
+ */
+void mmal_heap_stats(MmalHeap *heap, MmalStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
 
-    Header *first_hdr = FIRST_HEADER(first_arena);
-    Header *best_fit = NULL;
-    for (Header *curr_hdr = first_hdr->next; curr_hdr != first_hdr; curr_hdr = curr_hdr->next) {
-        // Check required conditions for header:
-        //  1. it's free,
-        //  2. it's big enough
-        if (curr_hdr->asize == 0 && curr_hdr->size >= size) {
-            // We are using best fit --> better is smaller block
-            if (best_fit == NULL || curr_hdr->size < best_fit->size) {
-                best_fit = curr_hdr;
+    HEAP_LOCK(heap);
+    heap_drain_remote(heap);
+
+    // Free blocks of arenas
+    for (size_t i = 0; i < BIN_COUNT; i++) {
+        for (Header *hdr = heap->bins[i]; hdr != NULL; hdr = FREE_LINKS(hdr)->next) {
+            stats_add_free(stats, BLOCK_SIZE(hdr), 1);
+            stats->largest_free = MAX(stats->largest_free, BLOCK_SIZE(hdr));
+        }
+    }
+    stats_add_tree(stats, heap->free_tree);
+    if (heap->free_tree != NULL) {
+        // The tree ordered by addresses knows its biggest block, otherwise
+        // it's the rightmost one
+        size_t largest = TREE_LINKS(heap->free_tree)->max;
+        if (!tree_by_address(heap)) {
+            Header *node = heap->free_tree;
+            while (TREE_LINKS(node)->right != NULL) {
+                node = TREE_LINKS(node)->right;
             }
+            largest = BLOCK_SIZE(node);
+        }
+        stats->largest_free = MAX(stats->largest_free, largest);
+    }
+    size_t heap_free = stats->free;
+    stats->fragmentation = (heap_free > 0) ? 1.0 - (double)stats->largest_free / heap_free : 0.0;
+
+    // Free slots of slab runs, full runs aren't in the lists
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        for (SlabRun *run = heap->slab_runs[i]; run != NULL; run = run->next) {
+            size_t slots = (RUN_END(run) - RUN_SLOTS(run)) / run->slot_size;
+            stats_add_free(stats, run->slot_size, slots - run->used);
+        }
+    }
+    for (SlabRun *run = heap->slab_free_runs; run != NULL; run = run->next) {
+        stats_add_free(stats, RUN_END(run) - RUN_SLOTS(run), 1);
+    }
+
+    // Blocks of quick lists are free, though they aren't merged yet
+    for (size_t i = 0; i < SMALL_BIN_COUNT; i++) {
+        if (heap->quick_count[i] > 0) {
+            stats_add_free(stats, i * BIN_STEP, heap->quick_count[i]);
         }
     }
 
-    return best_fit;
+    stats->mapped = heap->arena_bytes + heap->region_bytes + heap->slab_arenas * SLAB_ARENA_SIZE;
+    for (HugeBlock *huge = heap->huge_blocks; huge != NULL; huge = huge->next) {
+        stats->mapped += huge->size;
+    }
+    stats->in_use = stats->mapped - stats->free;
+
+    stats->mmaps = heap->arenas_mapped + heap->huges_mapped;
+    stats->munmaps = heap->arenas_unmapped + heap->huges_unmapped;
+
+    HEAP_UNLOCK(heap);
 }
 
 /**
- * Search the header which is the predecessor to the hdr. Note that if 
- * @param hdr       successor of the search header
- * @return pointer to predecessor, hdr if there is just one header.
- * @pre first_arena != NULL
- * @post predecessor->next == hdr
+ * Get statistics of the default heap (see mmal_heap_stats()).
+ * @param stats     output for the statistics
  */
-static
-Header *hdr_get_prev(Header *hdr)
+void mmal_stats(MmalStats *stats)
+{
+    mmal_heap_stats(&default_heap, stats);
+}
+
+/**
+ * Set the placement policy of large free blocks of the heap. The tree of
+ * free blocks is rebuilt when its order changes.
+ * @param heap      the heap
+ * @param policy    MMAL_FIT_BEST, MMAL_FIT_FIRST, MMAL_FIT_NEXT or MMAL_FIT_GOOD
+ * @return 0 or -1 if the policy is unknown (errno = EINVAL).
+ */
+int mmal_heap_set_fit_policy(MmalHeap *heap, unsigned policy)
 {
-    assert(first_arena != NULL);
+    if (policy > MMAL_FIT_GOOD) {
+        errno = EINVAL;
+        return -1;
+    }
 
-    Header *current_header = FIRST_HEADER(first_arena);
-    while (current_header->next != hdr) {
-        current_header = current_header->next;
+    HEAP_LOCK(heap);
+    bool by_address = tree_by_address(heap);
+    heap->fit_policy = policy;
+    heap->fit_rover = NULL;
+    if (tree_by_address(heap) != by_address) {
+        Header *root = heap->free_tree;
+        heap->free_tree = NULL;
+        tree_reinsert(heap, root);
     }
+    HEAP_UNLOCK(heap);
 
-    assert(current_header->next == hdr);
+    return 0;
+}
 
-    return current_header;
+/**
+ * Set the placement policy of large free blocks of the default heap.
+ * @param policy    MMAL_FIT_BEST, MMAL_FIT_FIRST, MMAL_FIT_NEXT or MMAL_FIT_GOOD
+ * @return 0 or -1 if the policy is unknown (errno = EINVAL).
+ */
+int mmal_set_fit_policy(unsigned policy)
+{
+    return mmal_heap_set_fit_policy(&default_heap, policy);
 }
 
+#ifdef MMAL_INSTRUMENT
+#undef mmalloc
+#undef mfree
+#undef mrealloc
+
 /**
- * Allocate memory. Use best-fit search of available block.
+ * Allocate memory (see untimed_mmalloc()), the latency is counted.
  * @param size      requested size for program
  * @return pointer to allocated data or NULL if error or size = 0.
  */
 void *mmalloc(size_t size)
 {
-    // Check for bad input value
-    if (size == 0) {
-        return NULL;
-    }
+    uint64_t start = instrument_clock();
+    void *ptr = untimed_mmalloc(size);
+    INSTRUMENT_HISTOGRAM(malloc_ns, instrument_clock() - start);
 
-    // Prepare header for user allocation
-    Header *best_fit_hdr;
-    if (first_arena == NULL) {
-        // No arena has been created yet --> make essential inits
-        // Create arena
-        size_t arena_size = MAX(size, PAGE_SIZE);
-        if ((first_arena = arena_alloc(arena_size)) == NULL) {
-            // OS can't give us a new memory block
-            return NULL;
-        }
+    return ptr;
+}
 
-        // Init arena with first header and use it for next actions
-        best_fit_hdr = FIRST_HEADER(first_arena);
-        hdr_ctor(best_fit_hdr, arena_size - sizeof(Arena));
-        best_fit_hdr->next = best_fit_hdr;
-    } else {
-        // The function has already been used, so we have all initialized
-        // Try to find header with free space for a new allocation
-        best_fit_hdr = best_fit(size);
-        if (best_fit_hdr == NULL) {
-            // No arena can store this block --> we need a new one
-            size_t arena_size = MAX(size, PAGE_SIZE);
-            Arena *new_arena;
-            if ((new_arena = arena_alloc(arena_size)) == NULL) {
-                // OS can't give us a new memory block
-                return NULL;
-            }
+/**
+ * Free memory (see untimed_mfree()), the latency is counted.
+ * @param ptr       pointer to previously allocated data
+ * @pre ptr != NULL
+ */
+void mfree(void *ptr)
+{
+    uint64_t start = instrument_clock();
+    untimed_mfree(ptr);
+    INSTRUMENT_HISTOGRAM(free_ns, instrument_clock() - start);
+}
+
+/**
+ * Reallocate memory (see untimed_mrealloc()), the latency is counted.
+ * @param ptr       pointer to previously allocated data (or NULL)
+ * @param size      a new requested size
+ * @return pointer to reallocated space or NULL if size equals to 0 or if error.
+ */
+void *mrealloc(void *ptr, size_t size)
+{
+    uint64_t start = instrument_clock();
+    void *new_ptr = untimed_mrealloc(ptr, size);
+    INSTRUMENT_HISTOGRAM(realloc_ns, instrument_clock() - start);
 
-            // Init new arena with header and use this header for next actions
-            best_fit_hdr = FIRST_HEADER(new_arena);
-            hdr_ctor(best_fit_hdr, arena_size - sizeof(Arena));
+    return new_ptr;
+}
 
-            // Set a next header, which is the first one (cyclic list)
-            Header *first_hdr = FIRST_HEADER(first_arena);
-            best_fit_hdr->next = first_hdr;
+/**
+ * Appends the histogram to the dump of the instrumentation: the number
+ * of values, percentiles (upper bounds of their buckets) and non-empty
+ * buckets.
+ * @param writer    the writer
+ * @param name      name of the histogram
+ * @param histogram buckets of the histogram
+ */
+static
+void instrument_write_histogram(ProfileWriter *writer, const char *name, const size_t *histogram)
+{
+    static const unsigned permille[] = {500, 900, 990, 999, 1000};
+    static const char *const labels[] = {", p50 < ", ", p90 < ", ", p99 < ", ", p99.9 < ", ", max < "};
 
-            // Find penultimate header (previously last)
-            Header *penultimate_hdr = first_hdr;
-            for (Header *curr_hdr = first_hdr->next; curr_hdr != first_hdr; curr_hdr = curr_hdr->next) {
-                penultimate_hdr = curr_hdr;
-            }
+    size_t total = 0;
+    for (size_t i = 0; i < MMAL_HISTOGRAM_BUCKETS; i++) {
+        total += histogram[i];
+    }
 
-            // Add link to the penultimate header
-            penultimate_hdr->next = best_fit_hdr;
+    profile_puts(writer, name);
+    profile_puts(writer, ": count ");
+    profile_number(writer, total, 10);
 
-            // Add arena to the list of arenas
-            arena_append(new_arena);
+    size_t bucket = 0;
+    size_t below = histogram[0];
+    for (size_t p = 0; total > 0 && p < sizeof(permille) / sizeof(permille[0]); p++) {
+        while (below * 1000 < (uint64_t)total * permille[p]) {
+            below += histogram[++bucket];
         }
+        profile_puts(writer, labels[p]);
+        profile_number(writer, (bucket < 64) ? (uint64_t)1 << bucket : UINTPTR_MAX, 10);
     }
+    profile_puts(writer, "\n");
 
-    // Split header when it's too large
-    if (hdr_should_split(best_fit_hdr, size)) {
-        hdr_split(best_fit_hdr, size);
+    for (size_t i = 0; i < MMAL_HISTOGRAM_BUCKETS; i++) {
+        if (histogram[i] > 0) {
+            profile_puts(writer, "  ");
+            profile_number(writer, (i == 0) ? 0 : (uint64_t)1 << (i - 1), 10);
+            profile_puts(writer, "-");
+            profile_number(writer, (i == 0) ? 0 : ((uint64_t)1 << (i - 1)) * 2 - 1, 10);
+            profile_puts(writer, ": ");
+            profile_number(writer, histogram[i], 10);
+            profile_puts(writer, "\n");
+        }
     }
-
-    // Update used header
-    best_fit_hdr->asize = size;
-
-    // Return pointer to user allocated space inside used header
-    return (void *)((char *)best_fit_hdr + sizeof(Header));
 }
+#endif // MMAL_INSTRUMENT
 
 /**
- * Free memory block.
- * @param ptr       pointer to previously allocated data
- * @pre ptr != NULL
+ * Get histograms and counters of the instrumented build (MMAL_INSTRUMENT).
+ * @param counters  output for the histograms and counters
+ * @return 0 on success or -1 if mmal.c isn't instrumented (errno = ENOSYS).
  */
-void mfree(void *ptr)
+int mmal_instrument_read(MmalInstrument *counters)
 {
-    // Header for allocated space
-    Header *processed_hdr = (Header *)((char *)ptr - sizeof(Header));
-
-    // Set block of the header as not used
-    processed_hdr->asize = 0;
-
-    // Inform previous header about this change (I'm not available, use my successor)
-    Header *prev_hdr = hdr_get_prev(processed_hdr);
-
-    // Merge with surrounding blocks if possible
-    // This and next
-    // The next one must go before the previous one, because when merged,
-    // processed_hdr will stay and has the right pointer to next header
-    Header *next_hdr = processed_hdr->next;
-    if (hdr_can_merge(processed_hdr, next_hdr)) {
-        hdr_merge(processed_hdr, next_hdr);
+#ifdef MMAL_INSTRUMENT
+    // All members are counters of size_t, updated atomically
+    size_t *dst = (size_t *)counters;
+    size_t *src = (size_t *)&instrument;
+    for (size_t i = 0; i < sizeof(MmalInstrument) / sizeof(size_t); i++) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
     }
 
-    // Previous and this
-    if (hdr_can_merge(prev_hdr, processed_hdr)) {
-        hdr_merge(prev_hdr, processed_hdr);
+    return 0;
+#else
+    (void)counters;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/**
+ * Reset histograms and counters of the instrumented build (e.g. after
+ * warming up), nothing happens in other builds.
+ */
+void mmal_instrument_reset(void)
+{
+#ifdef MMAL_INSTRUMENT
+    size_t *counters = (size_t *)&instrument;
+    for (size_t i = 0; i < sizeof(MmalInstrument) / sizeof(size_t); i++) {
+        __atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
     }
+#endif
 }
 
 /**
- * Reallocate previously allocated block.
- * @param ptr       pointer to previously allocated data
- * @param size      a new requested size. Size can be greater, equal, or less
- * then size of previously allocated block.
- * @return pointer to reallocated space or NULL if size equals to 0 or if error.
- * @post header_of(return pointer)->asize == size
+ * Write histograms and counters of the instrumented build as text.
+ * @param fd        output file
+ * @return 0 on success or -1 if writing has failed or if mmal.c isn't
+ * instrumented (errno = ENOSYS).
  */
-void *mrealloc(void *ptr, size_t size)
+int mmal_instrument_dump(int fd)
 {
-    // Header for allocated space
-    Header *processed_hdr = (Header *)((char *)ptr - sizeof(Header));
+#ifdef MMAL_INSTRUMENT
+    MmalInstrument counters;
+    mmal_instrument_read(&counters);
 
-    // Block is big enough for containing data of the new size
-    // This is used for shrinking, too
-    if (processed_hdr->size <= size) {
-        // Update block's used size
-        processed_hdr->asize = size;
+    ProfileWriter writer;
+    writer.fd = fd;
+    writer.used = 0;
+    writer.failed = false;
 
-        return ptr;
-    }
+    instrument_write_histogram(&writer, "mmalloc ns", counters.malloc_ns);
+    instrument_write_histogram(&writer, "mfree ns", counters.free_ns);
+    instrument_write_histogram(&writer, "mrealloc ns", counters.realloc_ns);
+    instrument_write_histogram(&writer, "search visits", counters.search_visits);
+    instrument_write_histogram(&writer, "remove visits", counters.remove_visits);
 
-    // The block currently in use is too small --> we need to change it for the bigger one
-    // Backup old size
-    size_t old_size = processed_hdr->asize;
+    profile_puts(&writer, "mmap: ");
+    profile_number(&writer, counters.mmaps, 10);
+    profile_puts(&writer, ", munmap: ");
+    profile_number(&writer, counters.munmaps, 10);
+    profile_puts(&writer, ", mremap: ");
+    profile_number(&writer, counters.mremaps, 10);
+    profile_puts(&writer, ", madvise: ");
+    profile_number(&writer, counters.madvises, 10);
+    profile_puts(&writer, "\n");
+    profile_flush(&writer);
 
-    // Free up current block
-    mfree(ptr);
+    return writer.failed ? -1 : 0;
+#else
+    (void)fd;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
 
-    // Allocate new block with the right size
-    void *new_ptr;
-    if ((new_ptr = mmalloc(size)) == NULL) {
-        // mmalloc() can't allocate 0 bytes
-        // mmalloc() can end with error due to allocation problems
-        return NULL;
+#ifdef MMAL_INSTRUMENT
+/**
+ * Writes the instrumentation at exit to the file named by the environment
+ * variable MMAL_INSTRUMENT ("-" for stderr).
+ */
+__attribute__((destructor))
+static
+void instrument_exit(void)
+{
+    const char *path = getenv("MMAL_INSTRUMENT");
+    if (path == NULL) {
+        return;
     }
 
-    // Move data from old block to the new one
-    memcpy(new_ptr, ptr, old_size);
+    if (strcmp(path, "-") == 0) {
+        mmal_instrument_dump(STDERR_FILENO);
+        return;
+    }
 
-    return new_ptr;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        mmal_instrument_dump(fd);
+        close(fd);
+    }
 }
+#endif
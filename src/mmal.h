@@ -11,23 +11,260 @@
 
 #ifndef NDEBUG
     // global pointer accessible only in DEBUG mode
+    // Header.size is the size of the whole block (header included) with
+    // flags in its lowest bits, asize is tracked only in DEBUG mode
     typedef struct header Header;
     struct header {
-        Header *next;
-        size_t size;
         size_t asize;
+        size_t size;
     };
     typedef struct arena Arena;
     struct arena {
         Arena *next;
         size_t size;
     };
-    extern Arena *first_arena;
+    // the first arena of the default heap
+    Arena *mmal_first_arena(void);
+    #define first_arena mmal_first_arena()
     #define PAGE_SIZE (128*1024)
+    #define ALIGNMENT 16
+    #define HDR_USED ((size_t)4)
+    #define HDR_FLAGS ((size_t)(ALIGNMENT - 1))
+    #define FIRST_HEADER(arena) ((Header *)((char *)(arena) + \
+        (sizeof(Arena) + sizeof(Header) + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT - sizeof(Header)))
 #endif
 
+/*
+ * When mmal.c is built with MMAL_THREADS, all functions are thread-safe and
+ * every thread keeps a small cache of freed blocks. Blocks freed while the
+ * heap is locked by another thread are queued without waiting (lock-free)
+ * and freed later in bulk. The heap stays usable in children of fork().
+ *
+ * src/mmal_preload.c exports the standard malloc family on top of these
+ * functions (libmmal.so, usable with LD_PRELOAD).
+ */
 void *mmalloc(size_t size);
 void mfree(void *ptr);
 void *mrealloc(void *ptr, size_t size);
 
+/*
+ * Zeroed array of count elements (NULL when count * size overflows).
+ * Memory which is known to be zero (never touched since it was mapped)
+ * isn't zeroed again.
+ */
+void *mcalloc(size_t count, size_t size);
+
+/*
+ * Blocks of the same size allocated and freed in bursts. mmalloc_batch()
+ * fills ptrs with count pointers (they may be freed one by one as well) and
+ * returns how many of them have been allocated (less than count if out of
+ * memory). Blocks of a batch usually lie one after another, mfree_batch()
+ * sorts the pointers (the array is reordered, NULL pointers are skipped),
+ * so neighbouring blocks are freed at once.
+ */
+size_t mmalloc_batch(size_t size, size_t count, void **ptrs);
+void mfree_batch(void **ptrs, size_t count);
+
+/*
+ * Regions for data freed all at once (e.g. scratch data of a request).
+ * Data are bump-allocated from big chunks mapped like arenas, they have no
+ * header, so mmal_region_alloc() costs a few instructions. The data must
+ * not be passed to mfree() or mrealloc(). mmal_region_reset() frees all
+ * data of the region and keeps its chunks for reuse, mmal_region_destroy()
+ * returns the chunks to the OS. A region is used by one thread at a time.
+ */
+#define MMAL_REGION_ALIGNMENT 16
+typedef struct mmal_region MmalRegion;
+struct mmal_region {
+    char *bump;             // next free byte of the current chunk
+    char *end;              // end of the current chunk
+    void *chunk;            // current chunk, chunks are linked in a list
+};
+MmalRegion *mmal_region_create(void);
+void mmal_region_reset(MmalRegion *region);
+void mmal_region_destroy(MmalRegion *region);
+void *mmal_region_grow(MmalRegion *region, size_t size);
+
+/*
+ * Data aligned to MMAL_REGION_ALIGNMENT from the current chunk of the region
+ * (NULL if error or size = 0). Only when the chunk is full, a next one is
+ * taken by mmal_region_grow().
+ */
+static inline void *mmal_region_alloc(MmalRegion *region, size_t size)
+{
+    // Size 0 and sizes overflowing by the rounding become huge, so they
+    // take the slow path as well
+    size_t rounded = (size + MMAL_REGION_ALIGNMENT - 1) & ~(size_t)(MMAL_REGION_ALIGNMENT - 1);
+    char *ptr = region->bump;
+    if (rounded - 1 < (size_t)(region->end - ptr)) {
+        region->bump = ptr + rounded;
+        return ptr;
+    }
+
+    return mmal_region_grow(region, size);
+}
+
+/*
+ * Size usable by the program of allocated data (at least the requested one).
+ */
+size_t mmal_usable_size(void *ptr);
+
+/*
+ * Data aligned to a power of two (e.g. 64 for SIMD, 4096 for O_DIRECT).
+ * The slack before aligned data is kept as a free block, so nothing is
+ * wasted. mfree() and mrealloc() work with the returned pointers (mrealloc()
+ * keeps the alignment only when the block is resized in place).
+ */
+void *mmemalign(size_t alignment, size_t size);
+void *maligned_alloc(size_t alignment, size_t size);
+int mposix_memalign(void **memptr, size_t alignment, size_t size);
+
+/*
+ * Completely free arenas are returned to the OS, only the given number
+ * of them is kept mapped for later use (2 by default). The same limit holds
+ * separately for the slab arenas of small objects. Recently freed small
+ * blocks aren't merged with their neighbours until an allocation doesn't
+ * find a free block (or until there are too many of one size), so they can
+ * hold an arena mapped; mmal_set_arena_cache() merges them.
+ */
+void mmal_set_arena_cache(size_t count);
+void mmal_arena_counters(size_t *mapped, size_t *unmapped);
+
+/*
+ * Statistics of a heap (mmal_stats() for the default one), available in
+ * release builds as well. They are gathered from the lists of free blocks
+ * when they are asked for, so allocations don't pay anything for them.
+ *
+ * Blocks in caches of threads (MMAL_THREADS) are counted as used. Recently
+ * freed small blocks, which aren't merged with their neighbours yet, are
+ * counted as free.
+ */
+#define MMAL_STATS_CLASSES (sizeof(size_t) * 8)
+typedef struct mmal_stats MmalStats;
+struct mmal_stats {
+    size_t mapped;          // bytes mapped from the OS
+    size_t in_use;          // mapped - free (used blocks, headers, metadata)
+    size_t free;            // bytes of free blocks, small slots and runs
+    size_t largest_free;    // largest free block in arenas (header included)
+    double fragmentation;   // 1 - largest_free / free bytes in arenas
+    // free_blocks[i] is the number of free blocks (or slots or runs) of
+    // a size from 2^i to 2^(i+1) - 1 bytes
+    size_t free_blocks[MMAL_STATS_CLASSES];
+    size_t mmaps;           // mappings created since the heap has been created
+    size_t munmaps;         // mappings released since the heap has been created
+};
+void mmal_stats(MmalStats *stats);
+
+/*
+ * Independent heaps, e.g. for subsystems with different lifetimes of data.
+ * Data must be freed or reallocated with the heap they come from.
+ * mmal_heap_destroy() frees all data of the heap at once and returns its
+ * memory to the OS. With MMAL_THREADS every heap has its own lock, so heaps
+ * used by different threads don't wait for each other (they don't use
+ * caches of threads). A heap is owned by the thread which has created it.
+ * Data freed by other threads (huge blocks too) are queued lock-free, the
+ * next allocation from the heap (by any thread) frees them in bulk.
+ * mmalloc() and the others work with the default heap.
+ */
+typedef struct mmal_heap MmalHeap;
+MmalHeap *mmal_heap_create(void);
+void *mmal_heap_malloc(MmalHeap *heap, size_t size);
+void mmal_heap_free(MmalHeap *heap, void *ptr);
+void *mmal_heap_realloc(MmalHeap *heap, void *ptr, size_t size);
+void mmal_heap_destroy(MmalHeap *heap);
+void mmal_heap_stats(MmalHeap *heap, MmalStats *stats);
+
+/*
+ * Options of arenas for big heaps, they apply to arenas mapped later (set
+ * them before the first allocation or with the environment variable
+ * MMAL_ARENA_OPTIONS=thp,hugetlb,populate):
+ *  - MMAL_ARENA_THP: arenas are aligned to 2 MiB and use transparent huge
+ *    pages (madvise(MADV_HUGEPAGE)),
+ *  - MMAL_ARENA_HUGETLB: arenas are mapped from the pool of huge pages
+ *    (MAP_HUGETLB), or as usual when the pool is empty,
+ *  - MMAL_ARENA_POPULATE: arenas are prefaulted (MAP_POPULATE).
+ * With huge pages, arenas are multiples of 2 MiB.
+ */
+#define MMAL_ARENA_THP 1
+#define MMAL_ARENA_HUGETLB 2
+#define MMAL_ARENA_POPULATE 4
+void mmal_set_arena_options(unsigned options);
+
+/*
+ * Whole pages of large free blocks (64 KiB and more) are returned to the OS
+ * with MADV_FREE (MADV_DONTNEED when MADV_FREE isn't supported or mmal.c is
+ * built with MMAL_PURGE_DONTNEED, then mcalloc() doesn't zero them again).
+ * It's done in batches, after the given number of bytes is freed next to
+ * them (4 MiB by default, 0 purges on every mfree(), SIZE_MAX never).
+ */
+void mmal_set_purge_interval(size_t bytes);
+
+/*
+ * Blocks of at least the given size (128 KiB by default) get their own
+ * mapping, which is returned to the OS by mfree().
+ */
+void mmal_set_mmap_threshold(size_t size);
+
+/*
+ * Placement policy of large free blocks (1 KiB and more) of a heap
+ * (mmal_set_fit_policy() for the default one):
+ *  - MMAL_FIT_BEST: the smallest block big enough (default),
+ *  - MMAL_FIT_FIRST: the block big enough at the lowest address,
+ *  - MMAL_FIT_NEXT: the first block big enough from the one found last
+ *    time (it wraps around to the lowest address),
+ *  - MMAL_FIT_GOOD: the first block met by the search of the best one
+ *    whose size is in the size class of the request (less than a quarter
+ *    of its power of two bigger).
+ * Smaller blocks have bins of exact sizes, so they always fit best. With
+ * mmal.c built with MMAL_LARGE_BINS, large blocks are in geometric bins and
+ * the policy has no effect. An unknown policy returns -1 (errno = EINVAL).
+ */
+#define MMAL_FIT_BEST 0
+#define MMAL_FIT_FIRST 1
+#define MMAL_FIT_NEXT 2
+#define MMAL_FIT_GOOD 3
+int mmal_set_fit_policy(unsigned policy);
+int mmal_heap_set_fit_policy(MmalHeap *heap, unsigned policy);
+
+/*
+ * Sampling heap profiler of mmalloc() and mcalloc() (disabled by default).
+ * About one allocation per the given number of bytes is sampled (e.g.
+ * 2 MiB), the intervals are random (exponential), so every byte has the
+ * same chance. A sampled allocation gets its own mapping (at least a page)
+ * with its call stack. mmal_profile_dump() writes live samples as a heap
+ * profile of gperftools (pprof --text program file, or plain text),
+ * mmal_profile_signal() makes the signal write the profile to the file.
+ * Disabled, the profiler costs a single branch per allocation.
+ */
+void mmal_set_sample_interval(size_t bytes);
+int mmal_profile_dump(int fd);
+int mmal_profile_signal(int signum, const char *path);
+
+/*
+ * Instrumentation of tail latencies (mmal.c built with MMAL_INSTRUMENT,
+ * other builds return -1 with errno = ENOSYS). Histograms are kept of
+ * latencies of mmalloc(), mfree() and mrealloc(), of blocks visited by
+ * searches for a free block and of nodes visited by removals from the tree
+ * of large free blocks. System calls for mappings are counted. Bucket i
+ * of a histogram counts values from 2^(i-1) to 2^i - 1 (bucket 0 zeros).
+ * With the environment variable MMAL_INSTRUMENT=file, mmal_instrument_dump()
+ * writes them to the file at exit ("-" for stderr).
+ */
+#define MMAL_HISTOGRAM_BUCKETS 65
+typedef struct mmal_instrument MmalInstrument;
+struct mmal_instrument {
+    size_t malloc_ns[MMAL_HISTOGRAM_BUCKETS];       // latencies in ns
+    size_t free_ns[MMAL_HISTOGRAM_BUCKETS];
+    size_t realloc_ns[MMAL_HISTOGRAM_BUCKETS];
+    size_t search_visits[MMAL_HISTOGRAM_BUCKETS];   // free blocks per search
+    size_t remove_visits[MMAL_HISTOGRAM_BUCKETS];   // tree nodes per removal
+    size_t mmaps;                                   // system calls
+    size_t munmaps;
+    size_t mremaps;
+    size_t madvises;
+};
+int mmal_instrument_read(MmalInstrument *counters);
+void mmal_instrument_reset(void);
+int mmal_instrument_dump(int fd);
+
 #endif
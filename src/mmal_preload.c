@@ -0,0 +1,419 @@
+/**
+ * Standardni alokacni funkce nad My MALloc
+ * Knihovna libmmal.so pro LD_PRELOAD=./bin/libmmal.so program
+ *
+ * With MMAL_TRACE=file all allocations of the program (and of its
+ * children) are appended to the file, one line per call:
+ *
+ *   <pid> m <ptr> <size>           malloc
+ *   <pid> c <ptr> <size>           calloc (size of the whole array)
+ *   <pid> a <ptr> <align> <size>   aligned allocations
+ *   <pid> r <old> <ptr> <size>     realloc
+ *   <pid> f <ptr>                  free
+ *
+ * All numbers are hexadecimal. The trace can be replayed by bench_mmal.
+ *
+ * With MMAL_PROFILE=file the heap profiler samples allocations (one per
+ * MMAL_PROFILE_INTERVAL bytes, 2 MiB by default). The profile of live
+ * samples is written to the file on SIGUSR2 and when the program exits:
+ *
+ *   go tool pprof -text program file
+ */
+
+#include "mmal.h"
+#include <stddef.h> // size_t
+#include <stdint.h> // uintptr_t, SIZE_MAX
+#include <stdlib.h> // getenv
+#include <string.h> // memcpy
+#include <errno.h> // ENOMEM, EINVAL
+#include <fcntl.h> // open
+#include <pthread.h> // pthread_atfork
+#include <signal.h> // SIGUSR2
+#include <unistd.h> // sysconf, write, getpid
+
+/**
+ * Default mean interval of samples of the heap profiler (MMAL_PROFILE)
+ */
+#define PROFILE_INTERVAL (2*1024*1024)
+
+/**
+ * Size of the buffer for allocations made while My MALloc is running
+ * (e.g. by the C library called from inside of it)
+ */
+#define BOOTSTRAP_SIZE (64*1024)
+/**
+ * Alignment of allocations from the bootstrap buffer
+ */
+#define BOOTSTRAP_ALIGNMENT 16
+
+/**
+ * Set while the thread is inside of My MALloc, nested calls are served from
+ * the bootstrap buffer. Thread variables of a preloaded library must not
+ * be allocated lazily (which would call malloc), hence initial-exec.
+ */
+static __thread int in_mmal __attribute__((tls_model("initial-exec")));
+
+/**
+ * Buffer for nested allocations, they are never freed
+ */
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(BOOTSTRAP_ALIGNMENT)));
+
+/**
+ * Used part of the bootstrap buffer
+ */
+static size_t bootstrap_used = 0;
+
+/**
+ * File of the trace of allocations (MMAL_TRACE), -1 if disabled
+ */
+static int trace_fd = -1;
+
+/**
+ * Process id written to the trace
+ */
+static pid_t trace_pid;
+
+/**
+ * File of the heap profile (MMAL_PROFILE), NULL if disabled
+ */
+static const char *profile_path = NULL;
+
+/**
+ * Runs the expression as the outermost call of My MALloc.
+ * @param expr Expression calling My MALloc
+ */
+#define MMAL_CALL(expr) do { in_mmal = 1; expr; in_mmal = 0; } while (0)
+
+/**
+ * Allocates from the bootstrap buffer. The size is stored before the data,
+ * so the data can be reallocated.
+ * @param size      requested size
+ * @return pointer to allocated data or NULL if the buffer is full.
+ */
+static
+void *bootstrap_alloc(size_t size)
+{
+    size_t total = BOOTSTRAP_ALIGNMENT + (size + BOOTSTRAP_ALIGNMENT - 1) / BOOTSTRAP_ALIGNMENT * BOOTSTRAP_ALIGNMENT;
+    size_t start = __atomic_fetch_add(&bootstrap_used, total, __ATOMIC_RELAXED);
+    if (size > BOOTSTRAP_SIZE || start + total > BOOTSTRAP_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    *(size_t *)(bootstrap + start) = size;
+    return bootstrap + start + BOOTSTRAP_ALIGNMENT;
+}
+
+/**
+ * Checks if the data have been allocated from the bootstrap buffer.
+ * @param ptr       pointer to allocated data
+ */
+static
+int bootstrap_owns(void *ptr)
+{
+    return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+/**
+ * Gives the size of data allocated from the bootstrap buffer.
+ * @param ptr       pointer to allocated data
+ */
+static
+size_t bootstrap_size(void *ptr)
+{
+    return *(size_t *)((char *)ptr - BOOTSTRAP_ALIGNMENT);
+}
+
+/**
+ * Updates the process id of the trace in children of fork().
+ */
+static
+void trace_fork_child(void)
+{
+    trace_pid = getpid();
+}
+
+/**
+ * Opens the trace when the library is loaded and MMAL_TRACE is set.
+ */
+__attribute__((constructor))
+static
+void trace_open(void)
+{
+    const char *path = getenv("MMAL_TRACE");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd >= 0) {
+        trace_pid = getpid();
+        pthread_atfork(NULL, NULL, trace_fork_child);
+    }
+}
+
+/**
+ * Starts the heap profiler when the library is loaded and MMAL_PROFILE is
+ * set.
+ */
+__attribute__((constructor))
+static
+void profile_start(void)
+{
+    const char *path = getenv("MMAL_PROFILE");
+    if (path == NULL || *path == '\0') {
+        return;
+    }
+
+    size_t interval = PROFILE_INTERVAL;
+    const char *interval_env = getenv("MMAL_PROFILE_INTERVAL");
+    if (interval_env != NULL && *interval_env != '\0') {
+        interval = strtoul(interval_env, NULL, 10);
+    }
+
+    if (mmal_profile_signal(SIGUSR2, path) == 0) {
+        profile_path = path;
+        mmal_set_sample_interval(interval);
+    }
+}
+
+/**
+ * Writes the last heap profile when the program exits.
+ */
+__attribute__((destructor))
+static
+void profile_stop(void)
+{
+    if (profile_path == NULL) {
+        return;
+    }
+
+    int fd = open(profile_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        mmal_profile_dump(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Appends a hexadecimal number to the line of the trace.
+ * @param out       end of the line
+ * @param value     number to append
+ * @return new end of the line
+ */
+static
+char *trace_hex(char *out, uintptr_t value)
+{
+    char digits[2 * sizeof(uintptr_t)];
+    int count = 0;
+    do {
+        digits[count++] = "0123456789abcdef"[value & 15];
+        value >>= 4;
+    } while (value != 0);
+
+    *out++ = ' ';
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+
+    return out;
+}
+
+/**
+ * Writes a line to the trace. The line is written at once, so lines of
+ * threads and processes aren't mixed. Nothing is allocated here.
+ * @param op        kind of the call
+ * @param args      arguments of the line
+ * @param count     number of the arguments
+ */
+static
+void trace(char op, const uintptr_t *args, int count)
+{
+    char line[8 * (2 * sizeof(uintptr_t) + 1)];
+    char *out = trace_hex(line, trace_pid);
+    *out++ = ' ';
+    *out++ = op;
+    for (int i = 0; i < count; i++) {
+        out = trace_hex(out, args[i]);
+    }
+    *out++ = '\n';
+
+    if (write(trace_fd, line + 1, out - line - 1) < 0) {
+        trace_fd = -1;
+    }
+}
+
+/**
+ * Writes a line to the trace if it's enabled.
+ * @param op        kind of the call
+ * @param ...       arguments of the line (pointers and sizes)
+ */
+#define TRACE(op, ...) do { \
+    if (trace_fd >= 0) { \
+        uintptr_t args[] = {__VA_ARGS__}; \
+        trace(op, args, sizeof(args) / sizeof(args[0])); \
+    } \
+} while (0)
+
+void *malloc(size_t size)
+{
+    if (in_mmal) {
+        return bootstrap_alloc(size);
+    }
+
+    // malloc(0) gives a unique pointer
+    void *ptr;
+    MMAL_CALL(ptr = mmalloc(size > 0 ? size : 1));
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    } else {
+        TRACE('m', (uintptr_t)ptr, size);
+    }
+
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    // Nested frees (only during initialization of a thread) are leaked,
+    // My MALloc may be in the middle of a change
+    if (ptr == NULL || bootstrap_owns(ptr) || in_mmal) {
+        return;
+    }
+
+    // Traced before the data can be allocated again by another thread
+    TRACE('f', (uintptr_t)ptr);
+    MMAL_CALL(mfree(ptr));
+}
+
+void *calloc(size_t count, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (in_mmal) {
+        // The bootstrap buffer is zero, it's never reused
+        return bootstrap_alloc(total);
+    }
+
+    void *ptr;
+    MMAL_CALL(ptr = (total > 0) ? mcalloc(count, size) : mcalloc(1, 1));
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    } else {
+        TRACE('c', (uintptr_t)ptr, total);
+    }
+
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+
+    if (bootstrap_owns(ptr)) {
+        // Moved out of the bootstrap buffer, which isn't reused
+        void *new_ptr = malloc(size);
+        if (new_ptr != NULL) {
+            size_t old_size = bootstrap_size(ptr);
+            memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+        }
+        return new_ptr;
+    }
+
+    if (in_mmal) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *new_ptr;
+    MMAL_CALL(new_ptr = mrealloc(ptr, size));
+    if (new_ptr != NULL) {
+        TRACE('r', (uintptr_t)ptr, (uintptr_t)new_ptr, size);
+    } else if (size > 0) {
+        errno = ENOMEM;
+    } else {
+        TRACE('f', (uintptr_t)ptr);
+    }
+
+    return new_ptr;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (in_mmal) {
+        return ENOMEM;
+    }
+
+    int rc;
+    MMAL_CALL(rc = mposix_memalign(memptr, alignment, size));
+    if (rc == 0 && *memptr != NULL) {
+        TRACE('a', (uintptr_t)*memptr, alignment, size);
+    }
+
+    return rc;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (in_mmal) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr;
+    MMAL_CALL(ptr = mmemalign(alignment, size > 0 ? size : 1));
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    } else {
+        TRACE('a', (uintptr_t)ptr, alignment, size);
+    }
+
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    // As in glibc, the alignment is rounded up to a power of two
+    if (alignment > SIZE_MAX / 2 + 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t power = 1;
+    while (power < alignment) {
+        power <<= 1;
+    }
+
+    return aligned_alloc(power, size);
+}
+
+void *valloc(size_t size)
+{
+    return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return aligned_alloc(page, (size + page - 1) / page * page);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL) {
+        return 0;
+    }
+    if (bootstrap_owns(ptr)) {
+        return bootstrap_size(ptr);
+    }
+
+    return mmal_usable_size(ptr);
+}
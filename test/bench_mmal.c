@@ -0,0 +1,1016 @@
+/**
+ * @file bench_mmal.c
+ * Benchmarks of My MALloc next to malloc of the C library. Every scenario
+ * runs in its own child process for both allocators, so one run doesn't
+ * affect the others. Reported are:
+ *  - throughput of the whole run,
+ *  - percentiles of the latency of single calls (every LAT_EVERY-th call
+ *    is timed, the timer itself costs a few tens of ns),
+ *  - peak RSS of the child over its RSS at the start,
+ *  - fragmentation: the part of the peak memory mapped by the allocator
+ *    which isn't needed for the peak of live data,
+ *  - with -c, cycles and cache misses per call in user space (hardware
+ *    counters of perf_event, "-" when they aren't available).
+ * Built with MMAL_INSTRUMENT (bench_mmal_instrument), histograms of every
+ * run of My MALloc are written to stderr.
+ *
+ * Usage: bench_mmal [-c] [trace...]
+ *   trace  allocations of a program recorded with libmmal.so:
+ *          MMAL_TRACE=file LD_PRELOAD=bin/libmmal.so program
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../src/mmal.h"
+
+/// Number of calls of synthetic scenarios
+#define OPS 2000000
+/// Number of blocks kept allocated at the same time
+#define SLOTS 4096
+/// Every LAT_EVERY-th call is timed alone
+#define LAT_EVERY 8
+/// Number of calls between two measurements of the mapped memory
+#define SAMPLE 4096
+/// Capacity of the queue between the producer and the consumer
+#define RING 1024
+/// Blocks of the realloc scenario grow up to this size
+#define REALLOC_MAX (64*1024)
+/// Maximal number of blocks of a burst
+#define BURST_MAX 256
+/// Number of bursts allocated at the same time
+#define BURSTS 8
+/// Maximal number of blocks of scratch data of a request
+#define SCRATCH_MAX 512
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+/**
+ * Allocator under test
+ */
+typedef struct allocator Allocator;
+struct allocator {
+    const char *name;
+    void *(*alloc)(size_t size);
+    void *(*calloc)(size_t count, size_t size);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*memalign)(size_t alignment, size_t size);
+    void (*free)(void *ptr);
+
+    /// Batch functions (NULL if the allocator hasn't got them)
+    size_t (*alloc_batch)(size_t size, size_t count, void **ptrs);
+    void (*free_batch)(void **ptrs, size_t count);
+
+    /// Bytes mapped by the allocator from the OS
+    size_t (*mapped)(void);
+};
+
+/**
+ * Results of one run (passed from the child to the parent)
+ */
+typedef struct result Result;
+struct result {
+    long ops;
+    double secs;
+    uint64_t p50, p90, p99, p999, max;
+    size_t peak_rss;
+    double fragmentation;
+
+    /// Per call, negative when the counters aren't available
+    double cycles, cache_misses;
+};
+
+/**
+ * Allocation of a replayed trace, blocks are identified by slots
+ */
+typedef struct trace_op TraceOp;
+struct trace_op {
+
+    /// 'm' malloc, 'c' calloc, 'a' aligned, 'r' realloc, 'f' free
+    char kind;
+
+    /// Slot of the block
+    uint32_t slot;
+
+    size_t size;
+    size_t alignment;
+};
+
+/**
+ * Parsed trace
+ */
+typedef struct trace Trace;
+struct trace {
+    const char *path;
+    TraceOp *ops;
+    size_t count;
+    size_t slots;
+};
+
+/// Heap of the producer (prodcons heap scenario)
+static MmalHeap *prodcons_heap;
+
+static size_t mmal_mapped(void)
+{
+    MmalStats stats;
+    mmal_stats(&stats);
+    size_t mapped = stats.mapped;
+    if (prodcons_heap != NULL) {
+        mmal_heap_stats(prodcons_heap, &stats);
+        mapped += stats.mapped;
+    }
+    return mapped;
+}
+
+static size_t libc_mapped(void)
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.arena + info.hblkhd;
+}
+
+static const Allocator allocators[] = {
+    {"mmal", mmalloc, mcalloc, mrealloc, mmemalign, mfree, mmalloc_batch, mfree_batch, mmal_mapped},
+    {"glibc", malloc, calloc, realloc, memalign, free, NULL, NULL, libc_mapped},
+};
+
+/// Allocator of the current run
+static const Allocator *al;
+
+static void *slots[SLOTS];
+static size_t sizes[SLOTS];
+static size_t fixed_size;
+static const Trace *trace;
+static void **trace_ptrs;
+static size_t *trace_sizes;
+
+/// Bytes requested by the program and not freed yet
+static size_t live_bytes;
+/// Mapped bytes at the start of the run
+static size_t start_mapped;
+static size_t peak_mapped;
+static size_t peak_live;
+
+/// Hardware counters are read around runs (-c)
+static bool use_counters;
+
+/// Latencies of timed calls (ns)
+static uint64_t lat[OPS / LAT_EVERY + 16];
+static size_t lat_count;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Runs the expression, every LAT_EVERY-th one is timed.
+ */
+#define TIMED(k, expr) do { \
+    if ((k) % LAT_EVERY == 0) { \
+        uint64_t t0_ = now_ns(); \
+        expr; \
+        uint64_t t1_ = now_ns(); \
+        size_t i_ = __atomic_fetch_add(&lat_count, 1, __ATOMIC_RELAXED); \
+        if (i_ < sizeof(lat) / sizeof(lat[0])) \
+            lat[i_] = t1_ - t0_; \
+    } else { \
+        expr; \
+    } \
+} while (0)
+
+/**
+ * Simple and fast pseudo-random generator (xorshift)
+ */
+static unsigned rand_next(unsigned *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/**
+ * Touches the first and the last byte, so the memory is really used.
+ */
+static void touch(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        perror("alloc");
+        exit(1);
+    }
+    ((volatile char *)ptr)[0] = 1;
+    ((volatile char *)ptr)[size - 1] = 1;
+}
+
+/**
+ * Counts allocated (or freed) bytes. Only one thread allocates, so the peak
+ * is updated without races.
+ */
+static void live_add(ptrdiff_t bytes)
+{
+    size_t live = __atomic_add_fetch(&live_bytes, bytes, __ATOMIC_RELAXED);
+    if (bytes > 0 && live > peak_live)
+        peak_live = live;
+}
+
+/**
+ * Measures the mapped memory.
+ */
+static void sample(void)
+{
+    peak_mapped = MAX(peak_mapped, al->mapped() - start_mapped);
+}
+
+/**
+ * Memory of the harness is mapped directly, so it isn't counted to any
+ * allocator.
+ */
+static void *harness_alloc(size_t size)
+{
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return ptr;
+}
+
+/***********************************************************************/
+// Scenare: jedna operace k-teho kroku
+
+/**
+ * Alokace a uvolnovani bloku stejne velikosti
+ */
+static void op_fixed(unsigned *state, long k)
+{
+    int i = rand_next(state) % SLOTS;
+    if (slots[i] != NULL) {
+        TIMED(k, al->free(slots[i]));
+        slots[i] = NULL;
+        live_add(-(ptrdiff_t)sizes[i]);
+    } else {
+        TIMED(k, slots[i] = al->alloc(fixed_size));
+        touch(slots[i], fixed_size);
+        sizes[i] = fixed_size;
+        live_add(fixed_size);
+    }
+}
+
+/**
+ * Nahodne velikosti od 8 B do 64 KiB, male jsou pravdepodobnejsi
+ */
+static void op_random(unsigned *state, long k)
+{
+    int i = rand_next(state) % SLOTS;
+    if (slots[i] != NULL) {
+        TIMED(k, al->free(slots[i]));
+        slots[i] = NULL;
+        live_add(-(ptrdiff_t)sizes[i]);
+    } else {
+        unsigned log2 = 3 + rand_next(state) % 13;
+        size_t size = (1UL << log2) + rand_next(state) % (1UL << log2);
+        TIMED(k, slots[i] = al->alloc(size));
+        touch(slots[i], size);
+        sizes[i] = size;
+        live_add(size);
+    }
+}
+
+/**
+ * Bloky rostou po 1.5 nasobcich, nejvetsi se uvolni
+ */
+static void op_realloc(unsigned *state, long k)
+{
+    int i = rand_next(state) % SLOTS;
+    if (slots[i] == NULL) {
+        TIMED(k, slots[i] = al->alloc(16));
+        touch(slots[i], 16);
+        sizes[i] = 16;
+        live_add(16);
+    } else if (sizes[i] < REALLOC_MAX) {
+        size_t size = sizes[i] * 3 / 2;
+        TIMED(k, slots[i] = al->realloc(slots[i], size));
+        touch(slots[i], size);
+        live_add(size - sizes[i]);
+        sizes[i] = size;
+    } else {
+        TIMED(k, al->free(slots[i]));
+        slots[i] = NULL;
+        live_add(-(ptrdiff_t)sizes[i]);
+    }
+}
+
+/**
+ * Prehrani zaznamenane stopy
+ */
+static void op_trace(unsigned *state, long k)
+{
+    (void)state;
+    const TraceOp *op = &trace->ops[k];
+    void **ptr = &trace_ptrs[op->slot];
+    size_t *size = &trace_sizes[op->slot];
+
+    switch (op->kind) {
+    case 'm':
+        TIMED(k, *ptr = al->alloc(op->size > 0 ? op->size : 1));
+        break;
+    case 'c':
+        TIMED(k, *ptr = al->calloc(1, op->size > 0 ? op->size : 1));
+        break;
+    case 'a':
+        TIMED(k, *ptr = al->memalign(op->alignment, op->size > 0 ? op->size : 1));
+        break;
+    case 'r':
+        TIMED(k, *ptr = al->realloc(*ptr, op->size > 0 ? op->size : 1));
+        live_add(-(ptrdiff_t)*size);
+        break;
+    case 'f':
+        TIMED(k, al->free(*ptr));
+        *ptr = NULL;
+        live_add(-(ptrdiff_t)*size);
+        return;
+    }
+    *size = op->size > 0 ? op->size : 1;
+    touch(*ptr, *size);
+    live_add(*size);
+}
+
+/**
+ * Runs ops calls of the scenario, measurements of the memory aren't timed.
+ */
+static void run_ops(void (*op)(unsigned *, long), long ops, Result *res)
+{
+    unsigned state = 2463534242u;
+    for (long done = 0; done < ops; done += SAMPLE) {
+        long end = (done + SAMPLE < ops) ? done + SAMPLE : ops;
+        uint64_t start = now_ns();
+        for (long k = done; k < end; k++)
+            op(&state, k);
+        res->secs += (now_ns() - start) / 1e9;
+        sample();
+    }
+    res->ops = ops;
+}
+
+static void free_slots(void)
+{
+    for (int i = 0; i < SLOTS; i++) {
+        if (slots[i] != NULL)
+            al->free(slots[i]);
+    }
+}
+
+static void run_fixed(Result *res)
+{
+    run_ops(op_fixed, OPS, res);
+    free_slots();
+}
+
+static void run_random(Result *res)
+{
+    run_ops(op_random, OPS, res);
+    free_slots();
+}
+
+/**
+ * The random scenario with the heap profiler of My MALloc sampling one
+ * allocation per 2 MiB on average.
+ */
+static void run_random_profiled(Result *res)
+{
+    mmal_set_sample_interval(2 * 1024 * 1024);
+    run_random(res);
+}
+
+static void run_realloc(Result *res)
+{
+    run_ops(op_realloc, OPS, res);
+    free_slots();
+}
+
+static void run_trace(Result *res)
+{
+    trace_ptrs = harness_alloc(trace->slots * sizeof(void *) + 1);
+    trace_sizes = harness_alloc(trace->slots * sizeof(size_t) + 1);
+    run_ops(op_trace, trace->count, res);
+    for (size_t i = 0; i < trace->slots; i++) {
+        if (trace_ptrs[i] != NULL)
+            al->free(trace_ptrs[i]);
+    }
+}
+
+/***********************************************************************/
+// Producent a konzument: bloky uvolnuje jine vlakno
+
+static void *ring[RING];
+static size_t ring_head;
+static size_t ring_tail;
+
+static void *consumer(void *arg)
+{
+    (void)arg;
+    for (long k = 0; k < OPS / 2; k++) {
+        size_t tail = ring_tail;
+        while (__atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == tail)
+            sched_yield();
+        void *ptr = ring[tail % RING];
+        size_t size = *(size_t *)ptr;
+        if (prodcons_heap != NULL) {
+            TIMED(k, mmal_heap_free(prodcons_heap, ptr));
+        } else {
+            TIMED(k, al->free(ptr));
+        }
+        live_add(-(ptrdiff_t)size);
+        __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void run_prodcons(Result *res)
+{
+    unsigned state = 2463534242u;
+    pthread_t thread;
+    uint64_t sampling = 0;
+    uint64_t start = now_ns();
+    if (pthread_create(&thread, NULL, consumer, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    for (long k = 0; k < OPS / 2; k++) {
+        size_t head = ring_head;
+        while (head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) == RING)
+            sched_yield();
+        size_t size = 16 + rand_next(&state) % 1008;
+        void *ptr;
+        if (prodcons_heap != NULL) {
+            TIMED(k, ptr = mmal_heap_malloc(prodcons_heap, size));
+        } else {
+            TIMED(k, ptr = al->alloc(size));
+        }
+        touch(ptr, size);
+        *(size_t *)ptr = size;
+        live_add(size);
+        ring[head % RING] = ptr;
+        __atomic_store_n(&ring_head, head + 1, __ATOMIC_RELEASE);
+
+        if (k % SAMPLE == 0) {
+            uint64_t t0 = now_ns();
+            sample();
+            sampling += now_ns() - t0;
+        }
+    }
+
+    pthread_join(thread, NULL);
+    res->secs = (now_ns() - start - sampling) / 1e9;
+    res->ops = OPS;
+}
+
+/**
+ * The producer allocates from its own heap of My MALloc, blocks freed by
+ * the consumer are queued to the heap without taking its lock.
+ */
+static void run_prodcons_heap(Result *res)
+{
+    if ((prodcons_heap = mmal_heap_create()) == NULL) {
+        perror("mmal_heap_create");
+        exit(1);
+    }
+    run_prodcons(res);
+}
+
+/***********************************************************************/
+// Davky: bloky stejne velikosti (pakety) se alokuji a uvolnuji po 32 az 256
+
+static void *bursts[BURSTS][BURST_MAX];
+static size_t burst_counts[BURSTS];
+static size_t burst_sizes[BURSTS];
+/// Batch functions of the allocator are used
+static bool burst_batch;
+
+static void burst_free(int b)
+{
+    if (burst_batch && al->free_batch != NULL) {
+        al->free_batch(bursts[b], burst_counts[b]);
+    } else {
+        for (size_t i = 0; i < burst_counts[b]; i++)
+            al->free(bursts[b][i]);
+    }
+    live_add(-(ptrdiff_t)(burst_counts[b] * burst_sizes[b]));
+}
+
+static void burst_alloc(int b, size_t size, size_t count)
+{
+    if (burst_batch && al->alloc_batch != NULL) {
+        if (al->alloc_batch(size, count, bursts[b]) != count) {
+            perror("alloc_batch");
+            exit(1);
+        }
+    } else {
+        for (size_t i = 0; i < count; i++)
+            bursts[b][i] = al->alloc(size);
+    }
+}
+
+/**
+ * The oldest burst is freed and a new one is allocated. The latency is
+ * the time of both per block.
+ */
+static void run_burst(Result *res)
+{
+    unsigned state = 2463534242u;
+    for (long k = 0; res->ops < OPS; k++) {
+        int b = k % BURSTS;
+        size_t count = 32 + rand_next(&state) % (BURST_MAX - 31);
+        size_t size = 64 + rand_next(&state) % 1473;
+        size_t ops = count + burst_counts[b];
+
+        uint64_t start = now_ns();
+        burst_free(b);
+        burst_alloc(b, size, count);
+        uint64_t time = now_ns() - start;
+
+        res->secs += time / 1e9;
+        res->ops += ops;
+        if (lat_count < sizeof(lat) / sizeof(lat[0]))
+            lat[lat_count++] = time / ops;
+        for (size_t i = 0; i < count; i++)
+            touch(bursts[b][i], size);
+        burst_counts[b] = count;
+        burst_sizes[b] = size;
+        live_add(count * size);
+        if (k % 16 == 0)
+            sample();
+    }
+
+    for (int b = 0; b < BURSTS; b++)
+        burst_free(b);
+}
+
+static void run_burst_batch(Result *res)
+{
+    burst_batch = true;
+    run_burst(res);
+}
+
+/***********************************************************************/
+// Pozadavky: pomocna data se alokuji po kouscich a uvolni najednou
+
+static void *scratch[SCRATCH_MAX];
+/// Scratch data are allocated from a region of My MALloc
+static bool scratch_region;
+
+/**
+ * Every request allocates 16 to 512 blocks of 8 B to 512 B, they are
+ * freed at its end. Every LAT_EVERY-th allocation is timed.
+ */
+static void run_scratch(Result *res)
+{
+    unsigned state = 2463534242u;
+    MmalRegion *region = scratch_region ? mmal_region_create() : NULL;
+    if (scratch_region && region == NULL) {
+        perror("mmal_region_create");
+        exit(1);
+    }
+
+    long k = 0;
+    while (k < OPS) {
+        size_t count = 16 + rand_next(&state) % (SCRATCH_MAX - 15);
+        size_t bytes = 0;
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < count; i++, k++) {
+            size_t size = 8 + rand_next(&state) % 505;
+            if (region != NULL) {
+                TIMED(k, scratch[i] = mmal_region_alloc(region, size));
+            } else {
+                TIMED(k, scratch[i] = al->alloc(size));
+            }
+            touch(scratch[i], size);
+            bytes += size;
+        }
+        live_add(bytes);
+        sample();
+        if (region != NULL) {
+            mmal_region_reset(region);
+        } else {
+            for (size_t i = 0; i < count; i++)
+                al->free(scratch[i]);
+        }
+        live_add(-(ptrdiff_t)bytes);
+        res->secs += (now_ns() - start) / 1e9;
+    }
+    res->ops = k;
+
+    if (region != NULL)
+        mmal_region_destroy(region);
+}
+
+static void run_scratch_region(Result *res)
+{
+    scratch_region = true;
+    run_scratch(res);
+}
+
+/***********************************************************************/
+
+/**
+ * Opens a hardware counter of the process and its future threads (user
+ * space only, so it works with perf_event_paranoid up to 2), disabled.
+ * Returns -1 if it isn't available.
+ */
+static int counter_open(uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * Stops the counter and gives its value per call (negative if the counter
+ * isn't available).
+ */
+static double counter_close(int fd, long ops)
+{
+    uint64_t value;
+    if (fd < 0)
+        return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    bool ok = read(fd, &value, sizeof(value)) == sizeof(value);
+    close(fd);
+    return (ok && ops > 0) ? (double)value / ops : -1;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Gives the resident set size of the process in KiB.
+ */
+static size_t current_rss(void)
+{
+    size_t pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/**
+ * Runs the scenario with the allocator in a child process.
+ */
+static void run(const char *name, void (*scenario)(Result *), const Allocator *allocator)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        Result res;
+        memset(&res, 0, sizeof(res));
+        size_t start_rss = current_rss();
+        al = allocator;
+        start_mapped = al->mapped();
+
+        int cycles = -1, misses = -1;
+        if (use_counters) {
+            cycles = counter_open(PERF_COUNT_HW_CPU_CYCLES);
+            misses = counter_open(PERF_COUNT_HW_CACHE_MISSES);
+            if (cycles >= 0)
+                ioctl(cycles, PERF_EVENT_IOC_ENABLE, 0);
+            if (misses >= 0)
+                ioctl(misses, PERF_EVENT_IOC_ENABLE, 0);
+        }
+        mmal_instrument_reset();
+
+        scenario(&res);
+
+        res.cycles = counter_close(cycles, res.ops);
+        res.cache_misses = counter_close(misses, res.ops);
+        MmalInstrument instrument;
+        if (allocator == &allocators[0] && mmal_instrument_read(&instrument) == 0) {
+            fprintf(stderr, "== %s\n", name);
+            mmal_instrument_dump(STDERR_FILENO);
+        }
+
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        res.peak_rss = (size_t)usage.ru_maxrss > start_rss ? usage.ru_maxrss - start_rss : 0;
+        if (peak_mapped > peak_live)
+            res.fragmentation = 100.0 - 100.0 * peak_live / peak_mapped;
+
+        size_t count = MIN(lat_count, sizeof(lat) / sizeof(lat[0]));
+        if (count > 0) {
+            qsort(lat, count, sizeof(lat[0]), cmp_u64);
+            res.p50 = lat[count * 50 / 100];
+            res.p90 = lat[count * 90 / 100];
+            res.p99 = lat[count * 99 / 100];
+            res.p999 = lat[count * 999 / 1000];
+            res.max = lat[count - 1];
+        }
+
+        if (write(fds[1], &res, sizeof(res)) != sizeof(res))
+            _exit(1);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    Result res;
+    ssize_t got = read(fds[0], &res, sizeof(res));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (got != sizeof(res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%-18s | %-5s | failed\n", name, allocator->name);
+        return;
+    }
+
+    printf("%-18s | %-5s | %7.2f | %6lu | %6lu | %6lu | %8lu | %8lu | %12zu | %6.1f",
+           name, allocator->name, res.ops / res.secs / 1e6,
+           res.p50, res.p90, res.p99, res.p999, res.max,
+           res.peak_rss, res.fragmentation);
+    if (use_counters) {
+        if (res.cycles >= 0)
+            printf(" | %8.0f", res.cycles);
+        else
+            printf(" | %8s", "-");
+        if (res.cache_misses >= 0)
+            printf(" | %8.2f", res.cache_misses);
+        else
+            printf(" | %8s", "-");
+    }
+    printf("\n");
+}
+
+/***********************************************************************/
+// Nacteni stopy
+
+/**
+ * Block of the traced program and its slot (open addressing)
+ */
+typedef struct trace_key TraceKey;
+struct trace_key {
+    unsigned long pid;
+    unsigned long ptr;
+    uint32_t slot;
+    bool used;
+};
+
+static TraceKey *keys;
+static size_t key_capacity;
+static size_t key_count;
+static uint32_t *free_slots_stack;
+static size_t free_slots_count;
+static size_t free_slots_capacity;
+
+static size_t key_hash(unsigned long pid, unsigned long ptr)
+{
+    return (size_t)((ptr / 16) ^ (pid * 0x9e3779b97f4a7c15ULL)) * 0x9e3779b97f4a7c15ULL >> 16;
+}
+
+static TraceKey *key_find(unsigned long pid, unsigned long ptr)
+{
+    size_t i = key_hash(pid, ptr) & (key_capacity - 1);
+    while (keys[i].used && (keys[i].pid != pid || keys[i].ptr != ptr))
+        i = (i + 1) & (key_capacity - 1);
+    return &keys[i];
+}
+
+/**
+ * Removes the key, following keys of the cluster are moved back.
+ */
+static void key_remove(TraceKey *key)
+{
+    size_t i = key - keys;
+    size_t mask = key_capacity - 1;
+    keys[i].used = false;
+    key_count--;
+    for (size_t j = (i + 1) & mask; keys[j].used; j = (j + 1) & mask) {
+        size_t home = key_hash(keys[j].pid, keys[j].ptr) & mask;
+        // The key can move to the hole, if the hole is between its home
+        // and its current position
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            keys[i] = keys[j];
+            keys[j].used = false;
+            i = j;
+        }
+    }
+}
+
+static void key_grow(void)
+{
+    TraceKey *old = keys;
+    size_t old_capacity = key_capacity;
+    key_capacity = old_capacity ? old_capacity * 2 : 1024;
+    keys = calloc(key_capacity, sizeof(TraceKey));
+    if (keys == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].used)
+            *key_find(old[i].pid, old[i].ptr) = old[i];
+    }
+    free(old);
+}
+
+static uint32_t slot_take(Trace *t)
+{
+    if (free_slots_count > 0)
+        return free_slots_stack[--free_slots_count];
+    return t->slots++;
+}
+
+static void slot_put(uint32_t slot)
+{
+    if (free_slots_count == free_slots_capacity) {
+        free_slots_capacity = free_slots_capacity ? free_slots_capacity * 2 : 1024;
+        free_slots_stack = realloc(free_slots_stack, free_slots_capacity * sizeof(uint32_t));
+        if (free_slots_stack == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    free_slots_stack[free_slots_count++] = slot;
+}
+
+static void trace_push(Trace *t, size_t *capacity, TraceOp op)
+{
+    if (t->count == *capacity) {
+        *capacity = *capacity ? *capacity * 2 : 4096;
+        t->ops = realloc(t->ops, *capacity * sizeof(TraceOp));
+        if (t->ops == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    t->ops[t->count++] = op;
+}
+
+/**
+ * Starts a new block of the traced program. A block which is still live
+ * is freed first (lines of threads can be written out of order).
+ */
+static void trace_new(Trace *t, size_t *capacity, unsigned long pid, unsigned long ptr, TraceOp op)
+{
+    if (2 * (key_count + 1) > key_capacity)
+        key_grow();
+    TraceKey *key = key_find(pid, ptr);
+    if (key->used) {
+        trace_push(t, capacity, (TraceOp){'f', key->slot, 0, 0});
+        slot_put(key->slot);
+    } else {
+        key->used = true;
+        key->pid = pid;
+        key->ptr = ptr;
+        key_count++;
+    }
+    key->slot = op.slot = slot_take(t);
+    trace_push(t, capacity, op);
+}
+
+/**
+ * Reads the trace, pointers of the program are mapped to dense slots.
+ * Frees of blocks allocated before the trace started are skipped.
+ */
+static bool trace_load(const char *path, Trace *t)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return false;
+    }
+
+    memset(t, 0, sizeof(*t));
+    t->path = path;
+    size_t capacity = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long pid, a = 0, b = 0, c = 0;
+        char kind;
+        if (sscanf(line, "%lx %c %lx %lx %lx", &pid, &kind, &a, &b, &c) < 3)
+            continue;
+
+        if (kind == 'm' || kind == 'c') {
+            trace_new(t, &capacity, pid, a, (TraceOp){kind, 0, b, 0});
+        } else if (kind == 'a') {
+            trace_new(t, &capacity, pid, a, (TraceOp){kind, 0, c, b});
+        } else if (kind == 'r' || kind == 'f') {
+            TraceKey *key = (key_capacity > 0) ? key_find(pid, a) : NULL;
+            if (key == NULL || !key->used) {
+                if (kind == 'r')
+                    trace_new(t, &capacity, pid, b, (TraceOp){'m', 0, c, 0});
+                continue;
+            }
+            uint32_t slot = key->slot;
+            key_remove(key);
+            if (kind == 'f') {
+                trace_push(t, &capacity, (TraceOp){'f', slot, 0, 0});
+                slot_put(slot);
+            } else {
+                // The block keeps its slot under the new pointer
+                if (2 * (key_count + 1) > key_capacity)
+                    key_grow();
+                TraceKey *new_key = key_find(pid, b);
+                if (new_key->used) {
+                    trace_push(t, &capacity, (TraceOp){'f', new_key->slot, 0, 0});
+                    slot_put(new_key->slot);
+                } else {
+                    key_count++;
+                }
+                *new_key = (TraceKey){pid, b, slot, true};
+                trace_push(t, &capacity, (TraceOp){'r', slot, c, 0});
+            }
+        }
+    }
+    fclose(f);
+
+    // Stopy jsou nezavisle
+    free(keys);
+    keys = NULL;
+    key_capacity = key_count = 0;
+    free_slots_count = 0;
+    return true;
+}
+
+/***********************************************************************/
+
+static void run_both(const char *name, void (*scenario)(Result *))
+{
+    for (size_t i = 0; i < sizeof(allocators) / sizeof(allocators[0]); i++)
+        run(name, scenario, &allocators[i]);
+}
+
+int main(int argc, char *argv[])
+{
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        use_counters = true;
+        argc--;
+        argv++;
+    }
+    printf("scenario           | alloc | Mops/s  | p50 ns | p90 ns | p99 ns | p99.9 ns | max ns   | peak RSS KiB | frag %%");
+    printf(use_counters ? " | cyc/op   | miss/op\n" : "\n");
+
+    fixed_size = 64;
+    run_both("fixed 64", run_fixed);
+    fixed_size = 4096;
+    run_both("fixed 4096", run_fixed);
+    run_both("random", run_random);
+    run("random profiled", run_random_profiled, &allocators[0]);
+    run_both("realloc", run_realloc);
+    run_both("prodcons", run_prodcons);
+    run("prodcons heap", run_prodcons_heap, &allocators[0]);
+    run_both("burst", run_burst);
+    run("burst batch", run_burst_batch, &allocators[0]);
+    run_both("scratch", run_scratch);
+    run("scratch region", run_scratch_region, &allocators[0]);
+
+    for (int i = 1; i < argc; i++) {
+        Trace t;
+        if (!trace_load(argv[i], &t))
+            return 1;
+        trace = &t;
+        const char *name = strrchr(argv[i], '/');
+        run_both(name != NULL ? name + 1 : argv[i], run_trace);
+        free(t.ops);
+    }
+
+    return 0;
+}
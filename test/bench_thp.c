@@ -0,0 +1,150 @@
+/**
+ * @file bench_thp.c
+ * Benchmark of options of arenas (see mmal_set_arena_options()) on a big
+ * heap accessed randomly. Every option runs in its own child process and
+ * reports the time of allocation and of the first touch, the number of page
+ * faults, memory backed by huge pages and the latency of random reads
+ * (dominated by TLB misses with usual pages).
+ *
+ * Usage: bench_thp [heap_MiB]
+ */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../src/mmal.h"
+
+/// Size of blocks of the heap (they stay in arenas)
+#define BLOCK (64*1024)
+/// Number of random reads
+#define READS 20000000
+/// Maximal number of blocks
+#define MAX_BLOCKS (64*1024)
+
+static char *blocks[MAX_BLOCKS];
+
+/// Result of random reads, so they aren't optimized out
+static volatile unsigned char sink;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static long minor_faults(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+/**
+ * Gives memory of the process backed by huge pages (transparent and from
+ * hugetlbfs) in KiB.
+ */
+static size_t huge_kib(void)
+{
+    size_t total = 0;
+    char line[256];
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        size_t kib;
+        if (sscanf(line, "AnonHugePages: %zu", &kib) == 1 ||
+            sscanf(line, "Private_Hugetlb: %zu", &kib) == 1)
+            total += kib;
+    }
+    fclose(f);
+    return total;
+}
+
+static void run(const char *name, unsigned options, size_t count)
+{
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid > 0) {
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            printf("%-14s | failed\n", name);
+        return;
+    }
+
+    mmal_set_arena_options(options);
+
+    // Alokace a prvni zapis (vypadky stranek)
+    long faults = minor_faults();
+    double start = now_ms();
+    for (size_t i = 0; i < count; i++) {
+        if ((blocks[i] = mmalloc(BLOCK)) == NULL) {
+            perror("mmalloc");
+            exit(1);
+        }
+    }
+    double allocated = now_ms();
+    uint64_t x = 88172645463325252ull;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t k = 0; k < BLOCK; k += 8) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            memcpy(blocks[i] + k, &x, 8);
+        }
+    }
+    double touched = now_ms();
+    faults = minor_faults() - faults;
+
+    // Nahodne cteni, dalsi adresa zavisi na prectenem bajtu
+    unsigned char sum = 0;
+    double reading = now_ms();
+    for (long r = 0; r < READS; r++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        x += sum;
+        sum = blocks[x % count][(x >> 32) % BLOCK];
+    }
+    double read = now_ms();
+    sink = sum;
+
+    printf("%-14s | %8.1f | %8.1f | %8ld | %8zu | %9.1f\n",
+           name, allocated - start, touched - allocated, faults,
+           huge_kib() / 1024, (read - reading) * 1e6 / READS);
+
+    for (size_t i = 0; i < count; i++)
+        mfree(blocks[i]);
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t heap_mib = (argc > 1) ? (size_t)atoi(argv[1]) : 256;
+    size_t count = heap_mib * 1024 * 1024 / BLOCK;
+    if (count == 0 || count > MAX_BLOCKS) {
+        fprintf(stderr, "heap_MiB from 1 to %zu\n", (size_t)MAX_BLOCKS * BLOCK / 1024 / 1024);
+        return 1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("heap %zu MiB of %d KiB blocks, %d random reads\n", heap_mib, BLOCK / 1024, READS);
+    printf("options        | alloc ms | touch ms | faults   | huge MiB | ns/access\n");
+    run("4 KiB pages", 0, count);
+    run("populate", MMAL_ARENA_POPULATE, count);
+    run("thp", MMAL_ARENA_THP, count);
+    run("thp+populate", MMAL_ARENA_THP | MMAL_ARENA_POPULATE, count);
+    run("hugetlb", MMAL_ARENA_HUGETLB, count);
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+/**
+ * @file bench_threads.c
+ * Benchmark of throughput scaling of My MALloc built with MMAL_THREADS
+ * (release build). Threads allocate and free random small blocks, either
+ * from the shared default heap (with caches of threads) or every thread
+ * from its own heap. The table shows the speedup from 1 thread up to N
+ * threads (the number of online CPUs by default).
+ *
+ * Usage: bench_threads [max_threads]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/mmal.h"
+
+/// Number of mmalloc/mfree operations done by every thread
+#define OPS_PER_THREAD 20000000
+/// Number of blocks a thread keeps allocated at the same time
+#define SLOTS 256
+
+/**
+ * Simple and fast pseudo-random generator (xorshift)
+ */
+static unsigned rand_next(unsigned *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/**
+ * Gives a random size, mostly small objects, every 16th up to 4 KiB.
+ */
+static size_t rand_size(unsigned *state)
+{
+    unsigned r = rand_next(state);
+    return (r % 16 == 0) ? 1 + r % 4096 : 1 + r % 256;
+}
+
+/**
+ * Allocates and frees random blocks of the default heap. The first and
+ * the last byte of every block is touched.
+ */
+static void *worker(void *arg)
+{
+    unsigned state = 2463534242u + (unsigned)(size_t)arg;
+    char *slots[SLOTS] = {NULL};
+
+    for (int op = 0; op < OPS_PER_THREAD; op++) {
+        unsigned i = rand_next(&state) % SLOTS;
+        if (slots[i] != NULL) {
+            mfree(slots[i]);
+            slots[i] = NULL;
+        } else {
+            size_t size = rand_size(&state);
+            if ((slots[i] = mmalloc(size)) == NULL) {
+                perror("mmalloc");
+                exit(1);
+            }
+            slots[i][0] = slots[i][size - 1] = 1;
+        }
+    }
+
+    for (int i = 0; i < SLOTS; i++) {
+        if (slots[i] != NULL) {
+            mfree(slots[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Same as worker(), but with its own heap. Blocks left at the end are
+ * freed by destroying the heap.
+ */
+static void *heap_worker(void *arg)
+{
+    unsigned state = 2463534242u + (unsigned)(size_t)arg;
+    char *slots[SLOTS] = {NULL};
+    MmalHeap *heap = mmal_heap_create();
+    if (heap == NULL) {
+        perror("mmal_heap_create");
+        exit(1);
+    }
+
+    for (int op = 0; op < OPS_PER_THREAD; op++) {
+        unsigned i = rand_next(&state) % SLOTS;
+        if (slots[i] != NULL) {
+            mmal_heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            size_t size = rand_size(&state);
+            if ((slots[i] = mmal_heap_malloc(heap, size)) == NULL) {
+                perror("mmal_heap_malloc");
+                exit(1);
+            }
+            slots[i][0] = slots[i][size - 1] = 1;
+        }
+    }
+
+    mmal_heap_destroy(heap);
+
+    return NULL;
+}
+
+/**
+ * Runs the work in the given number of threads.
+ * @return wall time in seconds
+ */
+static double run_workers(void *(*work)(void *), int threads)
+{
+    pthread_t tids[threads];
+    struct timespec start, stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&tids[i], NULL, work, (void *)(size_t)i) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    return (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1) {
+        max_threads = atoi(argv[1]);
+    }
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+    if (max_threads == 1) {
+        fprintf(stderr, "bench_threads: a single thread, no scaling to measure\n");
+    }
+
+    // Vlakna sdili vychozi haldu, nebo ma kazde svou
+    printf("heap    | threads | ops/s        | speedup\n");
+    for (int own = 0; own <= 1; own++) {
+        double single = 0;
+        // Powers of two and max_threads itself
+        for (int threads = 1; threads <= max_threads; threads = (threads < max_threads && threads * 2 > max_threads) ? max_threads : threads * 2) {
+            double secs = run_workers(own ? heap_worker : worker, threads);
+            double ops = (double)threads * OPS_PER_THREAD / secs;
+            if (threads == 1) {
+                single = ops;
+            }
+            printf("%-7s | %7d | %12.0f | %6.2fx\n", own ? "own" : "default", threads, ops, ops / single);
+        }
+    }
+
+    return 0;
+}
@@ -3,21 +3,73 @@
  * @author Aleš Smrčka
  */
 #undef NDEBUG
+#define _GNU_SOURCE // mremap
 
 #include <stdio.h>
 #include <assert.h>
 #include "../src/mmal.h"
 #include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 
 #define MSTR(x) #x
 #define M2STR(x) MSTR(x)
 #define HERE __FILE__ ":" M2STR(__LINE__) ": "
 
+/// Velikost celeho bloku (vcetne hlavicky), plot ma velikost 0
+#define BLOCK_SIZE(h) ((h)->size & ~HDR_FLAGS)
+
+/// Priznak volneho bloku, jehoz stranky byly vraceny systemu
+#define HDR_PURGED ((size_t)2)
+
+/// Priznak bloku, pred kterym lezi volny blok (s patickou na konci)
+#define HDR_PREV_FREE ((size_t)1)
+
+/// Paticka predchoziho volneho bloku (jeho velikost)
+#define PREV_FOOTER(h) (((size_t*)(h))[-1])
+
+/// Fyzicky nasledujici hlavicka
+Header *next_hdr(Header *h)
+{
+    return (Header*)((char*)h + BLOCK_SIZE(h));
+}
+
+/// Je hlavicka plotem (posledni hlavickou areny)?
+int is_fence(Header *h)
+{
+    return BLOCK_SIZE(h) == 0;
+}
+
+/// Nenulova hodnota: mremap() selze, jako by proces narazil na limit mapovani
+static int mremap_fails = 0;
+
+/// mremap() pro mmal.c, ktery lze nechat selhat (jinak primo volani systemu)
+void *mremap(void *old_address, size_t old_size, size_t new_size, int flags, ...)
+{
+    if (mremap_fails) {
+        errno = ENOMEM;
+        return MAP_FAILED;
+    }
+    void *new_address = NULL;
+    if (flags & MREMAP_FIXED) {
+        va_list args;
+        va_start(args, flags);
+        new_address = va_arg(args, void *);
+        va_end(args);
+    }
+    return (void *)syscall(SYS_mremap, old_address, old_size, new_size, flags, new_address);
+}
+
 void debug_hdr(Header *h, int idx)
 {
     printf("+- Header %d @ %p, data @ %p\n", idx, h, &h[1]);
-    printf("|    | next           | size     | asize    |\n");
-    printf("|    | %-14p | %-8lu | %-8lu |\n", h->next, h->size, h->asize);
+    printf("|    | size     | flags | asize    |\n");
+    printf("|    | %-8lu | %-5lu | %-8lu |\n", BLOCK_SIZE(h), h->size & HDR_FLAGS, h->asize);
 }
 
 void debug_arena(Arena *a, int idx)
@@ -25,16 +77,16 @@ void debug_arena(Arena *a, int idx)
     printf("Arena %d @ %p, size: %lu\n", idx, a, a->size);
     printf("|\n");
     char *arena_stop = (char*)a + a->size;
-    Header *h = (Header*)&a[1];
+    Header *h = FIRST_HEADER(a);
     int i = 1;
 
     while ((char*)h >= (char*)a && (char*)h < arena_stop)
     {
         debug_hdr(h, i);
         i++;
-        h = h->next;
-        if (h == (Header*)&a[1])
+        if (is_fence(h))
             break;
+        h = next_hdr(h);
     }
 }
 
@@ -60,7 +112,7 @@ int main()
     // Prvni alokace
     // Mela by alokovat novou arenu, pripravit hlavicku v ni a prave jeden
     // blok.
-    void *p1 = mmalloc(42);
+    void *p1 = mmalloc(420);
     /**
      *   v----- first_arena
      *   +-----+------+----+------+----------------------------+
@@ -74,18 +126,22 @@ int main()
     assert(first_arena->next == NULL);
     assert(first_arena->size > 0);
     assert(first_arena->size <= PAGE_SIZE);
-    Header *h1 = (Header*)(&first_arena[1]);
-    Header *h2 = h1->next;
-    assert(h1->asize == 42);
+    Header *h1 = FIRST_HEADER(first_arena);
+    Header *h2 = next_hdr(h1);
+    assert(p1 == &h1[1]);
+    assert((size_t)p1 % ALIGNMENT == 0);
+    assert(h1->asize == 420);
+    assert(h1->size & HDR_USED);
     assert((char*)h2 > (char*)h1);
-    assert(h2->next == h1);
+    assert(is_fence(next_hdr(h2)));
     assert(h2->asize == 0);
+    assert(!(h2->size & HDR_USED));
 
-    debug_arenas(HERE "po mmalloc(42) = mmalloc(0x2a)");
+    debug_arenas(HERE "po mmalloc(420) = mmalloc(0x1a4)");
 
     /***********************************************************************/
     // Druha alokace
-    char *p2 = mmalloc(42);
+    char *p2 = mmalloc(420);
     /**
      *   v----- first_arena
      *   +-----+------+----+------+----+------+----------------+
@@ -94,18 +150,19 @@ int main()
      *       p1-------^           ^
      *       p2-------------------/
      */
-    Header *h3 = h2->next;
+    Header *h3 = next_hdr(h2);
     assert(h3 != h1);
     assert(h2 != h3);
-    assert(h3->next == h1);
+    assert(is_fence(next_hdr(h3)));
     assert((char*)h2 < p2);
     assert(p2 < (char*)h3);
+    assert((size_t)p2 % ALIGNMENT == 0);
 
-    debug_arenas(HERE "po 2. mmalloc(42) = mmalloc(0x2a)");
+    debug_arenas(HERE "po 2. mmalloc(420) = mmalloc(0x1a4)");
 
     /***********************************************************************/
     // Treti alokace
-    void *p3 = mmalloc(16);
+    void *p3 = mmalloc(300);
     /**
      *                p1          p2          p3
      *   +-----+------+----+------+----+------+-----+------+---+
@@ -113,7 +170,7 @@ int main()
      *   +-----+------+----+------+----+------+-----+------+---+
      */
     // insert assert here
-    debug_arenas(HERE "po 3. mmalloc(16) = mmalloc(0x10)");
+    debug_arenas(HERE "po 3. mmalloc(300) = mmalloc(0x12c)");
 
     /***********************************************************************/
     // Uvolneni prvniho bloku
@@ -153,6 +210,8 @@ int main()
     debug_arenas(HERE "po mfree(p2)");
 
     // Dalsi alokace se nevleze do existujici areny
+    // (velke bloky by jinak dostaly vlastni mapovani mimo areny)
+    mmal_set_mmap_threshold(PAGE_SIZE*16);
     void *p4 = mmalloc(PAGE_SIZE*2);
     /**
      *   /-- first_arena
@@ -167,9 +226,10 @@ int main()
      *       +-----+------+---------------------------+------+-----+
      */
     Header *h4 = &((Header*)p4)[-1];
-    assert(h1->next == h4);
+    assert(first_arena->next != NULL);
+    assert(h4 == FIRST_HEADER(first_arena->next));
     assert(h4->asize == PAGE_SIZE*2);
-    assert(h4->next->next == h1);
+    assert(is_fence(next_hdr(next_hdr(h4))));
 
     debug_arenas(HERE "po mmalloc(262144) = mmalloc(0x40000)");
 
@@ -184,6 +244,8 @@ int main()
 
     assert(p4 != NULL);
     // h4 need not to be in the same location; would be nice, but not required
+    // Nasledujici volny blok staci, takze blok roste na miste
+    assert(&((Header*)p4)[-1] == h4);
     h4 = &((Header*)p4)[-1];
     assert(h4->asize == PAGE_SIZE*2 + 2);
     debug_arenas(HERE "po mrealloc(p4, 262146) = mmrealloc(p4, 0x400002)");
@@ -191,9 +253,813 @@ int main()
     /***********************************************************************/
     mfree(p4);
     assert(h4->asize == 0);
-    assert(h4->next == h1);
+    assert(is_fence(next_hdr(h4)));
 
     debug_arenas(HERE "po mfree(p4)");
 
+    /***********************************************************************/
+    // Obe areny jsou prazdne, vychozi limit je drzi namapovane
+    size_t mapped, unmapped;
+    mmal_arena_counters(&mapped, &unmapped);
+    assert(mapped == 2);
+    assert(unmapped == 0);
+
+    // Nad novym limitem se prazdna arena vraci systemu
+    mmal_set_arena_cache(1);
+    mmal_arena_counters(&mapped, &unmapped);
+    assert(unmapped == 1);
+    assert(first_arena != NULL);
+    assert(first_arena->next == NULL);
+    h1 = FIRST_HEADER(first_arena);
+    assert(is_fence(next_hdr(h1)));
+
+    debug_arenas(HERE "po mmal_set_arena_cache(1)");
+
+    // Bez cache se posledni arena uvolni hned pri mfree()
+    mmal_set_arena_cache(0);
+    assert(first_arena == NULL);
+    p1 = mmalloc(420);
+    assert(p1 != NULL);
+    assert(first_arena != NULL);
+    mfree(p1);
+    assert(first_arena == NULL);
+    mmal_arena_counters(&mapped, &unmapped);
+    assert(mapped == 3);
+    assert(unmapped == 3);
+
+    /***********************************************************************/
+    // Jediny blok areny roste spolu s arenou (mremap), data se nekopiruji
+    char *p5 = mmalloc(PAGE_SIZE*3);
+    assert(p5 != NULL);
+    memset(p5, 'x', PAGE_SIZE*3);
+    p5 = mrealloc(p5, PAGE_SIZE*8);
+    assert(p5 != NULL);
+    assert(p5[0] == 'x');
+    assert(p5[PAGE_SIZE*3 - 1] == 'x');
+    assert(first_arena->size > PAGE_SIZE*8);
+    assert(first_arena->next == NULL);
+    Header *h5 = &((Header*)p5)[-1];
+    assert(h5 == FIRST_HEADER(first_arena));
+    assert(h5->asize == PAGE_SIZE*8);
+    mmal_arena_counters(&mapped, &unmapped);
+    assert(mapped == 4);
+
+    debug_arenas(HERE "po mrealloc(p5, 1048576) = mrealloc(p5, 0x100000)");
+
+    // Zmenseni uvolni zbytek bloku
+    p5 = mrealloc(p5, 42);
+    assert(!is_fence(next_hdr(h5)));
+    assert(next_hdr(h5)->asize == 0);
+    assert(is_fence(next_hdr(next_hdr(h5))));
+    mfree(p5);
+    assert(first_arena == NULL);
+
+    /***********************************************************************/
+    // Velky blok ma vlastni mapovani mimo areny
+    mmal_set_mmap_threshold(PAGE_SIZE);
+    char *p6 = mmalloc(PAGE_SIZE*2);
+    assert(p6 != NULL);
+    assert(first_arena == NULL);
+    Header *h6 = &((Header*)p6)[-1];
+    assert(h6->asize == PAGE_SIZE*2);
+    assert((size_t)p6 % ALIGNMENT == 0);
+    memset(p6, 'y', PAGE_SIZE*2);
+
+    // Zmena velikosti pres mremap zachova data
+    p6 = mrealloc(p6, PAGE_SIZE*32);
+    assert(p6 != NULL);
+    assert(first_arena == NULL);
+    assert(p6[0] == 'y');
+    assert(p6[PAGE_SIZE*2 - 1] == 'y');
+    p6[PAGE_SIZE*32 - 1] = 'y';
+    h6 = &((Header*)p6)[-1];
+    assert(h6->asize == PAGE_SIZE*32);
+
+    // Mensi bloky zustavaji v arenach
+    p1 = mmalloc(420);
+    assert(first_arena != NULL);
+    assert(is_fence(next_hdr(next_hdr(FIRST_HEADER(first_arena)))));
+    mfree(p6);
+    mfree(p1);
+    assert(first_arena == NULL);
+    mmal_arena_counters(&mapped, &unmapped);
+    assert(mapped == 5);
+    assert(unmapped == 5);
+
+    /***********************************************************************/
+    // Male objekty dostanou slot ve slab arene, bez hlavicky a mimo areny
+    char *s1 = mmalloc(42);
+    char *s2 = mmalloc(42);
+    char *s3 = mmalloc(40);
+    assert(s1 != NULL && s2 != NULL && s3 != NULL);
+    assert(first_arena == NULL);
+    // Sloty stejne velikosti lezi hned za sebou
+    assert(s2 == s1 + 48);
+    assert(s3 == s2 + 48);
+    assert((size_t)s1 % 16 == 0);
+    memset(s1, 'a', 42);
+    memset(s2, 'b', 42);
+
+    // Uvolneny slot se pouzije znovu
+    mfree(s2);
+    assert(mmalloc(33) == s2);
+
+    // Slot se zvetsuje jen do sve velikosti, pak se data presunou
+    assert(mrealloc(s1, 48) == s1);
+    s1 = mrealloc(s1, 100);
+    assert(s1[0] == 'a' && s1[41] == 'a');
+    assert(first_arena == NULL);
+    s1 = mrealloc(s1, 1000);
+    assert(s1[0] == 'a' && s1[41] == 'a');
+    assert(first_arena != NULL);
+    mfree(s1);
+    mfree(s2);
+    mfree(s3);
+    // Prazdna slab arena se vraci systemu jako ostatni areny
+    mmal_arena_counters(&mapped, &unmapped);
+    assert(mapped == 7);
+    assert(unmapped == 7);
+
+    // Prazdne slab areny se drzi jen do limitu cache, zbytek vrati
+    // mmal_set_arena_cache()
+    static char *slots[4200];
+    mmal_set_arena_cache(1);
+    for (int i = 0; i < 4200; i++) {
+        slots[i] = mmalloc(256);
+        assert(slots[i] != NULL);
+        slots[i][255] = 's';
+    }
+    mmal_arena_counters(&mapped, &unmapped);
+    assert(mapped == 9);
+    for (int i = 0; i < 4200; i++)
+        mfree(slots[i]);
+    mmal_arena_counters(&mapped, &unmapped);
+    assert(unmapped == 8);
+    // Arena z cache se pouzije znovu
+    slots[0] = mmalloc(200);
+    mfree(slots[0]);
+    mmal_arena_counters(&mapped, &unmapped);
+    assert(mapped == 9 && unmapped == 8);
+    mmal_set_arena_cache(0);
+    mmal_arena_counters(&mapped, &unmapped);
+    assert(unmapped == 9);
+
+    /***********************************************************************/
+    // Zarovnane bloky se vykroji z areny, mezera pred nimi je volny blok
+    char *a1 = mmemalign(4096, 5000);
+    assert(a1 != NULL);
+    assert((size_t)a1 % 4096 == 0);
+    Header *ha = &((Header*)a1)[-1];
+    assert(ha->asize == 5000);
+    Header *slack = FIRST_HEADER(first_arena);
+    assert(slack != ha);
+    assert(!(slack->size & HDR_USED));
+    assert(next_hdr(slack) == ha);
+    memset(a1, 'z', 5000);
+
+    // Mezeru lze pouzit pro dalsi bloky
+    char *a2 = mmemalign(64, 300);
+    assert(a2 != NULL);
+    assert((size_t)a2 % 64 == 0);
+    assert(a2 < a1);
+
+    void *a3;
+    assert(mposix_memalign(&a3, 24, 100) != 0);
+    assert(mposix_memalign(&a3, 256, 1000) == 0);
+    assert((size_t)a3 % 256 == 0);
+    assert(maligned_alloc(3, 100) == NULL);
+
+    // Zarovnany blok jde zvetsit i uvolnit
+    a1 = mrealloc(a1, 6000);
+    assert(a1 != NULL);
+    assert(a1[0] == 'z' && a1[4999] == 'z');
+    debug_arenas(HERE "po zarovnanych alokacich");
+    mfree(a1);
+    mfree(a2);
+    mfree(a3);
+    // Nedavno uvolneny maly blok (a2) se neslucuje a drzi arenu, dokud
+    // se bloky nesluci
+    assert(first_arena != NULL);
+    mmal_set_arena_cache(0);
+    assert(first_arena == NULL);
+
+    // Velky zarovnany blok ma vlastni mapovani
+    char *a4 = mmemalign(PAGE_SIZE, PAGE_SIZE*2);
+    assert(a4 != NULL);
+    assert((size_t)a4 % PAGE_SIZE == 0);
+    assert(first_arena == NULL);
+    a4[PAGE_SIZE*2 - 1] = 'z';
+    a4 = mrealloc(a4, PAGE_SIZE*4);
+    assert(a4 != NULL && a4[PAGE_SIZE*2 - 1] == 'z');
+    mfree(a4);
+
+    /***********************************************************************/
+    // mcalloc vraci vynulovana data, i v drive pouzitem bloku
+    char *c0 = mmalloc(2000);
+    char *c1 = mmalloc(5000);
+    memset(c1, 0xff, 5000);
+    mfree(c1);
+    char *c2 = mcalloc(1000, 5);
+    assert(c2 == c1);
+    for (int i = 0; i < 5000; i++)
+        assert(c2[i] == 0);
+
+    // Zbytek areny nebyl nikdy pouzit, nuluji se jen metadata
+    char *c3 = mcalloc(10, 3000);
+    assert(c3 > c2);
+    for (int i = 0; i < 30000; i++)
+        assert(c3[i] == 0);
+
+    // Preteceni a nulova velikost
+    assert(mcalloc(SIZE_MAX / 2, 3) == NULL);
+    assert(mcalloc(0, 3) == NULL);
+
+    // Velky blok je primo z noveho mapovani
+    char *c4 = mcalloc(PAGE_SIZE, 2);
+    assert(c4 != NULL);
+    for (int i = 0; i < PAGE_SIZE*2; i += 512)
+        assert(c4[i] == 0);
+    debug_arenas(HERE "po mcalloc");
+    mfree(c4);
+    mfree(c3);
+    mfree(c2);
+    mfree(c0);
+    assert(first_arena == NULL);
+
+    /***********************************************************************/
+    // Statistiky: vse uvolnene je vraceno systemu
+    MmalStats st0, st;
+    mmal_stats(&st0);
+    assert(st0.mapped == 0 && st0.in_use == 0 && st0.free == 0);
+    assert(st0.largest_free == 0 && st0.fragmentation == 0.0);
+    assert(st0.mmaps == st0.munmaps);
+
+    // Volny blok mezi dvema zabranymi a volny zbytek areny
+    char *t1 = mmalloc(3000);
+    char *t2 = mmalloc(3000);
+    char *t3 = mmalloc(3000);
+    mfree(t2);
+    mmal_stats(&st);
+    Header *ht2 = (Header *)(t2 - sizeof(Header));
+    Header *tail = next_hdr((Header *)(t3 - sizeof(Header)));
+    assert(st.mmaps == st0.mmaps + 1 && st.munmaps == st0.munmaps);
+    assert(st.mapped == st0.mapped + first_arena->size);
+    assert(st.mapped == st.in_use + st.free);
+    assert(st.free == st0.free + BLOCK_SIZE(ht2) + BLOCK_SIZE(tail));
+    assert(st.largest_free == BLOCK_SIZE(tail));
+    assert(st.fragmentation > 0.0 && st.fragmentation < 0.1);
+    size_t class = 0;
+    while (((size_t)2 << class) <= BLOCK_SIZE(ht2))
+        class++;
+    assert(st.free_blocks[class] == st0.free_blocks[class] + 1);
+
+    // Velky blok ma vlastni mapovani
+    char *t4 = mmalloc(PAGE_SIZE * 2);
+    mmal_stats(&st);
+    assert(st.mmaps == st0.mmaps + 2);
+    assert(st.in_use >= st0.in_use + PAGE_SIZE * 2);
+    mfree(t4);
+
+    mfree(t1);
+    mfree(t3);
+    mmal_stats(&st);
+    assert(first_arena == NULL);
+    assert(st.mapped == st0.mapped && st.free == st0.free);
+    assert(st.munmaps == st0.munmaps + 2);
+
+    /***********************************************************************/
+    // Velky blok, ktery nejde zmensit na miste (mremap selze), se presune
+    // do mensiho bloku, kopiruje se jen nova velikost
+    char *v1 = mmalloc(PAGE_SIZE * 4);
+    assert(v1 != NULL);
+    memset(v1, 'r', PAGE_SIZE * 4);
+    mremap_fails = 1;
+    char *v2 = mrealloc(v1, 1000);
+    mremap_fails = 0;
+    assert(v2 != NULL && v2 != v1);
+    assert(v2[0] == 'r' && v2[999] == 'r');
+    assert(first_arena != NULL);
+    mfree(v2);
+    assert(first_arena == NULL);
+
+    // Stejne u samostatne haldy
+    MmalHeap *rheap = mmal_heap_create();
+    assert(rheap != NULL);
+    v1 = mmal_heap_malloc(rheap, PAGE_SIZE * 4);
+    assert(v1 != NULL);
+    memset(v1, 'r', PAGE_SIZE * 4);
+    mremap_fails = 1;
+    v2 = mmal_heap_realloc(rheap, v1, 1000);
+    mremap_fails = 0;
+    assert(v2 != NULL && v2 != v1);
+    assert(v2[0] == 'r' && v2[999] == 'r');
+    mmal_heap_destroy(rheap);
+
+    /***********************************************************************/
+    // Slucovani pres hranicni znacky: bloky A-E mezi dvema zabranymi,
+    // volny blok ma paticku a nasledujici blok priznak HDR_PREV_FREE
+    char *m0 = mmalloc(2000);
+    char *ma = mmalloc(2000);
+    char *mb = mmalloc(2000);
+    char *mc = mmalloc(2000);
+    char *md = mmalloc(2000);
+    char *me = mmalloc(2000);
+    char *mf = mmalloc(2000);
+    assert(m0 && ma && mb && mc && md && me && mf);
+    Header *hma = &((Header*)ma)[-1];
+    Header *hmb = &((Header*)mb)[-1];
+    Header *hmc = &((Header*)mc)[-1];
+    Header *hmd = &((Header*)md)[-1];
+    Header *hmf = &((Header*)mf)[-1];
+    size_t mblock = BLOCK_SIZE(hma);
+    mfree(ma);
+    assert(!(hma->size & HDR_USED));
+    assert(hmb->size & HDR_PREV_FREE);
+    assert(PREV_FOOTER(hmb) == mblock);
+
+    // B se slouci s predchozim A
+    mfree(mb);
+    assert(BLOCK_SIZE(hma) == 2 * mblock);
+    assert(next_hdr(hma) == hmc);
+    assert(hmc->size & HDR_PREV_FREE);
+    assert(PREV_FOOTER(hmc) == 2 * mblock);
+
+    // D se slouci s nasledujicim E
+    mfree(me);
+    mfree(md);
+    assert(BLOCK_SIZE(hmd) == 2 * mblock);
+    assert(next_hdr(hmd) == hmf);
+    assert(!(hmd->size & HDR_PREV_FREE));
+    assert(hmf->size & HDR_PREV_FREE);
+    assert(PREV_FOOTER(hmf) == 2 * mblock);
+
+    // C se slouci s obema sousedy najednou
+    mfree(mc);
+    assert(BLOCK_SIZE(hma) == 5 * mblock);
+    assert(next_hdr(hma) == hmf);
+    assert(!(hma->size & (HDR_USED | HDR_PREV_FREE)));
+    assert(hmf->size & HDR_PREV_FREE);
+    assert(PREV_FOOTER(hmf) == 5 * mblock);
+    mfree(m0);
+    mfree(mf);
+    assert(first_arena == NULL);
+
+    // Posledni blok areny se nikdy neslouci s prvnim blokem dalsi areny
+    char *l0 = mmalloc(2000);
+    Header *rest_hdr = next_hdr(&((Header*)l0)[-1]);
+    char *l1 = mmalloc(BLOCK_SIZE(rest_hdr) - sizeof(Header));
+    Header *hl1 = &((Header*)l1)[-1];
+    assert(hl1 == rest_hdr);
+    assert(is_fence(next_hdr(hl1)));
+    size_t l1_block = BLOCK_SIZE(hl1);
+    char *n0 = mmalloc(2000);
+    char *n1 = mmalloc(2000);
+    assert(n0 != NULL && n1 != NULL);
+    assert(first_arena->next != NULL);
+    Header *hn0 = &((Header*)n0)[-1];
+    assert(hn0 == FIRST_HEADER(first_arena->next));
+    mfree(l1);
+    mfree(n0);
+    assert(BLOCK_SIZE(hl1) == l1_block);
+    assert(is_fence(next_hdr(hl1)));
+    assert(!(hn0->size & (HDR_USED | HDR_PREV_FREE)));
+    assert(next_hdr(hn0) == &((Header*)n1)[-1]);
+    mfree(l0);
+    mfree(n1);
+    assert(first_arena == NULL);
+
+    /***********************************************************************/
+    // Areny rostou spolu s haldou, 8 MiB se vejde do nekolika aren
+    static char *g[128];
+    size_t g_mapped, g_mapped0;
+    mmal_arena_counters(&g_mapped0, NULL);
+    for (int i = 0; i < 128; i++) {
+        g[i] = mmalloc(64*1024);
+        assert(g[i] != NULL);
+    }
+    mmal_arena_counters(&g_mapped, NULL);
+    assert(g_mapped - g_mapped0 <= 12);
+    for (Arena *a = first_arena; a->next != NULL; a = a->next)
+        assert(a->next->size >= a->size);
+    assert(first_arena->size == PAGE_SIZE);
+    for (int i = 0; i < 128; i++)
+        mfree(g[i]);
+    assert(first_arena == NULL);
+
+    /***********************************************************************/
+    // Areny s transparentnimi velkymi strankami jsou zarovnane na 2 MiB
+    mmal_set_arena_options(MMAL_ARENA_THP | MMAL_ARENA_POPULATE);
+    char *t5 = mmalloc(1000);
+    assert(first_arena->size == 2*1024*1024);
+    assert((uintptr_t)first_arena % (2*1024*1024) == 0);
+    memset(t5, 1, 1000);
+    mfree(t5);
+    assert(first_arena == NULL);
+
+    // Bez rezervovanych velkych stranek se pouziji obycejne
+    mmal_set_arena_options(MMAL_ARENA_HUGETLB);
+    char *t6 = mmalloc(1000);
+    assert(first_arena->size == 2*1024*1024);
+    memset(t6, 1, 1000);
+    mfree(t6);
+    assert(first_arena == NULL);
+    mmal_set_arena_options(0);
+
+    /***********************************************************************/
+    // Stranky velkych volnych bloku se vraci systemu po davkach
+    mmal_set_arena_options(MMAL_ARENA_THP);
+    mmal_set_purge_interval(SIZE_MAX);
+    char *u0 = mmalloc(2000);
+    char *u1 = mmalloc(100000);
+    char *u2 = mmalloc(100000);
+    char *u3 = mmalloc(2000);
+    memset(u1, 0xaa, 100000);
+    memset(u2, 0xbb, 100000);
+    mfree(u1);
+    Header *hu1 = (Header *)(u1 - sizeof(Header));
+    assert(!(hu1->size & HDR_PURGED));
+
+    // Po kazdem uvolneni: spojeny blok i nedotceny zbytek areny
+    mmal_set_purge_interval(0);
+    mfree(u2);
+    assert(!(hu1->size & HDR_USED) && (hu1->size & HDR_PURGED));
+    assert(next_hdr((Header *)(u3 - sizeof(Header)))->size & HDR_PURGED);
+
+    // Vraceny blok se znovu pouzije, mcalloc ho vynuluje
+    char *u4 = mcalloc(1, 120000);
+    assert(u4 == u1 && !(hu1->size & HDR_PURGED));
+    for (int i = 0; i < 120000; i++)
+        assert(u4[i] == 0);
+    mfree(u4);
+    mfree(u3);
+    mfree(u0);
+    assert(first_arena == NULL);
+    mmal_set_purge_interval(4*1024*1024);
+    mmal_set_arena_options(0);
+
+    /***********************************************************************/
+    // Davka bloku stejne velikosti lezi v arene jeden za druhym
+    void *batch[66];
+    assert(mmalloc_batch(500, 64, batch) == 64);
+    for (int i = 0; i < 64; i++) {
+        Header *hb = (Header *)((char *)batch[i] - sizeof(Header));
+        assert(hb->asize == 500 && (hb->size & HDR_USED));
+        if (i > 0)
+            assert((char *)batch[i] == (char *)batch[i - 1] + 512 + sizeof(Header));
+        memset(batch[i], i, 500);
+    }
+    assert(!(next_hdr((Header *)((char *)batch[63] - sizeof(Header)))->size & HDR_USED));
+
+    // Uvolneni v libovolnem poradi, i s NULL a velkym blokem
+    batch[64] = NULL;
+    batch[65] = mmalloc(PAGE_SIZE);
+    for (int i = 0; i < 33; i++) {
+        void *tmp = batch[i];
+        batch[i] = batch[65 - i];
+        batch[65 - i] = tmp;
+    }
+    mfree_batch(batch, 66);
+    assert(first_arena == NULL);
+
+    // Male objekty jsou ve slab arene, velke bloky maji vlastni mapovani
+    assert(mmalloc_batch(32, 16, batch) == 16);
+    for (int i = 1; i < 16; i++)
+        assert((char *)batch[i] == (char *)batch[i - 1] + 32);
+    mfree_batch(batch, 16);
+    assert(mmalloc_batch(PAGE_SIZE, 2, batch) == 2);
+    memset(batch[0], 1, PAGE_SIZE);
+    mfree_batch(batch, 2);
+    assert(mmalloc_batch(0, 4, batch) == 0);
+    mfree_batch(batch, 0);
+    assert(first_arena == NULL);
+
+    /***********************************************************************/
+    // Region: data lezi za sebou bez hlavicek, mimo seznam aren
+    size_t r_mapped, r_unmapped, r_mapped2, r_unmapped2;
+    MmalStats rs0, rs;
+    mmal_stats(&rs0);
+    mmal_arena_counters(&r_mapped, &r_unmapped);
+    MmalRegion *region = mmal_region_create();
+    assert(region != NULL && first_arena == NULL);
+    char *r1 = mmal_region_alloc(region, 10);
+    char *r2 = mmal_region_alloc(region, 100);
+    char *r3 = mmal_region_alloc(region, 16);
+    assert(r2 == r1 + 16 && r3 == r2 + 112);
+    assert(mmal_region_alloc(region, 0) == NULL);
+    assert(mmal_region_alloc(region, SIZE_MAX) == NULL);
+    mmal_stats(&rs);
+    assert(rs.mapped == rs0.mapped + PAGE_SIZE);
+
+    // Velka data dostanou novy chunk
+    char *r4 = mmal_region_alloc(region, 3 * PAGE_SIZE);
+    assert(r4 != NULL && (uintptr_t)r4 % MMAL_REGION_ALIGNMENT == 0);
+    memset(r4, 1, 3 * PAGE_SIZE);
+    mmal_arena_counters(&r_mapped2, NULL);
+    assert(r_mapped2 == r_mapped + 2);
+
+    // Po resetu se chunky pouziji znovu, nic dalsiho se nemapuje
+    mmal_region_reset(region);
+    assert(mmal_region_alloc(region, 10) == r1);
+    assert(mmal_region_alloc(region, 3 * PAGE_SIZE) == r4);
+    mmal_arena_counters(&r_mapped2, NULL);
+    assert(r_mapped2 == r_mapped + 2);
+
+    // Zruseni regionu vrati vsechny chunky
+    mmal_region_destroy(region);
+    mmal_arena_counters(&r_mapped2, &r_unmapped2);
+    assert(r_unmapped2 == r_unmapped + 2);
+    mmal_stats(&rs);
+    assert(rs.mapped == rs0.mapped && first_arena == NULL);
+
+    /***********************************************************************/
+    // Samostatna halda ma vlastni areny, vychozi halda zustava beze zmeny
+    MmalStats hs;
+    mmal_stats(&rs0);
+    MmalHeap *heap = mmal_heap_create();
+    assert(heap != NULL);
+    mmal_heap_stats(heap, &hs);
+    assert(hs.mapped == 0 && hs.mmaps == 0);
+    char *hp1 = mmal_heap_malloc(heap, 24);
+    char *hp2 = mmal_heap_malloc(heap, 3000);
+    char *hp3 = mmal_heap_malloc(heap, 2 * PAGE_SIZE);
+    assert(hp1 != NULL && hp2 != NULL && hp3 != NULL);
+    assert(mmal_heap_malloc(heap, 0) == NULL);
+    memset(hp1, 1, 24);
+    memset(hp2, 2, 3000);
+    memset(hp3, 3, 2 * PAGE_SIZE);
+    assert(first_arena == NULL);
+    mmal_stats(&rs);
+    assert(rs.mapped == rs0.mapped && rs.mmaps == rs0.mmaps);
+    mmal_heap_stats(heap, &hs);
+    assert(hs.mapped >= 2 * PAGE_SIZE && hs.mmaps == 3);
+
+    // Realokace presouva data jen v ramci haldy
+    hp1 = mmal_heap_realloc(heap, hp1, 1000);
+    hp2 = mmal_heap_realloc(heap, hp2, 6000);
+    assert(hp1[23] == 1 && hp2[2999] == 2);
+    mmal_heap_free(heap, hp1);
+    mmal_heap_free(heap, hp3);
+    assert(mmal_heap_realloc(heap, NULL, 100) != NULL);
+    assert(first_arena == NULL);
+
+    // Zruseni haldy vrati vse najednou, i neuvolnena data
+    mmal_heap_destroy(heap);
+    mmal_stats(&rs);
+    assert(rs.mapped == rs0.mapped && first_arena == NULL);
+    void *slab_ptr = mmalloc(24);
+    assert(slab_ptr != NULL);
+    mfree(slab_ptr);
+    assert(first_arena == NULL);
+
+    /***********************************************************************/
+    // Rychle seznamy: uvolneny maly blok se neslucuje se sousedy a dalsi
+    // alokace stejne velikosti ho dostane zpet (LIFO)
+    heap = mmal_heap_create();
+    assert(heap != NULL);
+    char *q1 = mmal_heap_malloc(heap, 500);
+    char *q2 = mmal_heap_malloc(heap, 500);
+    char *q3 = mmal_heap_malloc(heap, 500);
+    Header *hq3 = &((Header*)q3)[-1];
+    assert(q1 != NULL && q2 != NULL && q3 != NULL);
+    mmal_heap_free(heap, q2);
+    mmal_heap_free(heap, q3);
+    assert(hq3->size & HDR_USED);
+    assert(!(next_hdr(hq3)->size & HDR_USED));
+    assert(mmal_heap_malloc(heap, 500) == q3);
+    assert(mmal_heap_malloc(heap, 500) == q2);
+
+    // Kdyz alokace nenajde volny blok, seznamy se slouci drive, nez halda
+    // namapuje dalsi arenu
+    mmal_heap_stats(heap, &hs);
+    size_t quick_mmaps = hs.mmaps;
+    void *rest = mmal_heap_malloc(heap, hs.largest_free - sizeof(Header));
+    assert(rest != NULL);
+    mmal_heap_free(heap, q2);
+    mmal_heap_free(heap, q3);
+    assert(mmal_heap_malloc(heap, 900) == q2);
+    mmal_heap_stats(heap, &hs);
+    assert(hs.mmaps == quick_mmaps);
+
+    // Nad limitem (16 bloku jedne velikosti) se seznam slouci najednou
+    char *qs[17];
+    for (int i = 0; i < 17; i++) {
+        qs[i] = mmal_heap_malloc(heap, 500);
+        assert(qs[i] != NULL);
+    }
+    assert(mmal_heap_malloc(heap, 500) != NULL);
+    for (int i = 0; i < 17; i++) {
+        mmal_heap_free(heap, qs[i]);
+    }
+    Header *hqs = &((Header*)qs[0])[-1];
+    assert(!(hqs->size & HDR_USED));
+    assert(next_hdr(hqs) == &((Header*)qs[16])[-1]);
+    assert(next_hdr(hqs)->size & HDR_USED);
+    mmal_heap_destroy(heap);
+
+    /***********************************************************************/
+    // Biny: volny blok kazde tridy (presne biny pod SMALL_BIN_LIMIT i velke
+    // bloky nad ni) se najde drive nez zbytek areny
+    static const size_t bin_sizes[] = {300, 500, 992, 1008, 1500, 5000, 40000};
+    size_t bin_count = sizeof(bin_sizes) / sizeof(bin_sizes[0]);
+    char *bx[sizeof(bin_sizes) / sizeof(bin_sizes[0])];
+    heap = mmal_heap_create();
+    assert(heap != NULL);
+    // Mnoho zabranych bloku, ktere hledani nesmi prochazet
+    for (int i = 0; i < 64; i++) {
+        assert(mmal_heap_malloc(heap, 300) != NULL);
+    }
+    for (size_t i = 0; i < bin_count; i++) {
+        bx[i] = mmal_heap_malloc(heap, bin_sizes[i]);
+        assert(bx[i] != NULL);
+        assert(mmal_heap_malloc(heap, 300) != NULL);
+    }
+    for (size_t i = 0; i < bin_count; i++) {
+        mmal_heap_free(heap, bx[i]);
+    }
+    // Nedavno uvolnene male bloky se presunou do binu
+    mmal_set_arena_cache(0);
+    mmal_instrument_reset();
+    for (size_t i = bin_count; i-- > 0;) {
+        assert(mmal_heap_malloc(heap, bin_sizes[i]) == bx[i]);
+    }
+
+    // S instrumentaci: hledani navstivi jen nekolik volnych bloku (mene
+    // nez 8), nikdy zabrane bloky
+    MmalInstrument bin_ins;
+    if (mmal_instrument_read(&bin_ins) == 0) {
+        size_t bin_searches = 0;
+        for (int i = 0; i < MMAL_HISTOGRAM_BUCKETS; i++) {
+            bin_searches += bin_ins.search_visits[i];
+            assert(i < 4 || bin_ins.search_visits[i] == 0);
+        }
+        assert(bin_searches == bin_count);
+    }
+
+    // Kolem hranice presnych binu plati smlouva mmalloc/mfree: zarovnani,
+    // pouzitelna velikost, sousedni data zustavaji a blok se pouzije znovu
+    for (size_t size = 960; size <= 1072; size += 8) {
+        char *b = mmal_heap_malloc(heap, size);
+        char *n = mmal_heap_malloc(heap, 300);
+        assert(b != NULL && n != NULL);
+        assert((size_t)b % ALIGNMENT == 0);
+        assert(mmal_usable_size(b) >= size);
+        memset(n, 'n', 300);
+        memset(b, 'b', mmal_usable_size(b));
+        assert(n[0] == 'n' && n[299] == 'n');
+        mmal_heap_free(heap, b);
+        assert(mmal_heap_malloc(heap, size) == b);
+        mmal_heap_free(heap, b);
+    }
+    mmal_heap_destroy(heap);
+
+    /***********************************************************************/
+    // Strategie umisteni velkych bloku: volne bloky A (4000), C (2000)
+    // a E (4000) oddelene malymi pouzitymi bloky
+    heap = mmal_heap_create();
+    assert(heap != NULL);
+    char *fa = mmal_heap_malloc(heap, 4000);
+    assert(mmal_heap_malloc(heap, 500) != NULL);
+    char *fc = mmal_heap_malloc(heap, 2000);
+    assert(mmal_heap_malloc(heap, 500) != NULL);
+    char *fe = mmal_heap_malloc(heap, 4000);
+    assert(mmal_heap_malloc(heap, 500) != NULL);
+    assert(fa != NULL && fc != NULL && fe != NULL);
+    mmal_heap_free(heap, fa);
+    mmal_heap_free(heap, fc);
+    mmal_heap_free(heap, fe);
+
+    // Best fit (vychozi): nejmensi dostatecne velky blok
+    char *fx = mmal_heap_malloc(heap, 1500);
+    assert(fx == fc);
+    mmal_heap_free(heap, fx);
+
+    // First fit: blok s nejnizsi adresou
+    assert(mmal_heap_set_fit_policy(heap, MMAL_FIT_FIRST) == 0);
+    fx = mmal_heap_malloc(heap, 1500);
+    assert(fx == fa);
+    mmal_heap_free(heap, fx);
+
+    // Next fit: hledani pokracuje od naposledy nalezeneho bloku
+    assert(mmal_heap_set_fit_policy(heap, MMAL_FIT_NEXT) == 0);
+    char *fx1 = mmal_heap_malloc(heap, 1500);
+    char *fx2 = mmal_heap_malloc(heap, 1500);
+    assert(fx1 == fa);
+    assert(fx2 == fx1 + 1504 + sizeof(Header));
+    mmal_heap_free(heap, fx1);
+    char *fx3 = mmal_heap_malloc(heap, 1500);
+    assert(fx3 == fc);
+    mmal_heap_free(heap, fx2);
+    mmal_heap_free(heap, fx3);
+
+    // Good fit: blok z velikostni tridy pozadavku, neznama strategie je chyba
+    assert(mmal_heap_set_fit_policy(heap, MMAL_FIT_GOOD) == 0);
+    fx = mmal_heap_malloc(heap, 1900);
+    assert(fx == fc);
+    assert(mmal_heap_set_fit_policy(heap, 4) == -1);
+    mmal_heap_destroy(heap);
+
+    /***********************************************************************/
+    // Profiler: vzorkovana data maji vlastni mapovani, profil obsahuje
+    // jejich velikosti a zasobniky volani
+    char profile[4096];
+    mmal_stats(&rs0);
+    mmal_set_sample_interval(1);
+    char *sp1 = mmalloc(100);
+    char *sp2 = mmalloc(5000);
+    char *sp3 = mcalloc(10, 10);
+    mmal_set_sample_interval(0);
+    assert(sp1 != NULL && sp2 != NULL && sp3 != NULL);
+    assert(sp3[0] == 0 && sp3[99] == 0);
+    assert(first_arena == NULL);
+    FILE *f = tmpfile();
+    assert(f != NULL);
+    assert(mmal_profile_dump(fileno(f)) == 0);
+    rewind(f);
+    size_t length = fread(profile, 1, sizeof(profile) - 1, f);
+    profile[length] = '\0';
+    fclose(f);
+    assert(strncmp(profile, "heap profile: 3: 5200 [3: 5200] @ heap_v2/1\n1: 100 [1: 100] @ 0x", 64) == 0);
+    assert(strstr(profile, "\n1: 5000 [1: 5000] @ 0x") != NULL);
+    assert(strstr(profile, "\nMAPPED_LIBRARIES:\n") != NULL);
+
+    // Uvolnena data z profilu zmizi, zvetsena na miste zmeni velikost
+    mfree(sp1);
+    sp2 = mrealloc(sp2, 6000);
+    mfree(sp3);
+    f = tmpfile();
+    assert(f != NULL);
+    assert(mmal_profile_dump(fileno(f)) == 0);
+    rewind(f);
+    length = fread(profile, 1, sizeof(profile) - 1, f);
+    profile[length] = '\0';
+    fclose(f);
+    assert(strncmp(profile, "heap profile: 1: 6000 [3: 6200] @ heap_v2/1\n1: 6000 [1: 6000] @ 0x", 64) == 0);
+    mfree(sp2);
+    mmal_stats(&rs);
+    assert(rs.mapped == rs0.mapped);
+
+    // Na signal profil zapise nejblizsi alokace
+    const char *profile_path = "/tmp/test_mmal.heap";
+    unlink(profile_path);
+    assert(mmal_profile_signal(SIGUSR2, profile_path) == 0);
+    raise(SIGUSR2);
+    void *big = mmalloc(2 * 1024 * 1024);
+    assert(big != NULL);
+    mfree(big);
+    f = fopen(profile_path, "r");
+    assert(f != NULL);
+    assert(fgets(profile, sizeof(profile), f) != NULL);
+    assert(strcmp(profile, "heap profile: 0: 0 [3: 6200] @ heap_v2/1\n") == 0);
+    fclose(f);
+    unlink(profile_path);
+
+    /***********************************************************************/
+    // Instrumentace (jen s MMAL_INSTRUMENT): histogramy latenci a delek
+    // hledani volnych bloku, pocty volani systemu
+    MmalInstrument ins;
+    if (mmal_instrument_read(&ins) == 0) {
+        mmal_instrument_reset();
+        void *ip[10];
+        for (int i = 0; i < 10; i++) {
+            ip[i] = mmalloc(2000);
+            assert(ip[i] != NULL);
+        }
+        ip[0] = mrealloc(ip[0], 100000);
+        assert(ip[0] != NULL);
+        for (int i = 0; i < 10; i++) {
+            mfree(ip[i]);
+        }
+        big = mmalloc(1024 * 1024);
+        assert(big != NULL);
+        mfree(big);
+
+        assert(mmal_instrument_read(&ins) == 0);
+        size_t mallocs = 0, frees = 0, reallocs = 0, searches = 0;
+        for (int i = 0; i < MMAL_HISTOGRAM_BUCKETS; i++) {
+            mallocs += ins.malloc_ns[i];
+            frees += ins.free_ns[i];
+            reallocs += ins.realloc_ns[i];
+            searches += ins.search_visits[i];
+        }
+        // Vnorena volani mrealloc() se nemeri znovu
+        assert(mallocs == 11 && frees == 11 && reallocs == 1);
+        assert(searches >= 10);
+        assert(ins.mmaps >= 1 && ins.munmaps >= 1);
+
+        f = tmpfile();
+        assert(f != NULL);
+        assert(mmal_instrument_dump(fileno(f)) == 0);
+        rewind(f);
+        length = fread(profile, 1, sizeof(profile) - 1, f);
+        profile[length] = '\0';
+        fclose(f);
+        assert(strncmp(profile, "mmalloc ns: count 11, p50 < ", 28) == 0);
+        assert(strstr(profile, "\nmfree ns: count 11, ") != NULL);
+        assert(strstr(profile, "\nmrealloc ns: count 1, ") != NULL);
+        assert(strstr(profile, "\nmmap: ") != NULL);
+    } else {
+        assert(mmal_instrument_dump(STDOUT_FILENO) == -1);
+    }
+
     return 0;
 }
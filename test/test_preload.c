@@ -0,0 +1,146 @@
+/**
+ * @file test_preload.c
+ * Test of libmmal.so. The program uses only the standard malloc family
+ * and is run with LD_PRELOAD=bin/libmmal.so, so the C library (stdio,
+ * strdup, threads) allocates through My MALloc too.
+ *
+ * Usage: LD_PRELOAD=bin/libmmal.so test_preload
+ */
+#undef NDEBUG
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/// Number of threads allocating at the same time
+#define THREADS 4
+/// Number of malloc/free operations done by every thread
+#define OPS_PER_THREAD 200000
+/// Number of blocks a thread keeps allocated at the same time
+#define SLOTS 128
+
+/**
+ * Allocates, reallocates and frees blocks, every block is filled with
+ * a byte specific for the thread, so overlapping blocks are detected.
+ */
+static void *worker(void *arg)
+{
+    unsigned char mark = (unsigned char)(uintptr_t)arg;
+    unsigned state = 1 + mark;
+    unsigned char *slots[SLOTS] = {NULL};
+    size_t sizes[SLOTS] = {0};
+
+    for (int op = 0; op < OPS_PER_THREAD; op++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        int i = state % SLOTS;
+        if (slots[i] != NULL) {
+            for (size_t k = 0; k < sizes[i]; k++)
+                assert(slots[i][k] == mark);
+            if (op % 3 == 0) {
+                sizes[i] = 1 + state % 2000;
+                slots[i] = realloc(slots[i], sizes[i]);
+                assert(slots[i] != NULL);
+                memset(slots[i], mark, sizes[i]);
+            } else {
+                free(slots[i]);
+                slots[i] = NULL;
+            }
+        } else {
+            sizes[i] = 1 + state % 2000;
+            slots[i] = malloc(sizes[i]);
+            assert(slots[i] != NULL);
+            memset(slots[i], mark, sizes[i]);
+        }
+    }
+
+    for (int i = 0; i < SLOTS; i++)
+        free(slots[i]);
+    return NULL;
+}
+
+int main()
+{
+    // Knihovna je opravdu nactena
+    assert(dlsym(RTLD_DEFAULT, "mmal_usable_size") != NULL);
+
+    // Zakladni funkce
+    char *p = malloc(100);
+    assert(p != NULL && (uintptr_t)p % 16 == 0);
+    assert(malloc_usable_size(p) >= 100);
+    strcpy(p, "hello");
+    p = realloc(p, 100000);
+    assert(p != NULL && strcmp(p, "hello") == 0);
+    free(p);
+    free(NULL);
+
+    void *z = malloc(0);
+    assert(z != NULL);
+    free(z);
+
+    unsigned char *c = calloc(1000, 8);
+    assert(c != NULL);
+    for (int i = 0; i < 8000; i++)
+        assert(c[i] == 0);
+    free(c);
+    volatile size_t count = SIZE_MAX / 2;
+    errno = 0;
+    assert(calloc(count, 4) == NULL && errno == ENOMEM);
+
+    // Zarovnane alokace
+    void *a = NULL;
+    assert(posix_memalign(&a, 64, 1000) == 0 && (uintptr_t)a % 64 == 0);
+    free(a);
+    assert(posix_memalign(&a, 24, 1000) == EINVAL);
+    a = aligned_alloc(4096, 10000);
+    assert(a != NULL && (uintptr_t)a % 4096 == 0);
+    free(a);
+    a = memalign(256, 300);
+    assert(a != NULL && (uintptr_t)a % 256 == 0);
+    free(a);
+    // memalign zaokrouhli zarovnani na mocninu dvou, aligned_alloc ne
+    a = memalign(48, 300);
+    assert(a != NULL && (uintptr_t)a % 64 == 0);
+    free(a);
+    errno = 0;
+    assert(aligned_alloc(48, 300) == NULL && errno == EINVAL);
+
+    // Knihovna C alokuje pres My MALloc
+    char *s = strdup("My MALloc");
+    assert(s != NULL && malloc_usable_size(s) >= 10);
+    free(s);
+    char *line = NULL;
+    assert(asprintf(&line, "%d + %d", 1, 2) > 0 && strcmp(line, "1 + 2") == 0);
+    free(line);
+
+    // Vlakna
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; i++)
+        assert(pthread_create(&threads[i], NULL, worker, (void *)(uintptr_t)(i + 1)) == 0);
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    // Potomek fork() muze alokovat
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        worker((void *)(uintptr_t)(THREADS + 1));
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    printf("test_preload: OK\n");
+    return 0;
+}
@@ -0,0 +1,359 @@
+/**
+ * @file test_threads.c
+ * Multi-threaded test of My MALloc built with MMAL_THREADS. Checks that
+ * concurrent allocations don't overlap, with the default heap and with
+ * a heap per thread, and that blocks can be freed by another thread (also
+ * to a heap owned by the allocating thread), and that fork() works while
+ * another thread allocates. Throughput scaling is measured by
+ * bench_threads.
+ *
+ * Usage: test_threads [threads]
+ */
+#undef NDEBUG
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "../src/mmal.h"
+
+/// Number of mmalloc/mfree operations done by every thread
+#define OPS_PER_THREAD 200000
+/// Number of blocks a thread keeps allocated at the same time
+#define SLOTS 256
+/// Number of blocks passed from the producer to the consumer
+#define REMOTE_BLOCKS 100000
+/// Number of fork() calls while another thread allocates
+#define FORKS 200
+/// Number and size of huge blocks (with their own mappings) freed remotely
+#define HUGE_BLOCKS 16
+#define HUGE_SIZE (1 << 20)
+
+/**
+ * Simple and fast pseudo-random generator (xorshift)
+ */
+static unsigned rand_next(unsigned *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+/**
+ * Allocates and frees random small blocks. Every block is filled with
+ * a byte specific for the thread, so overlapping blocks are detected.
+ */
+static void *worker(void *arg)
+{
+    unsigned id = (unsigned)(size_t)arg;
+    unsigned state = 2463534242u + id;
+    unsigned char *slots[SLOTS] = {NULL};
+    size_t sizes[SLOTS] = {0};
+    unsigned char mark = (unsigned char)(id + 1);
+
+    for (int op = 0; op < OPS_PER_THREAD; op++) {
+        unsigned i = rand_next(&state) % SLOTS;
+        if (slots[i] != NULL) {
+            assert(slots[i][0] == mark);
+            assert(slots[i][sizes[i] - 1] == mark);
+            mfree(slots[i]);
+            slots[i] = NULL;
+        } else {
+            unsigned r = rand_next(&state);
+            sizes[i] = (r % 16 == 0) ? 1 + r % 4096 : 1 + r % 256;
+            slots[i] = mmalloc(sizes[i]);
+            assert(slots[i] != NULL);
+            memset(slots[i], mark, sizes[i]);
+        }
+    }
+
+    for (int i = 0; i < SLOTS; i++) {
+        if (slots[i] != NULL) {
+            mfree(slots[i]);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Same as worker(), but with its own heap. Blocks left at the end are
+ * freed by destroying the heap.
+ */
+static void *heap_worker(void *arg)
+{
+    unsigned id = (unsigned)(size_t)arg;
+    unsigned state = 2463534242u + id;
+    unsigned char *slots[SLOTS] = {NULL};
+    size_t sizes[SLOTS] = {0};
+    unsigned char mark = (unsigned char)(id + 1);
+    MmalHeap *heap = mmal_heap_create();
+    assert(heap != NULL);
+
+    for (int op = 0; op < OPS_PER_THREAD; op++) {
+        unsigned i = rand_next(&state) % SLOTS;
+        if (slots[i] != NULL) {
+            assert(slots[i][0] == mark);
+            assert(slots[i][sizes[i] - 1] == mark);
+            mmal_heap_free(heap, slots[i]);
+            slots[i] = NULL;
+        } else {
+            unsigned r = rand_next(&state);
+            sizes[i] = (r % 16 == 0) ? 1 + r % 4096 : 1 + r % 256;
+            slots[i] = mmal_heap_malloc(heap, sizes[i]);
+            assert(slots[i] != NULL);
+            memset(slots[i], mark, sizes[i]);
+        }
+    }
+
+    mmal_heap_destroy(heap);
+
+    return NULL;
+}
+
+/// Set when fork_worker() should stop
+static int forks_done;
+
+/**
+ * Allocates and frees blocks too big for the thread cache, until
+ * forks_done is set.
+ */
+static void *fork_worker(void *arg)
+{
+    (void)arg;
+    while (!__atomic_load_n(&forks_done, __ATOMIC_ACQUIRE)) {
+        void *ptr = mmalloc(4000);
+        assert(ptr != NULL);
+        mfree(ptr);
+    }
+
+    return NULL;
+}
+
+/**
+ * Allocates blocks for the consumer.
+ */
+static void *producer(void *arg)
+{
+    void **blocks = arg;
+    for (int i = 0; i < REMOTE_BLOCKS; i++) {
+        blocks[i] = mmalloc(16 + i % 512);
+        assert(blocks[i] != NULL);
+        memset(blocks[i], 0xab, 16);
+    }
+
+    return NULL;
+}
+
+/**
+ * Frees blocks allocated by the producer.
+ */
+static void *consumer(void *arg)
+{
+    void **blocks = arg;
+    for (int i = 0; i < REMOTE_BLOCKS; i++) {
+        assert(((unsigned char *)blocks[i])[15] == 0xab);
+        mfree(blocks[i]);
+    }
+
+    return NULL;
+}
+
+/// Heap of heap_producer() and the number of its blocks published so far
+static MmalHeap *remote_heap;
+static int published;
+
+/**
+ * Allocates blocks from its own heap for heap_consumer().
+ */
+static void *heap_producer(void *arg)
+{
+    void **blocks = arg;
+    for (int i = 0; i < REMOTE_BLOCKS; i++) {
+        blocks[i] = mmal_heap_malloc(remote_heap, 16 + i % 512);
+        assert(blocks[i] != NULL);
+        memset(blocks[i], 0xcd, 16);
+        __atomic_store_n(&published, i + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * Frees blocks of heap_producer() while it's still allocating. They are
+ * queued, the producer frees them on its next allocations.
+ */
+static void *heap_consumer(void *arg)
+{
+    void **blocks = arg;
+    for (int i = 0; i < REMOTE_BLOCKS; i++) {
+        while (__atomic_load_n(&published, __ATOMIC_ACQUIRE) <= i) {
+            sched_yield();
+        }
+        assert(((unsigned char *)blocks[i])[15] == 0xcd);
+        mmal_heap_free(remote_heap, blocks[i]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Frees the published huge blocks of remote_heap.
+ */
+static void *huge_consumer(void *arg)
+{
+    void **blocks = arg;
+    for (int i = 0; i < published; i++) {
+        assert(((unsigned char *)blocks[i])[HUGE_SIZE - 1] == 0xef);
+        mmal_heap_free(remote_heap, blocks[i]);
+    }
+
+    return NULL;
+}
+
+/**
+ * Checks whether the page of the data is mapped.
+ */
+static int is_mapped(void *ptr)
+{
+    uintptr_t page = (uintptr_t)ptr & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+    unsigned char vec;
+    if (mincore((void *)page, 1, &vec) == 0) {
+        return 1;
+    }
+    assert(errno == ENOMEM);
+    return 0;
+}
+
+/**
+ * Runs the work in the given number of threads.
+ */
+static void run_workers(void *(*work)(void *), int threads)
+{
+    pthread_t tids[threads];
+    for (int i = 0; i < threads; i++) {
+        int rc = pthread_create(&tids[i], NULL, work, (void *)(size_t)i);
+        assert(rc == 0);
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc > 1) {
+        threads = atoi(argv[1]);
+    }
+    if (threads < 2) {
+        threads = 2;
+    }
+
+    /***********************************************************************/
+    // fork() behem alokaci jineho vlakna, pred prvni alokaci malych bloku
+    // (ta by zaregistrovala cache vlakna), potomek muze alokovat
+    pthread_t prod, cons;
+    pthread_create(&prod, NULL, fork_worker, NULL);
+    for (int i = 0; i < FORKS; i++) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            // Zablokovany potomek ukonci signal
+            alarm(5);
+            void *ptr = mmalloc(4000);
+            mfree(ptr);
+            _exit(ptr != NULL ? 0 : 1);
+        }
+        int status;
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    __atomic_store_n(&forks_done, 1, __ATOMIC_RELEASE);
+    pthread_join(prod, NULL);
+
+    /***********************************************************************/
+    // Bloky alokovane jednim vlaknem a uvolnene jinym
+    static void *blocks[REMOTE_BLOCKS];
+    pthread_create(&prod, NULL, producer, blocks);
+    pthread_join(prod, NULL);
+    pthread_create(&cons, NULL, consumer, blocks);
+    pthread_join(cons, NULL);
+
+    /***********************************************************************/
+    // Bloky vlastni haldy uvolnene jinym vlaknem cekaji ve fronte, vlastnik
+    // je uvolni pri dalsi alokaci
+    remote_heap = mmal_heap_create();
+    assert(remote_heap != NULL);
+    pthread_create(&prod, NULL, heap_producer, blocks);
+    pthread_create(&cons, NULL, heap_consumer, blocks);
+    pthread_join(prod, NULL);
+    pthread_join(cons, NULL);
+    mmal_heap_destroy(remote_heap);
+
+    // Fronta se vyprazdni i pri zjistovani statistik
+    MmalStats before, after;
+    remote_heap = mmal_heap_create();
+    assert(remote_heap != NULL);
+    for (int i = 0; i < REMOTE_BLOCKS; i++) {
+        blocks[i] = mmal_heap_malloc(remote_heap, 16 + i % 512);
+        assert(blocks[i] != NULL);
+        memset(blocks[i], 0xcd, 16);
+    }
+    mmal_heap_stats(remote_heap, &before);
+    published = REMOTE_BLOCKS;
+    pthread_create(&cons, NULL, heap_consumer, blocks);
+    pthread_join(cons, NULL);
+    mmal_heap_stats(remote_heap, &after);
+    assert(after.in_use < before.in_use / 4);
+    mmal_heap_destroy(remote_heap);
+
+    // Velke bloky s vlastnim mapovanim jsou ve fronte take, mapovani
+    // zrusi az vlastnik haldy
+    remote_heap = mmal_heap_create();
+    assert(remote_heap != NULL);
+    for (int i = 0; i < HUGE_BLOCKS; i++) {
+        blocks[i] = mmal_heap_malloc(remote_heap, HUGE_SIZE);
+        assert(blocks[i] != NULL);
+        memset(blocks[i], 0xef, HUGE_SIZE);
+    }
+    mmal_heap_stats(remote_heap, &before);
+    published = HUGE_BLOCKS;
+    pthread_create(&cons, NULL, huge_consumer, blocks);
+    pthread_join(cons, NULL);
+    for (int i = 0; i < HUGE_BLOCKS; i++)
+        assert(is_mapped(blocks[i]));
+    mmal_heap_stats(remote_heap, &after);
+    assert(after.munmaps == before.munmaps + HUGE_BLOCKS);
+    assert(after.in_use + HUGE_BLOCKS * HUGE_SIZE <= before.in_use);
+    for (int i = 0; i < HUGE_BLOCKS; i++)
+        assert(!is_mapped(blocks[i]));
+
+    // Vlastnik je uvolni i pri alokaci dalsiho velkeho bloku
+    blocks[0] = mmal_heap_malloc(remote_heap, HUGE_SIZE);
+    assert(blocks[0] != NULL);
+    memset(blocks[0], 0xef, HUGE_SIZE);
+    published = 1;
+    pthread_create(&cons, NULL, huge_consumer, blocks);
+    pthread_join(cons, NULL);
+    assert(is_mapped(blocks[0]));
+    blocks[1] = mmal_heap_malloc(remote_heap, HUGE_SIZE);
+    assert(blocks[1] != NULL);
+    assert(!is_mapped(blocks[0]));
+    mmal_heap_destroy(remote_heap);
+
+    /***********************************************************************/
+    // Soubezne alokace se neprekryvaji, vlakna sdili vychozi haldu, nebo ma
+    // kazde svou
+    run_workers(worker, threads);
+    run_workers(heap_worker, threads);
+
+    return 0;
+}